@@ -0,0 +1,395 @@
+/*
+ * Greybus Simulator: asynchronous I/O on the CPort endpoints
+ *
+ * Copyright 2015 Google Inc.
+ * Copyright 2015 Linaro Ltd.
+ *
+ * Provided under the three clause BSD license found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <linux/aio_abi.h>
+
+#include "gbsim.h"
+
+/*
+ * FunctionFS endpoint files support Linux AIO. Instead of a blocking
+ * read() on from_ap and a blocking write() on to_ap per message, keep
+ * aio_depth reads queued on each bulk-OUT endpoint and up to aio_depth
+ * writes in flight on the bulk-IN endpoints. Completions are signalled
+ * through an eventfd and reaped by a single thread, which frames the
+ * received data for the CPort workers and returns written buffers to the
+ * transmit pool. Each bulk-OUT endpoint is a stream of its own, with its
+ * own framer. There is one such set of queues, for the first bridge: -a
+ * is only accepted with a single bridge.
+ */
+#define AIO_EVENTS_MAX		64
+
+struct ffs_aio_req {
+	struct iocb		iocb;
+	struct ffs_aio_req	*next;
+	int			pair;
+	char			*buf;
+	struct gbsim_txbuf	*tb;
+};
+
+static struct gbsim_bridge *aio_bridge;
+static aio_context_t ctx;
+static int aio_efd = -1;
+static bool aio_running;
+static pthread_t aio_pthread;
+
+static struct ffs_aio_req *rx_reqs;
+static struct ffs_aio_req *tx_reqs;
+static struct ffs_aio_req *tx_free;
+static pthread_mutex_t tx_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tx_cond = PTHREAD_COND_INITIALIZER;
+
+static struct gbsim_framer rx_framers[GBSIM_EP_PAIRS_MAX];
+
+static inline int io_setup(unsigned nr, aio_context_t *ctxp)
+{
+	return syscall(__NR_io_setup, nr, ctxp);
+}
+
+static inline int io_destroy(aio_context_t ctxp)
+{
+	return syscall(__NR_io_destroy, ctxp);
+}
+
+static inline int io_submit(aio_context_t ctxp, long nr, struct iocb **iocbpp)
+{
+	return syscall(__NR_io_submit, ctxp, nr, iocbpp);
+}
+
+static inline int io_getevents(aio_context_t ctxp, long min_nr, long max_nr,
+			       struct io_event *events,
+			       struct timespec *timeout)
+{
+	return syscall(__NR_io_getevents, ctxp, min_nr, max_nr, events,
+		       timeout);
+}
+
+static void ffs_aio_prep(struct ffs_aio_req *req, int fd, uint16_t opcode,
+			 size_t nbytes)
+{
+	memset(&req->iocb, 0, sizeof(req->iocb));
+	req->iocb.aio_data = (uintptr_t)req;
+	req->iocb.aio_lio_opcode = opcode;
+	req->iocb.aio_fildes = fd;
+	req->iocb.aio_buf = (uintptr_t)req->buf;
+	req->iocb.aio_nbytes = nbytes;
+	req->iocb.aio_flags = IOCB_FLAG_RESFD;
+	req->iocb.aio_resfd = aio_efd;
+}
+
+static int ffs_aio_submit(struct ffs_aio_req *req)
+{
+	struct iocb *iocbp = &req->iocb;
+	int ret;
+
+	ret = io_submit(ctx, 1, &iocbp);
+	if (ret < 0)
+		return -errno;
+
+	return 0;
+}
+
+static int ffs_aio_submit_read(struct ffs_aio_req *req)
+{
+	ffs_aio_prep(req, aio_bridge->from_ap[req->pair], IOCB_CMD_PREAD,
+		     rx_size);
+
+	return ffs_aio_submit(req);
+}
+
+/*
+ * Frame a completed read for the CPort workers. Messages are framed in
+ * place in the request buffer, unless a message split by an earlier read
+ * is still waiting to be completed. What is carried over is less than a
+ * message, so with room for a message and a read the carry never overruns.
+ */
+static void ffs_aio_rx_complete(struct ffs_aio_req *req, size_t nbytes)
+{
+	struct gbsim_framer *rx_framer = &rx_framers[req->pair];
+	struct gbsim_framer f = {
+		.bridge = aio_bridge,
+		.buf = req->buf,
+		.size = rx_size,
+		.len = 0,
+	};
+
+	if (rx_framer->len) {
+		memcpy(rx_framer->buf + rx_framer->len, req->buf, nbytes);
+		rx_frame(rx_framer, nbytes);
+		return;
+	}
+
+	rx_frame(&f, nbytes);
+	if (f.len) {
+		memcpy(rx_framer->buf, f.buf, f.len);
+		rx_framer->len = f.len;
+	}
+}
+
+static void ffs_aio_tx_complete(struct ffs_aio_req *req)
+{
+	struct gbsim_txbuf *tb = req->tb;
+
+	/* Taken first, so a cancelled thread never leaves it to be freed twice */
+	req->tb = NULL;
+	txbuf_release(tb);
+
+	pthread_mutex_lock(&tx_lock);
+	req->next = tx_free;
+	tx_free = req;
+	pthread_cond_signal(&tx_cond);
+	pthread_mutex_unlock(&tx_lock);
+}
+
+static void *ffs_aio_thread(void *param)
+{
+	struct io_event events[AIO_EVENTS_MAX];
+	struct timespec timeout = { 0, 0 };
+	struct ffs_aio_req *req;
+	uint64_t ready;
+	int i, n, ret;
+
+	while (1) {
+		/* Blocks until at least one request has completed */
+		if (read(aio_efd, &ready, sizeof(ready)) != sizeof(ready)) {
+			if (errno == EINTR)
+				continue;
+			gbsim_error("aio eventfd read: %s\n", strerror(errno));
+			return NULL;
+		}
+
+		while (ready) {
+			n = io_getevents(ctx, 1, AIO_EVENTS_MAX, events,
+					 &timeout);
+			if (n <= 0)
+				break;
+			ready = ready > n ? ready - n : 0;
+
+			for (i = 0; i < n; i++) {
+				req = (struct ffs_aio_req *)(uintptr_t)events[i].data;
+				ret = events[i].res;
+
+				if (req->iocb.aio_lio_opcode == IOCB_CMD_PWRITE) {
+					if (ret < 0)
+						gbsim_error("error %d sending to AP\n",
+							    ret);
+					ffs_aio_tx_complete(req);
+					continue;
+				}
+
+				/* Warm restart: requeue for when the link is back */
+				if (ret == -ESHUTDOWN && warm_restart) {
+					rx_framers[req->pair].len = 0;
+					ret = 0;
+				} else if (ret < 0) {
+					gbsim_error("error %d receiving from AP\n",
+						    ret);
+					return NULL;
+				}
+
+				ffs_aio_rx_complete(req, ret);
+
+				ret = ffs_aio_submit_read(req);
+				if (ret < 0) {
+					gbsim_error("failed to requeue read (%d)\n",
+						    ret);
+					return NULL;
+				}
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Queue a pooled buffer for the AP, waiting for an earlier write to
+ * complete if aio_depth of them are already in flight. The buffer is
+ * written in place and released when the write completes.
+ */
+int ffs_aio_write(struct gbsim_txbuf *tb, size_t size)
+{
+	struct ffs_aio_req *req;
+	int ret;
+
+	pthread_mutex_lock(&tx_lock);
+	while (aio_running && !tx_free)
+		pthread_cond_wait(&tx_cond, &tx_lock);
+	if (!aio_running) {
+		pthread_mutex_unlock(&tx_lock);
+		txbuf_release(tb);
+		return -ESHUTDOWN;
+	}
+	req = tx_free;
+	tx_free = req->next;
+
+	req->tb = tb;
+	req->buf = tb->buf;
+	ffs_aio_prep(req, aio_bridge->to_ap[ep_pair(tb->hd_cport_id)],
+		     IOCB_CMD_PWRITE, size);
+	ret = ffs_aio_submit(req);
+	if (ret < 0) {
+		req->tb = NULL;
+		req->next = tx_free;
+		tx_free = req;
+	}
+	pthread_mutex_unlock(&tx_lock);
+
+	if (ret < 0)
+		txbuf_release(tb);
+
+	return ret;
+}
+
+/*
+ * Give the buffers of writes that were never reaped back to the pool; the
+ * workers would run out of them after a few disables otherwise. Whether
+ * they reached the AP is not known, so no response among them is timed.
+ */
+static void ffs_aio_tx_drain(void)
+{
+	struct gbsim_txbuf *tb;
+	int i;
+
+	for (i = 0; tx_reqs && i < aio_depth; i++) {
+		tb = tx_reqs[i].tb;
+		if (!tb)
+			continue;
+		tx_reqs[i].tb = NULL;
+		tb->rx_ns = 0;
+		txbuf_release(tb);
+	}
+}
+
+static void ffs_aio_free(void)
+{
+	int i;
+
+	for (i = 0; rx_reqs && i < aio_depth * ep_pairs; i++)
+		free(rx_reqs[i].buf);
+	free(rx_reqs);
+	rx_reqs = NULL;
+	free(tx_reqs);
+	tx_reqs = NULL;
+	tx_free = NULL;
+	for (i = 0; i < ep_pairs; i++) {
+		free(rx_framers[i].buf);
+		rx_framers[i].buf = NULL;
+	}
+
+	if (aio_efd >= 0)
+		close(aio_efd);
+	aio_efd = -1;
+}
+
+int ffs_aio_start(struct gbsim_bridge *bridge)
+{
+	int i, ret;
+
+	aio_bridge = bridge;
+
+	aio_efd = eventfd(0, 0);
+	if (aio_efd < 0) {
+		gbsim_error("aio eventfd: %s\n", strerror(errno));
+		return -errno;
+	}
+
+	ctx = 0;
+	if (io_setup((ep_pairs + 1) * aio_depth, &ctx) < 0) {
+		ret = -errno;
+		gbsim_error("io_setup: %s\n", strerror(errno));
+		ffs_aio_free();
+		return ret;
+	}
+
+	for (i = 0; i < ep_pairs; i++) {
+		rx_framers[i].bridge = bridge;
+		rx_framers[i].size = rx_size + msg_size_max;
+		rx_framers[i].len = 0;
+		rx_framers[i].buf = buf_alloc(rx_framers[i].size);
+		if (!rx_framers[i].buf)
+			goto err_nomem;
+	}
+
+	rx_reqs = calloc(aio_depth * ep_pairs, sizeof(*rx_reqs));
+	tx_reqs = calloc(aio_depth, sizeof(*tx_reqs));
+	if (!rx_reqs || !tx_reqs)
+		goto err_nomem;
+
+	for (i = 0; i < aio_depth * ep_pairs; i++) {
+		rx_reqs[i].pair = i % ep_pairs;
+		rx_reqs[i].buf = buf_alloc(rx_size);
+		if (!rx_reqs[i].buf)
+			goto err_nomem;
+	}
+
+	for (i = 0; i < aio_depth; i++) {
+		tx_reqs[i].next = tx_free;
+		tx_free = &tx_reqs[i];
+	}
+
+	for (i = 0; i < aio_depth * ep_pairs; i++) {
+		ret = ffs_aio_submit_read(&rx_reqs[i]);
+		if (ret < 0) {
+			gbsim_error("failed to queue read (%d)\n", ret);
+			goto err;
+		}
+	}
+
+	aio_running = true;
+
+	ret = pthread_create(&aio_pthread, NULL, ffs_aio_thread, NULL);
+	if (ret) {
+		gbsim_error("can't create aio thread\n");
+		aio_running = false;
+		ret = -ret;
+		goto err;
+	}
+
+	gbsim_debug("AIO started, %d reads and writes in flight\n", aio_depth);
+
+	return 0;
+
+err_nomem:
+	ret = -ENOMEM;
+err:
+	io_destroy(ctx);
+	ffs_aio_free();
+	return ret;
+}
+
+void ffs_aio_stop(void)
+{
+	pthread_mutex_lock(&tx_lock);
+	if (!aio_running) {
+		pthread_mutex_unlock(&tx_lock);
+		return;
+	}
+	aio_running = false;
+	pthread_cond_broadcast(&tx_cond);
+	pthread_mutex_unlock(&tx_lock);
+
+	pthread_cancel(aio_pthread);
+	pthread_join(aio_pthread, NULL);
+
+	/* Cancels and waits for the requests still in flight */
+	io_destroy(ctx);
+	ffs_aio_tx_drain();
+	ffs_aio_free();
+}
@@ -0,0 +1,60 @@
+/*
+ * Greybus Simulator: AP bridges
+ *
+ * Copyright 2015 Google Inc.
+ * Copyright 2015 Linaro Ltd.
+ *
+ * Provided under the three clause BSD license found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "gbsim.h"
+
+struct gbsim_bridge bridges[GBSIM_BRIDGES_MAX];
+
+/*
+ * The first bridge keeps the names gbsim has always used: gadget g1,
+ * functionfs instance gbsim mounted on /dev/ffs-gbsim, and hotplug-module
+ * under the hotplug base directory. Bridge n is g<n+1>, gbsim<n>,
+ * /dev/ffs-gbsim<n> and hotplug-module<n>.
+ */
+void bridges_init(void)
+{
+	struct gbsim_bridge *bridge;
+	int i, j;
+
+	for (i = 0; i < bridge_count; i++) {
+		bridge = &bridges[i];
+		bridge->id = i;
+
+		snprintf(bridge->gadget_name, sizeof(bridge->gadget_name),
+			 "g%d", i + 1);
+		if (i) {
+			snprintf(bridge->ffs_name, sizeof(bridge->ffs_name),
+				 "gbsim%d", i);
+			snprintf(bridge->ffs_dir, sizeof(bridge->ffs_dir),
+				 "/dev/ffs-gbsim%d/", i);
+			snprintf(bridge->hotplug_dir,
+				 sizeof(bridge->hotplug_dir),
+				 "%s/hotplug-module%d", hotplug_basedir, i);
+		} else {
+			strcpy(bridge->ffs_name, "gbsim");
+			strcpy(bridge->ffs_dir, "/dev/ffs-gbsim/");
+			snprintf(bridge->hotplug_dir,
+				 sizeof(bridge->hotplug_dir),
+				 "%s/hotplug-module", hotplug_basedir);
+		}
+
+		TAILQ_INIT(&bridge->info.cports);
+
+		bridge->control = -ENXIO;
+		for (j = 0; j < GBSIM_EP_PAIRS_MAX; j++) {
+			bridge->to_ap[j] = -ENXIO;
+			bridge->from_ap[j] = -ENXIO;
+		}
+		bridge->notify_fd = -ENXIO;
+	}
+}
@@ -0,0 +1,81 @@
+/*
+ * Greybus Simulator: message buffer allocation
+ *
+ * Copyright 2015 Google Inc.
+ * Copyright 2015 Linaro Ltd.
+ *
+ * Provided under the three clause BSD license found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "gbsim.h"
+
+/*
+ * Every buffer a message passes through on its way to or from the
+ * endpoints (the read buffers, the received message slots and the
+ * transmit pool) is allocated here, once, at startup. Buffers start on a
+ * page boundary, or for pools of small buffers on a cache line boundary
+ * with each buffer padded to whole cache lines, so that FunctionFS can
+ * transfer them without bounce copies and no two threads share a line.
+ * Their size follows msg_size_max, which may be raised above the ES1
+ * limit for an AP that accepts larger messages.
+ */
+#define GBSIM_CACHELINE		64
+
+static size_t buf_page_size(void)
+{
+	long size = sysconf(_SC_PAGESIZE);
+
+	return size > 0 ? size : 4096;
+}
+
+static size_t buf_round_up(size_t size, size_t align)
+{
+	return (size + align - 1) & ~(align - 1);
+}
+
+/*
+ * The distance between buffers of a pool: whole cache lines, or whole
+ * pages once a buffer is at least a page long.
+ */
+size_t buf_stride(size_t size)
+{
+	size_t page = buf_page_size();
+
+	if (size >= page)
+		return buf_round_up(size, page);
+
+	return buf_round_up(size, GBSIM_CACHELINE);
+}
+
+/* A zeroed, page-aligned buffer of at least size bytes; free with free() */
+void *buf_alloc(size_t size)
+{
+	void *buf;
+	int ret;
+
+	size = buf_round_up(size ? size : 1, GBSIM_CACHELINE);
+	ret = posix_memalign(&buf, buf_page_size(), size);
+	if (ret) {
+		gbsim_error("failed to allocate %zu byte buffer: %s\n", size,
+			    strerror(ret));
+		return NULL;
+	}
+	memset(buf, 0, size);
+
+	return buf;
+}
+
+/*
+ * One page-aligned allocation holding count buffers of size bytes, the
+ * i-th of which is at i * buf_stride(size). Free with free().
+ */
+void *buf_pool_alloc(int count, size_t size)
+{
+	return buf_alloc(count * buf_stride(size));
+}
@@ -0,0 +1,309 @@
+/*
+ * Greybus Simulator: pcapng capture
+ *
+ * Copyright 2015 Google Inc.
+ * Copyright 2015 Linaro Ltd.
+ *
+ * Provided under the three clause BSD license found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gbsim.h"
+
+/*
+ * With -p, every message to and from the AP is written, whole, to a
+ * pcapng file. Each bridge is an interface of its own, named after its
+ * functionfs instance, with link type LINKTYPE_USER0: a packet is one
+ * Greybus operation message, header included, with the hd_cport_id the
+ * AP knows in the header pad bytes as on the wire. Its direction is in
+ * the packet flags, inbound for messages from the AP, and timestamps are
+ * in nanoseconds.
+ *
+ * The file is written through a shared mapping of CAPTURE_WINDOW bytes,
+ * moved on and the file extended as it fills, so that capturing a message
+ * is a copy under a lock and the kernel writes the pages back in its own
+ * time. The file is truncated to what was written on exit.
+ */
+#define CAPTURE_WINDOW		(16 << 20)
+
+#define LINKTYPE_USER0		147
+
+#define PCAPNG_SHB		0x0a0d0d0a
+#define PCAPNG_IDB		0x00000001
+#define PCAPNG_EPB		0x00000006
+#define PCAPNG_BYTE_ORDER	0x1a2b3c4d
+
+#define PCAPNG_OPT_END		0
+#define PCAPNG_OPT_IF_NAME	2
+#define PCAPNG_OPT_IF_TSRESOL	9
+#define PCAPNG_OPT_EPB_FLAGS	2
+
+#define PCAPNG_FLAG_INBOUND	1
+#define PCAPNG_FLAG_OUTBOUND	2
+
+struct pcapng_block {
+	uint32_t type;
+	uint32_t length;
+};
+
+struct pcapng_shb {
+	struct pcapng_block block;
+	uint32_t byte_order;
+	uint16_t major;
+	uint16_t minor;
+	int64_t section_length;
+};
+
+struct pcapng_idb {
+	struct pcapng_block block;
+	uint16_t link_type;
+	uint16_t reserved;
+	uint32_t snap_len;
+};
+
+struct pcapng_epb {
+	struct pcapng_block block;
+	uint32_t interface;
+	uint32_t ts_high;
+	uint32_t ts_low;
+	uint32_t captured_len;
+	uint32_t packet_len;
+};
+
+struct pcapng_opt {
+	uint16_t code;
+	uint16_t length;
+};
+
+static int capture_fd = -1;
+static char *capture_map;
+static off_t capture_map_off;		/* file offset of the mapping */
+static size_t capture_pos;		/* write position within it */
+static size_t capture_page;
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t pad4(size_t len)
+{
+	return (len + 3) & ~3;
+}
+
+/* Move the mapping on to the write position; capture_lock held */
+static int capture_remap(void)
+{
+	off_t end = capture_map_off + capture_pos;
+	off_t off = end & ~(off_t)(capture_page - 1);
+	char *map;
+
+	if (capture_map)
+		munmap(capture_map, CAPTURE_WINDOW);
+	capture_map = NULL;
+
+	if (ftruncate(capture_fd, off + CAPTURE_WINDOW) < 0) {
+		gbsim_error("can't extend capture file: %s\n", strerror(errno));
+		return -errno;
+	}
+
+	map = mmap(NULL, CAPTURE_WINDOW, PROT_READ | PROT_WRITE, MAP_SHARED,
+		   capture_fd, off);
+	if (map == MAP_FAILED) {
+		gbsim_error("can't map capture file: %s\n", strerror(errno));
+		return -errno;
+	}
+
+	capture_map = map;
+	capture_map_off = off;
+	capture_pos = end - off;
+
+	return 0;
+}
+
+/* Room for a block of len bytes; capture_lock held */
+static void *capture_reserve(size_t len)
+{
+	void *p;
+
+	if (capture_pos + len > CAPTURE_WINDOW && capture_remap() < 0)
+		return NULL;
+
+	p = capture_map + capture_pos;
+	capture_pos += len;
+
+	return p;
+}
+
+static char *capture_opt(char *p, uint16_t code, const void *val,
+			 uint16_t len)
+{
+	struct pcapng_opt *opt = (struct pcapng_opt *)p;
+
+	opt->code = code;
+	opt->length = len;
+	if (len)
+		memcpy(p + sizeof(*opt), val, len);
+	memset(p + sizeof(*opt) + len, 0, pad4(len) - len);
+
+	return p + sizeof(*opt) + pad4(len);
+}
+
+static int capture_header(void)
+{
+	struct pcapng_shb *shb;
+	struct pcapng_idb *idb;
+	uint8_t tsresol = 9;	/* nanoseconds */
+	const char *name;
+	size_t len;
+	char *p;
+	int i;
+
+	len = sizeof(*shb) + sizeof(uint32_t);
+	shb = capture_reserve(len);
+	if (!shb)
+		return -ENOMEM;
+	shb->block.type = PCAPNG_SHB;
+	shb->block.length = len;
+	shb->byte_order = PCAPNG_BYTE_ORDER;
+	shb->major = 1;
+	shb->minor = 0;
+	shb->section_length = -1;
+	memcpy((char *)shb + len - sizeof(uint32_t), &len, sizeof(uint32_t));
+
+	/* One interface per bridge, numbered as the bridges are */
+	for (i = 0; i < bridge_count; i++) {
+		name = bridges[i].ffs_name;
+		len = sizeof(*idb) + sizeof(struct pcapng_opt) * 3 +
+		      pad4(strlen(name)) + pad4(1) + sizeof(uint32_t);
+		idb = capture_reserve(len);
+		if (!idb)
+			return -ENOMEM;
+		idb->block.type = PCAPNG_IDB;
+		idb->block.length = len;
+		idb->link_type = LINKTYPE_USER0;
+		idb->reserved = 0;
+		idb->snap_len = msg_size_max;
+
+		p = (char *)(idb + 1);
+		p = capture_opt(p, PCAPNG_OPT_IF_NAME, name, strlen(name));
+		p = capture_opt(p, PCAPNG_OPT_IF_TSRESOL, &tsresol, 1);
+		p = capture_opt(p, PCAPNG_OPT_END, NULL, 0);
+		memcpy(p, &len, sizeof(uint32_t));
+	}
+
+	return 0;
+}
+
+/* Capture a message to (tx) or from (rx) the AP */
+void capture_msg(uint8_t dir, uint16_t hd_cport_id, const void *buf,
+		 size_t size)
+{
+	struct gb_operation_msg_hdr *hdr;
+	struct pcapng_epb *epb;
+	struct timespec ts;
+	uint32_t flags, len;
+	uint16_t wire_id;
+	uint64_t ns;
+	char *p;
+
+	if (capture_fd < 0)
+		return;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	flags = dir == GBSIM_TRACE_RX ? PCAPNG_FLAG_INBOUND :
+					PCAPNG_FLAG_OUTBOUND;
+	len = sizeof(*epb) + pad4(size) + sizeof(struct pcapng_opt) * 2 +
+	      sizeof(flags) + sizeof(uint32_t);
+
+	pthread_mutex_lock(&capture_lock);
+	epb = capture_map ? capture_reserve(len) : NULL;
+	if (!epb) {
+		pthread_mutex_unlock(&capture_lock);
+		return;
+	}
+
+	epb->block.type = PCAPNG_EPB;
+	epb->block.length = len;
+	epb->interface = cport_bridge(hd_cport_id)->id;
+	epb->ts_high = ns >> 32;
+	epb->ts_low = ns & 0xffffffff;
+	epb->captured_len = size;
+	epb->packet_len = size;
+
+	p = (char *)(epb + 1);
+	memcpy(p, buf, size);
+	memset(p + size, 0, pad4(size) - size);
+
+	/* Until the transport writes it, a message carries gbsim's own id */
+	hdr = (struct gb_operation_msg_hdr *)p;
+	wire_id = cport_wire_id(hd_cport_id);
+	hdr->pad[0] = wire_id & 0xff;
+	hdr->pad[1] = (wire_id >> 8) & 0xff;
+
+	p = capture_opt(p + pad4(size), PCAPNG_OPT_EPB_FLAGS, &flags,
+			sizeof(flags));
+	p = capture_opt(p, PCAPNG_OPT_END, NULL, 0);
+	memcpy(p, &len, sizeof(uint32_t));
+	pthread_mutex_unlock(&capture_lock);
+}
+
+int capture_init(void)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	int ret;
+
+	if (!capture_path)
+		return 0;
+
+	capture_page = page > 0 ? page : 4096;
+
+	capture_fd = open(capture_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+			  0644);
+	if (capture_fd < 0) {
+		gbsim_error("can't open capture file %s: %s\n", capture_path,
+			    strerror(errno));
+		return -errno;
+	}
+
+	pthread_mutex_lock(&capture_lock);
+	ret = capture_remap();
+	if (!ret)
+		ret = capture_header();
+	pthread_mutex_unlock(&capture_lock);
+	if (ret < 0)
+		return ret;
+
+	gbsim_info("capturing messages to %s\n", capture_path);
+
+	return 0;
+}
+
+/* Cut the file down to what was captured */
+void capture_cleanup(void)
+{
+	off_t end;
+
+	if (capture_fd < 0)
+		return;
+
+	pthread_mutex_lock(&capture_lock);
+	end = capture_map_off + capture_pos;
+	if (capture_map) {
+		munmap(capture_map, CAPTURE_WINDOW);
+		capture_map = NULL;
+	}
+	pthread_mutex_unlock(&capture_lock);
+
+	if (ftruncate(capture_fd, end) < 0)
+		gbsim_error("can't truncate capture file: %s\n",
+			    strerror(errno));
+	close(capture_fd);
+	capture_fd = -1;
+}
@@ -20,11 +20,12 @@
 
 #include "gbsim.h"
 
-int control_handler(uint16_t cport_id, uint16_t hd_cport_id, void *rbuf,
-		    size_t rsize, void *tbuf, size_t tsize)
+static int control_handler(uint16_t cport_id, uint16_t hd_cport_id, void *rbuf,
+			   size_t rsize, void *tbuf, size_t tsize)
 {
 	struct op_msg *op_req = rbuf;
 	struct op_msg *op_rsp = tbuf;
+	struct gbsim_info *info = &cport_bridge(hd_cport_id)->info;
 	struct gb_operation_msg_hdr *oph = &op_req->header;
 	uint16_t message_size = sizeof(*oph);
 	size_t payload_size;
@@ -37,11 +38,11 @@ int control_handler(uint16_t cport_id, uint16_t hd_cport_id, void *rbuf,
 		break;
 	case GB_CONTROL_TYPE_GET_MANIFEST_SIZE:
 		payload_size = sizeof(op_rsp->control_msize_rsp);
-		op_rsp->control_msize_rsp.size = htole16(info.manifest_size);
+		op_rsp->control_msize_rsp.size = htole16(info->manifest_size);
 		break;
 	case GB_CONTROL_TYPE_GET_MANIFEST:
-		payload_size = info.manifest_size;
-		memcpy(&op_rsp->control_manifest_rsp.data, info.manifest,
+		payload_size = info->manifest_size;
+		memcpy(&op_rsp->control_manifest_rsp.data, info->manifest,
 		       payload_size);
 		break;
 	case GB_CONTROL_TYPE_CONNECTED:
@@ -60,24 +61,20 @@ int control_handler(uint16_t cport_id, uint16_t hd_cport_id, void *rbuf,
 			     PROTOCOL_STATUS_SUCCESS);
 }
 
-char *control_get_operation(uint8_t type)
-{
-	switch (type) {
-	case GB_CONTROL_TYPE_INVALID:
-		return "GB_CONTROL_TYPE_INVALID";
-	case GB_CONTROL_TYPE_PROTOCOL_VERSION:
-		return "GB_CONTROL_TYPE_PROTOCOL_VERSION";
-	case GB_CONTROL_TYPE_PROBE_AP:
-		return "GB_CONTROL_TYPE_PROBE_AP";
-	case GB_CONTROL_TYPE_GET_MANIFEST_SIZE:
-		return "GB_CONTROL_TYPE_GET_MANIFEST_SIZE";
-	case GB_CONTROL_TYPE_GET_MANIFEST:
-		return "GB_CONTROL_TYPE_GET_MANIFEST";
-	case GB_CONTROL_TYPE_CONNECTED:
-		return "GB_CONTROL_TYPE_CONNECTED";
-	case GB_CONTROL_TYPE_DISCONNECTED:
-		return "GB_CONTROL_TYPE_DISCONNECTED";
-	default:
-		return "(Unknown operation)";
-	}
-}
+static const char * const control_operations[] = {
+	[GB_CONTROL_TYPE_INVALID] = "GB_CONTROL_TYPE_INVALID",
+	[GB_CONTROL_TYPE_PROTOCOL_VERSION] = "GB_CONTROL_TYPE_PROTOCOL_VERSION",
+	[GB_CONTROL_TYPE_PROBE_AP] = "GB_CONTROL_TYPE_PROBE_AP",
+	[GB_CONTROL_TYPE_GET_MANIFEST_SIZE] = "GB_CONTROL_TYPE_GET_MANIFEST_SIZE",
+	[GB_CONTROL_TYPE_GET_MANIFEST] = "GB_CONTROL_TYPE_GET_MANIFEST",
+	[GB_CONTROL_TYPE_CONNECTED] = "GB_CONTROL_TYPE_CONNECTED",
+	[GB_CONTROL_TYPE_DISCONNECTED] = "GB_CONTROL_TYPE_DISCONNECTED",
+};
+
+const struct gbsim_protocol control_protocol = {
+	.id		= GREYBUS_PROTOCOL_CONTROL,
+	.name		= "CONTROL",
+	.handler	= control_handler,
+	.operations	= control_operations,
+	.operation_count = ARRAY_SIZE(control_operations),
+};
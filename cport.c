@@ -7,6 +7,9 @@
  * Provided under the three clause BSD license found in the LICENSE file.
  */
 
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <linux/types.h>
@@ -16,21 +19,149 @@
 
 #include "gbsim.h"
 
-#define ES1_MSG_SIZE	(2 * 1024)
+/*
+ * CPorts are looked up on every message, so they are indexed directly by
+ * hd_cport_id, one table for all bridges. Each bridge's info.cports list
+ * is only used to walk its CPorts.
+ *
+ * Lookups take no lock: entries are published and cleared atomically by
+ * the hotplug paths, which serialise among themselves with cport_lock.
+ * A CPort found by cport_find() may only be used between
+ * cport_read_lock() and cport_read_unlock(). Removal clears the table
+ * entries first and then waits, in cport_synchronize(), for every reader
+ * that could still see them to leave its read-side section before the
+ * memory is freed.
+ *
+ * That wait holds no lock, but it lasts as long as the longest read
+ * section, so nothing may block inside one: no waiting for credits, for a
+ * lock held across I/O, or on I/O itself. Copy what is needed out of the
+ * CPort and leave the section first; a protocol handler runs on such a
+ * copy.
+ */
+static struct gbsim_cport *cport_table[UINT16_MAX + 1];
+static pthread_mutex_t cport_lock = PTHREAD_MUTEX_INITIALIZER;
 
-/* Receive buffer for all data arriving from the AP */
-static char cport_rbuf[ES1_MSG_SIZE];
-static char cport_tbuf[ES1_MSG_SIZE];
+/*
+ * One per thread that ever took the read lock. Records are never freed,
+ * only left for a later thread to reuse, so the list can be walked
+ * without cport_readers_lock.
+ */
+struct cport_reader {
+	struct cport_reader *next;
+	unsigned long epoch;		/* 0 when outside a read section */
+	int nesting;
+	bool retired;
+};
+
+static unsigned long cport_epoch = 1;
+static struct cport_reader *cport_readers;
+static pthread_mutex_t cport_readers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t cport_reader_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cport_reader_key;
+static __thread struct cport_reader *cport_self;
+
+static void cport_reader_exit(void *arg)
+{
+	struct cport_reader *r = arg;
 
-struct gbsim_cport *cport_find(uint16_t cport_id)
+	/* A thread cancelled in a read section must not hold up removals */
+	r->nesting = 0;
+	__atomic_store_n(&r->epoch, 0, __ATOMIC_RELEASE);
+
+	pthread_mutex_lock(&cport_readers_lock);
+	r->retired = true;
+	pthread_mutex_unlock(&cport_readers_lock);
+}
+
+static void cport_reader_key_init(void)
 {
-	struct gbsim_cport *cport;
+	pthread_key_create(&cport_reader_key, cport_reader_exit);
+}
 
-	TAILQ_FOREACH(cport, &info.cports, cnode)
-		if (cport->hd_cport_id == cport_id)
-			return cport;
+static struct cport_reader *cport_reader_register(void)
+{
+	struct cport_reader *r;
 
-	return NULL;
+	pthread_mutex_lock(&cport_readers_lock);
+	for (r = cport_readers; r; r = r->next) {
+		if (r->retired) {
+			r->retired = false;
+			break;
+		}
+	}
+	if (!r) {
+		r = calloc(1, sizeof(*r));
+		if (!r) {
+			gbsim_error("failed to register cport reader\n");
+			abort();
+		}
+		r->next = cport_readers;
+		__atomic_store_n(&cport_readers, r, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&cport_readers_lock);
+
+	pthread_once(&cport_reader_once, cport_reader_key_init);
+	pthread_setspecific(cport_reader_key, r);
+
+	cport_self = r;
+	return r;
+}
+
+void cport_read_lock(void)
+{
+	struct cport_reader *r = cport_self;
+
+	if (!r)
+		r = cport_reader_register();
+
+	if (r->nesting++)
+		return;
+
+	__atomic_store_n(&r->epoch, __atomic_load_n(&cport_epoch,
+						    __ATOMIC_ACQUIRE),
+			 __ATOMIC_RELAXED);
+	/* Order the epoch store before any table lookup */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void cport_read_unlock(void)
+{
+	struct cport_reader *r = cport_self;
+
+	if (--r->nesting)
+		return;
+
+	__atomic_store_n(&r->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Wait for all readers that may have looked up an entry cleared before
+ * this call to leave their read sections. No lock is held meanwhile, so a
+ * reader may register or leave while it waits. Readers registered after
+ * the epoch moved on cannot have seen the entry; the calling thread is
+ * skipped, as it cannot be waiting for itself.
+ */
+static void cport_synchronize(void)
+{
+	struct cport_reader *r;
+	unsigned long epoch, e;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	epoch = __atomic_add_fetch(&cport_epoch, 1, __ATOMIC_SEQ_CST);
+
+	for (r = __atomic_load_n(&cport_readers, __ATOMIC_ACQUIRE); r;
+	     r = r->next) {
+		if (r == cport_self)
+			continue;
+		while ((e = __atomic_load_n(&r->epoch, __ATOMIC_ACQUIRE)) &&
+		       e < epoch)
+			sched_yield();
+	}
+}
+
+struct gbsim_cport *cport_find(uint16_t hd_cport_id)
+{
+	return __atomic_load_n(&cport_table[hd_cport_id], __ATOMIC_ACQUIRE);
 }
 
 void allocate_cport(uint16_t cport_id, uint16_t hd_cport_id, int protocol_id)
@@ -38,136 +169,160 @@ void allocate_cport(uint16_t cport_id, uint16_t hd_cport_id, int protocol_id)
 	struct gbsim_cport *cport;
 
 	cport = malloc(sizeof(*cport));
+	if (!cport) {
+		gbsim_error("failed to allocate cport %hu\n", hd_cport_id);
+		return;
+	}
 	cport->id = cport_id;
 
 	cport->hd_cport_id = hd_cport_id;
 	cport->protocol = protocol_id;
-	TAILQ_INSERT_TAIL(&info.cports, cport, cnode);
+	cport->proto = protocol_find(protocol_id);
+	if (cport->proto)
+		protocol_start(cport->proto);
+	else
+		gbsim_error("no handler for protocol 0x%02x on cport %hu\n",
+			    protocol_id, cport_id);
+
+	pthread_mutex_lock(&cport_lock);
+	if (cport_table[hd_cport_id]) {
+		pthread_mutex_unlock(&cport_lock);
+		gbsim_error("hd cport id %hu already allocated\n", hd_cport_id);
+		free(cport);
+		return;
+	}
+	TAILQ_INSERT_TAIL(&cport_bridge(hd_cport_id)->info.cports, cport, cnode);
+	__atomic_store_n(&cport_table[hd_cport_id], cport, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&cport_lock);
+}
+
+/*
+ * Unpublish a CPort and move it to the given list. Must be called with
+ * cport_lock held; the CPort is freed by free_unpublished_cports(), which
+ * waits for readers and so must be called without it.
+ */
+static void unpublish_cport(struct gbsim_cport *cport, struct chead *dead)
+{
+	__atomic_store_n(&cport_table[cport->hd_cport_id], NULL,
+			 __ATOMIC_RELEASE);
+	TAILQ_REMOVE(&cport_bridge(cport->hd_cport_id)->info.cports, cport,
+		     cnode);
+	TAILQ_INSERT_TAIL(dead, cport, cnode);
+}
+
+static void free_unpublished_cports(struct chead *dead)
+{
+	struct gbsim_cport *cport;
+
+	if (TAILQ_EMPTY(dead))
+		return;
+
+	cport_synchronize();
+
+	while ((cport = TAILQ_FIRST(dead))) {
+		TAILQ_REMOVE(dead, cport, cnode);
+		free(cport);
+	}
 }
 
 void free_cport(struct gbsim_cport *cport)
 {
-	TAILQ_REMOVE(&info.cports, cport, cnode);
-	free(cport);
+	struct chead dead = TAILQ_HEAD_INITIALIZER(dead);
+
+	if (!cport)
+		return;
+
+	pthread_mutex_lock(&cport_lock);
+	unpublish_cport(cport, &dead);
+	pthread_mutex_unlock(&cport_lock);
+
+	free_unpublished_cports(&dead);
 }
 
-void free_cports(void)
+void free_cports(struct gbsim_bridge *bridge)
 {
+	struct chead dead = TAILQ_HEAD_INITIALIZER(dead);
 	struct gbsim_cport *cport;
 
+	pthread_mutex_lock(&cport_lock);
+
 	/*
 	 * Linux doesn't have a foreach_safe version of tailq and so the dirty
 	 * trick of 'goto again'.
 	 */
 again:
-	TAILQ_FOREACH(cport, &info.cports, cnode) {
-		if (cport->hd_cport_id == GB_SVC_CPORT_ID)
+	TAILQ_FOREACH(cport, &bridge->info.cports, cnode) {
+		if (cport_wire_id(cport->hd_cport_id) == GB_SVC_CPORT_ID)
 			continue;
 
-		free_cport(cport);
+		unpublish_cport(cport, &dead);
 		goto again;
 	}
-	reset_hd_cport_id();
+	reset_hd_cport_id(bridge);
+	pthread_mutex_unlock(&cport_lock);
+
+	/* Readers see either the old CPorts or none, then they are freed */
+	free_unpublished_cports(&dead);
 }
 
-static void get_protocol_operation(uint16_t cport_id, char **protocol,
-				   char **operation, uint8_t type)
+static void get_protocol_operation(struct gbsim_cport *cport,
+				   const char **protocol,
+				   const char **operation, uint8_t type)
 {
-	struct gbsim_cport *cport;
-
-	cport = cport_find(cport_id);
 	if (!cport) {
 		*protocol = "N/A";
 		*operation = "N/A";
 		return;
 	}
 
-	switch (cport->protocol) {
-	case GREYBUS_PROTOCOL_CONTROL:
-		*protocol = "CONTROL";
-		*operation = control_get_operation(type);
-		break;
-	case GREYBUS_PROTOCOL_SVC:
-		*protocol = "SVC";
-		*operation = svc_get_operation(type);
-		break;
-	case GREYBUS_PROTOCOL_GPIO:
-		*protocol = "GPIO";
-		*operation = gpio_get_operation(type);
-		break;
-	case GREYBUS_PROTOCOL_I2C:
-		*protocol = "I2C";
-		*operation = i2c_get_operation(type);
-		break;
-	case GREYBUS_PROTOCOL_UART:
-		*protocol = "UART";
-		*operation = uart_get_operation(type);
-		break;
-	case GREYBUS_PROTOCOL_LOOPBACK:
-		*protocol = "LOOPBACK";
-		*operation = loopback_get_operation(type);
-		break;
-	case GREYBUS_PROTOCOL_PWM:
-		*protocol = "PWM";
-		*operation = pwm_get_operation(type);
-		break;
-	case GREYBUS_PROTOCOL_SDIO:
-		*protocol = "SDIO";
-		*operation = sdio_get_operation(type);
-		break;
-	case GREYBUS_PROTOCOL_I2S_MGMT:
-		*protocol = "I2S_MGMT";
-		*operation = i2s_mgmt_get_operation(type);
-		break;
-	case GREYBUS_PROTOCOL_I2S_RECEIVER:
-		*protocol = "I2S_RECEIVER";
-		*operation = i2s_data_get_operation(type);
-		break;
-	case GREYBUS_PROTOCOL_I2S_TRANSMITTER:
-		*protocol = "I2S_TRANSMITTER";
-		*operation = i2s_data_get_operation(type);
-		break;
-	default:
+	if (!cport->proto) {
 		*protocol = "(Unknown protocol)";
 		*operation = "(Unknown operation)";
-		break;
+		return;
 	}
+
+	*protocol = cport->proto->name;
+	*operation = protocol_get_operation(cport->proto, type);
 }
 
 static int send_msg_to_ap(struct op_msg *op, uint16_t hd_cport_id,
 			  uint16_t message_size, uint16_t id, uint8_t type,
 			  uint8_t result)
 {
-	char *protocol, *operation;
-	ssize_t nbytes;
+	const char *protocol, *operation;
 
 	op->header.size = htole16(message_size);
 	op->header.operation_id = id;
 	op->header.type = type;
 	op->header.result = result;
 
-	/* Store the cport id in the header pad bytes */
+	/*
+	 * Store the cport id in the header pad bytes. Until the transport
+	 * writes the message, this is the gbsim-wide hd_cport_id.
+	 */
 	op->header.pad[0] = hd_cport_id & 0xff;
 	op->header.pad[1] = (hd_cport_id >> 8) & 0xff;
 
-	get_protocol_operation(hd_cport_id, &protocol, &operation,
-			       type & ~OP_RESPONSE);
-	if (type & OP_RESPONSE)
-		gbsim_debug("Module -> AP CPort %hu %s %s response\n",
-			    hd_cport_id, protocol, operation);
-	else
-		gbsim_debug("Module -> AP CPort %hu %s %s request\n",
-			    hd_cport_id, protocol, operation);
+	trace_msg(GBSIM_TRACE_TX, hd_cport_id, &op->header);
+	capture_msg(GBSIM_TRACE_TX, hd_cport_id, op, message_size);
+
+	/* With a trace, the text log leaves the hot path */
+	if (gbsim_debug_enabled() && !trace_path) {
+		cport_read_lock();
+		get_protocol_operation(cport_find(hd_cport_id), &protocol,
+				       &operation, type & ~OP_RESPONSE);
+		if (type & OP_RESPONSE)
+			gbsim_debug("Module -> AP CPort %hu %s %s response\n",
+				    hd_cport_id, protocol, operation);
+		else
+			gbsim_debug("Module -> AP CPort %hu %s %s request\n",
+				    hd_cport_id, protocol, operation);
+		cport_read_unlock();
 
-	/* Send the response to the AP */
-	if (verbose)
 		gbsim_dump(op, message_size);
+	}
 
-	nbytes = write(to_ap, op, message_size);
-	if (nbytes < 0)
-		return nbytes;
-
-	return 0;
+	return txbuf_send(op, message_size);
 }
 
 int send_response(struct op_msg *op, uint16_t hd_cport_id,
@@ -178,50 +333,56 @@ int send_response(struct op_msg *op, uint16_t hd_cport_id,
 			oph->type | OP_RESPONSE, result);
 }
 
+/*
+ * Requests are tracked until the AP responds, or they time out. One sent
+ * from the main loop fails with -EAGAIN if the CPort has no credit left,
+ * rather than stalling every other event behind it.
+ */
 int send_request(struct op_msg *op, uint16_t hd_cport_id,
-		 uint16_t message_size, uint16_t id, uint8_t type)
+		 uint16_t message_size, uint8_t type)
 {
-	return send_msg_to_ap(op, hd_cport_id, message_size, id, type, 0);
+	int id, ret;
+
+	if (reactor_current())
+		id = operation_try_start(hd_cport_id, type);
+	else
+		id = operation_start(hd_cport_id, type);
+	if (id < 0) {
+		gbsim_error("failed to start operation %02x on cport %hu (%d)\n",
+			    type, hd_cport_id, id);
+		txbuf_discard(op);
+		return id;
+	}
+
+	ret = send_msg_to_ap(op, hd_cport_id, message_size, htole16(id), type,
+			     0);
+	if (ret)
+		operation_cancel(hd_cport_id, id);
+
+	return ret;
 }
 
 static int cport_recv_handler(struct gbsim_cport *cport,
 				void *rbuf, size_t rsize,
 				void *tbuf, size_t tsize)
 {
-	switch (cport->protocol) {
-	case GREYBUS_PROTOCOL_CONTROL:
-		return control_handler(cport->id, cport->hd_cport_id, rbuf, rsize, tbuf, tsize);
-	case GREYBUS_PROTOCOL_SVC:
-		return svc_handler(cport->id, cport->hd_cport_id, rbuf, rsize, tbuf, tsize);
-	case GREYBUS_PROTOCOL_GPIO:
-		return gpio_handler(cport->id, cport->hd_cport_id, rbuf, rsize, tbuf, tsize);
-	case GREYBUS_PROTOCOL_I2C:
-		return i2c_handler(cport->id, cport->hd_cport_id, rbuf, rsize, tbuf, tsize);
-	case GREYBUS_PROTOCOL_UART:
-		return uart_handler(cport->id, cport->hd_cport_id, rbuf, rsize, tbuf, tsize);
-	case GREYBUS_PROTOCOL_PWM:
-		return pwm_handler(cport->id, cport->hd_cport_id, rbuf, rsize, tbuf, tsize);
-	case GREYBUS_PROTOCOL_SDIO:
-		return sdio_handler(cport->id, cport->hd_cport_id, rbuf, rsize, tbuf, tsize);
-	case GREYBUS_PROTOCOL_I2S_MGMT:
-		return i2s_mgmt_handler(cport->id, cport->hd_cport_id, rbuf, rsize, tbuf, tsize);
-	case GREYBUS_PROTOCOL_I2S_RECEIVER:
-	case GREYBUS_PROTOCOL_I2S_TRANSMITTER:
-		return i2s_data_handler(cport->id, cport->hd_cport_id, rbuf, rsize, tbuf, tsize);
-	case GREYBUS_PROTOCOL_LOOPBACK:
-		return loopback_handler(cport->id, cport->hd_cport_id, rbuf, rsize, tbuf, tsize);
-	default:
+	if (!cport->proto) {
 		gbsim_error("handler not found for cport %u\n", cport->id);
 		return -EINVAL;
 	}
+
+	return cport->proto->handler(cport->id, cport->hd_cport_id, rbuf, rsize,
+				     tbuf, tsize);
 }
 
-static void recv_handler(void *rbuf, size_t rsize, void *tbuf, size_t tsize)
+void recv_handler(uint16_t hd_cport_id, void *rbuf, size_t rsize, void *tbuf,
+		  size_t tsize)
 {
 	struct gb_operation_msg_hdr *hdr = rbuf;
-	uint16_t hd_cport_id;
-	struct gbsim_cport *cport;
-	char *protocol, *operation, *type;
+	struct gbsim_cport *cport, c;
+	const char *protocol, *operation, *type;
+	uint8_t msg_type;
+	uint64_t start = 0;
 	int ret;
 
 	if (rsize < sizeof(*hdr)) {
@@ -229,61 +390,201 @@ static void recv_handler(void *rbuf, size_t rsize, void *tbuf, size_t tsize)
 		return;
 	}
 
-	/* Retreive the cport id stored in the header pad bytes */
-	hd_cport_id = hdr->pad[1] << 8 | hdr->pad[0];
-
+	/* Handlers may block, so they run on a copy, outside the section */
+	cport_read_lock();
 	cport = cport_find(hd_cport_id);
+	if (cport)
+		c = *cport;
+	cport_read_unlock();
 	if (!cport) {
 		gbsim_error("message received for unknown cport id %u\n",
 			hd_cport_id);
 		return;
 	}
 
-	type = hdr->type & OP_RESPONSE ? "response" : "request";
-	get_protocol_operation(hd_cport_id, &protocol, &operation,
-			       hdr->type & ~OP_RESPONSE);
+	if (gbsim_debug_enabled() && !trace_path) {
+		type = hdr->type & OP_RESPONSE ? "response" : "request";
+		get_protocol_operation(&c, &protocol, &operation,
+				       hdr->type & ~OP_RESPONSE);
 
-	/* FIXME: can identify module from our cport connection */
-	gbsim_debug("AP -> Module %hhu CPort %hu %s %s %s\n",
-		    cport_to_module_id(hd_cport_id), cport->id,
-		    protocol, operation, type);
+		/* FIXME: can identify module from our cport connection */
+		gbsim_debug("AP -> Module %hhu CPort %hu %s %s %s\n",
+			    cport_to_module_id(hd_cport_id), c.id,
+			    protocol, operation, type);
 
-	if (verbose)
 		gbsim_dump(rbuf, rsize);
+	}
 
 	/* clear the cport id stored in the header pad bytes */
 	hdr->pad[0] = 0;
 	hdr->pad[1] = 0;
 
-	ret = cport_recv_handler(cport, rbuf, rsize, tbuf, tsize);
+	/* The handler may reuse the message buffer */
+	msg_type = hdr->type;
+	if (stats_path)
+		start = stats_now();
+
+	ret = cport_recv_handler(&c, rbuf, rsize, tbuf, tsize);
+
+	if (stats_path)
+		stats_record(GBSIM_STATS_HANDLER, c.protocol, msg_type,
+			     stats_now() - start);
 	if (ret)
 		gbsim_debug("cport_recv_handler() returned %d\n", ret);
 }
 
 void recv_thread_cleanup(void *arg)
 {
-	cleanup_endpoint(to_ap, "to_ap");
-	cleanup_endpoint(from_ap, "from_ap");
+	struct gbsim_bridge *bridge;
+	int b, i;
+
+	for (b = 0; b < bridge_count; b++) {
+		bridge = &bridges[b];
+		for (i = 0; i < ep_pairs; i++) {
+			cleanup_endpoint(bridge->to_ap[i], "to_ap");
+			cleanup_endpoint(bridge->from_ap[i], "from_ap");
+		}
+	}
+}
+
+/* Leave only the hd_cport_id the AP knows in the header pad bytes */
+void txbuf_to_wire(struct gbsim_txbuf *tb)
+{
+	struct gb_operation_msg_hdr *hdr = (struct gb_operation_msg_hdr *)tb->buf;
+	uint16_t hd_cport_id = cport_wire_id(tb->hd_cport_id);
+
+	hdr->pad[0] = hd_cport_id & 0xff;
+	hdr->pad[1] = (hd_cport_id >> 8) & 0xff;
 }
 
 /*
- * Repeatedly perform blocking reads to receive messages arriving
- * from the AP.
+ * Walk the Greybus messages held in the framer's buffer, using each header's
+ * size field, and hand every complete one over to the CPort workers, under
+ * the gbsim-wide hd_cport_id of the framer's bridge. A
+ * trailing partial message is kept at the start of the buffer so the next
+ * read can complete it.
+ *
+ * Returns the number of messages dispatched.
  */
-void *recv_thread(void *param)
+int rx_frame(struct gbsim_framer *f, size_t nbytes)
 {
-	while (1) {
-		ssize_t rsize;
+	struct gb_operation_msg_hdr *hdr;
+	struct gbsim_msg *msg;
+	size_t off = 0;
+	uint16_t msize, hd_cport_id;
+	uint64_t rx_ns = 0;
+	int count = 0;
+
+	f->len += nbytes;
+
+	/* All the messages of a read arrived together */
+	if (stats_path)
+		rx_ns = stats_now();
+
+	while (f->len - off >= sizeof(*hdr)) {
+		hdr = (struct gb_operation_msg_hdr *)(f->buf + off);
+		msize = le16toh(hdr->size);
+
+		if (msize < sizeof(*hdr) || msize > msg_size_max) {
+			gbsim_error("bad message size %hu, dropping %zu bytes\n",
+				    msize, f->len - off);
+			off = f->len;
+			break;
+		}
 
-		rsize = read(from_ap, cport_rbuf, ES1_MSG_SIZE);
-		if (rsize < 0) {
-			gbsim_error("error %zd receiving from AP\n", rsize);
-			return NULL;
+		if (f->len - off < msize)
+			break;
+
+		/* Retreive the cport id stored in the header pad bytes */
+		hd_cport_id = hdr->pad[1] << 8 | hdr->pad[0];
+		if (hd_cport_id >= GBSIM_BRIDGE_CPORTS) {
+			gbsim_error("message for out of range cport id %hu dropped\n",
+				    hd_cport_id);
+			off += msize;
+			continue;
 		}
 
-		recv_handler(cport_rbuf, rsize, cport_tbuf, sizeof(cport_tbuf));
+		msg = msg_get();
+		memcpy(msg->buf, hdr, msize);
+		msg->size = msize;
+		msg->rx_ns = rx_ns;
+		msg->hd_cport_id = bridge_cport_id(f->bridge, hd_cport_id);
+		trace_msg(GBSIM_TRACE_RX, msg->hd_cport_id, hdr);
+		capture_msg(GBSIM_TRACE_RX, msg->hd_cport_id, hdr, msize);
+		record_msg(msg->hd_cport_id, hdr, msize);
+
+		/* Responses complete their operation before any queueing */
+		if (hdr->type & OP_RESPONSE)
+			operation_complete(msg->hd_cport_id,
+					   le16toh(hdr->operation_id), hdr->type);
+
+		dispatch_submit(msg);
+		off += msize;
+		count++;
+	}
+
+	f->len -= off;
+	if (f->len && off)
+		memmove(f->buf, f->buf + off, f->len);
+
+	return count;
+}
+
+static void recv_thread_free(void *arg)
+{
+	free(arg);
+}
+
+/*
+ * Repeatedly perform blocking reads from fd to receive messages arriving
+ * from the AP, and hand each of them over to the CPort workers. A single
+ * read may carry several messages, or only part of one. For a stream that
+ * can be closed, a read of 0 bytes ends it and 0 is returned; on a USB
+ * endpoint it is only a zero-length packet. Returns a negative error if a
+ * read fails.
+ */
+int rx_stream(struct gbsim_bridge *bridge, int fd, bool closable)
+{
+	struct gbsim_framer f = { .bridge = bridge, .len = 0, .size = rx_size };
+	ssize_t rsize;
+	int ret = 0;
+
+	f.buf = buf_alloc(f.size);
+	if (!f.buf)
+		return -ENOMEM;
+
+	pthread_cleanup_push(recv_thread_free, f.buf);
+	while (1) {
+		rsize = read(fd, f.buf + f.len, f.size - f.len);
+		if (rsize < 0) {
+			if (errno == EINTR)
+				continue;
+			/* Warm restart: the next read waits for the link */
+			if (errno == ESHUTDOWN && warm_restart) {
+				f.len = 0;
+				continue;
+			}
+			ret = -errno;
+			gbsim_error("error %d receiving from AP\n", ret);
+			break;
+		}
+		if (rsize == 0 && closable)
+			break;
 
-		memset(cport_rbuf, 0, sizeof(cport_rbuf));
-		memset(cport_tbuf, 0, sizeof(cport_tbuf));
+		rx_frame(&f, rsize);
 	}
+	pthread_cleanup_pop(1);
+
+	return ret;
+}
+
+/* Receives from a bulk-OUT endpoint; param is bridge * GBSIM_EP_PAIRS_MAX + pair */
+void *recv_thread(void *param)
+{
+	struct gbsim_bridge *bridge = &bridges[(intptr_t)param / GBSIM_EP_PAIRS_MAX];
+
+	rx_stream(bridge, bridge->from_ap[(intptr_t)param % GBSIM_EP_PAIRS_MAX],
+		  false);
+
+	return NULL;
 }
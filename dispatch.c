@@ -0,0 +1,184 @@
+/*
+ * Greybus Simulator: CPort message dispatch
+ *
+ * Copyright 2015 Google Inc.
+ * Copyright 2015 Linaro Ltd.
+ *
+ * Provided under the three clause BSD license found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gbsim.h"
+
+/*
+ * Messages arriving from the AP are read into a fixed set of slots by the
+ * receive thread, and handed to a pool of worker threads which run the
+ * protocol handlers. A message is always queued to the worker selected by
+ * its hd_cport_id, so messages for a given CPort are handled in the order
+ * they were received, while a slow handler on one CPort no longer stalls
+ * the others.
+ */
+#define MSG_SLOTS		64
+
+struct gbsim_worker {
+	pthread_t		thread;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	struct gbsim_msg	*head;
+	struct gbsim_msg	*tail;
+	bool			terminate;
+};
+
+static struct gbsim_msg msg_slots[MSG_SLOTS];
+static struct gbsim_msg *free_slots;
+static pthread_mutex_t free_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t free_cond = PTHREAD_COND_INITIALIZER;
+
+static struct gbsim_worker *workers;
+static int workers_started;
+
+static void msg_get_cleanup(void *arg)
+{
+	pthread_mutex_unlock(&free_lock);
+}
+
+/*
+ * Take a free message slot, waiting for one to be returned by a worker if
+ * they are all in use. This is a cancellation point.
+ */
+struct gbsim_msg *msg_get(void)
+{
+	struct gbsim_msg *msg;
+
+	pthread_mutex_lock(&free_lock);
+	pthread_cleanup_push(msg_get_cleanup, NULL);
+	while (!free_slots)
+		pthread_cond_wait(&free_cond, &free_lock);
+	msg = free_slots;
+	free_slots = msg->next;
+	pthread_cleanup_pop(1);
+
+	msg->next = NULL;
+	return msg;
+}
+
+void msg_put(struct gbsim_msg *msg)
+{
+	pthread_mutex_lock(&free_lock);
+	msg->next = free_slots;
+	free_slots = msg;
+	pthread_cond_signal(&free_cond);
+	pthread_mutex_unlock(&free_lock);
+}
+
+void dispatch_submit(struct gbsim_msg *msg)
+{
+	struct gbsim_worker *w = &workers[msg->hd_cport_id % worker_count];
+
+	pthread_mutex_lock(&w->lock);
+	if (w->tail)
+		w->tail->next = msg;
+	else
+		w->head = msg;
+	w->tail = msg;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+}
+
+static void *worker_thread(void *param)
+{
+	struct gbsim_worker *w = param;
+	struct gbsim_txbuf *tb;
+	struct gbsim_msg *msg;
+
+	while (1) {
+		pthread_mutex_lock(&w->lock);
+		while (!w->head && !w->terminate)
+			pthread_cond_wait(&w->cond, &w->lock);
+		if (w->terminate) {
+			pthread_mutex_unlock(&w->lock);
+			break;
+		}
+		msg = w->head;
+		w->head = msg->next;
+		if (!w->head)
+			w->tail = NULL;
+		pthread_mutex_unlock(&w->lock);
+
+		/* The handler builds its response directly in a pooled buffer */
+		tb = txbuf_acquire();
+		tb->rx_ns = msg->rx_ns;
+		txbuf_set_current(tb);
+
+		recv_handler(msg->hd_cport_id, msg->buf, msg->size, tb->buf,
+			     msg_size_max);
+
+		txbuf_put_current();
+		msg_put(msg);
+	}
+
+	return NULL;
+}
+
+int dispatch_init(void)
+{
+	size_t stride = buf_stride(msg_size_max);
+	char *pool;
+	int i, ret;
+
+	pool = buf_pool_alloc(MSG_SLOTS, msg_size_max);
+	if (!pool)
+		return -ENOMEM;
+
+	for (i = 0; i < MSG_SLOTS; i++) {
+		msg_slots[i].buf = pool + i * stride;
+		msg_slots[i].next = free_slots;
+		free_slots = &msg_slots[i];
+	}
+
+	workers = calloc(worker_count, sizeof(*workers));
+	if (!workers) {
+		gbsim_error("failed to allocate %d workers\n", worker_count);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < worker_count; i++) {
+		pthread_mutex_init(&workers[i].lock, NULL);
+		pthread_cond_init(&workers[i].cond, NULL);
+		ret = pthread_create(&workers[i].thread, NULL, worker_thread,
+				     &workers[i]);
+		if (ret) {
+			gbsim_error("can't create worker thread %d\n", i);
+			dispatch_cleanup();
+			return -ret;
+		}
+		workers_started++;
+	}
+
+	gbsim_debug("%d CPort workers started\n", worker_count);
+
+	return 0;
+}
+
+void dispatch_cleanup(void)
+{
+	int i;
+
+	for (i = 0; i < workers_started; i++) {
+		pthread_mutex_lock(&workers[i].lock);
+		workers[i].terminate = true;
+		pthread_cond_signal(&workers[i].cond);
+		pthread_mutex_unlock(&workers[i].lock);
+		pthread_join(workers[i].thread, NULL);
+	}
+	workers_started = 0;
+
+	free(workers);
+	workers = NULL;
+}
@@ -10,141 +10,202 @@
 #include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <poll.h>
 #include <pthread.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <linux/usb/functionfs.h>
 
 #include "gbsim.h"
-#include "config.h"
 
-#define FFS_PREFIX	"/dev/ffs-gbsim/"
-#define FFS_GBEMU_EP0	FFS_PREFIX"ep0"
-#define FFS_GBEMU_SVC	FFS_PREFIX"ep1"
-#define FFS_GBEMU_IN	FFS_PREFIX"ep2"
-#define FFS_GBEMU_OUT	FFS_PREFIX"ep3"
+/* Under each bridge's ffs_dir; bulk pair n is ep(2n + 2) in and ep(2n + 3) out */
+#define FFS_GBEMU_EP0	"%sep0"
+#define FFS_GBEMU_SVC	"%sep1"
+#define FFS_GBEMU_EP	"%sep%d"
 
 #define STR_INTERFACE	"gbsim"
 
 #define NEVENT		5
 
-int control = -ENXIO;
-int to_ap = -ENXIO;
-int from_ap = -ENXIO;
-
-static pthread_t recv_pthread;
+/*
+ * Every bridge has its own gadget and functionfs instance, endpoint files
+ * and receive threads, all kept in its struct gbsim_bridge.
+ *
+ * With warm_restart, a DISABLE only marks the link down: the endpoint
+ * files stay open and their receive threads wait in read() for the next
+ * ENABLE, and the CPorts and manifests are kept. On ENABLE only the SVC
+ * handshake is replayed, and the interfaces present are announced again.
+ */
+static usbg_state *s;
 
-#define GBSIM_LEGACY_DESCRIPTORS
+/*
+ * Held by the outbound scheduler while it writes to the bulk-IN endpoints,
+ * so an endpoint is never closed, and its fd reused, under a write.
+ */
+static pthread_mutex_t send_lock = PTHREAD_MUTEX_INITIALIZER;
 
-/* 
+/*
  * Descriptors:
  *
  * EP0 [control]	- Ch9 and SVC inbound messages
  * EP1 [interrupt in]	- SVC outbound events/messages
  * EP2 [bulk in]	- CPort outbound messages
  * EP3 [bulk out]	- CPort inbound messages
+ *
+ * With ep_pairs above 1, EP4/EP5 and so on are further bulk in/out pairs,
+ * and each hd_cport_id is carried by the pair ep_pair() picks for it.
+ *
+ * Full and high speed descriptors are always offered; SuperSpeed ones,
+ * which need the V2 format, only with usb_max_speed set to super. The bulk
+ * endpoints use bulk_packet_size at full speed, the only speed where USB
+ * leaves a choice.
  */
-static const struct {
-	struct {
-		__le32 magic;
-		__le32 length;
-#ifndef GBSIM_LEGACY_DESCRIPTORS
-		__le32 flags;
-#endif
-		__le32 fs_count;
-		__le32 hs_count;
-	} __attribute__((packed)) header;
-	struct {
-		struct usb_interface_descriptor intf;
-		struct usb_endpoint_descriptor_no_audio svc_in;
-		struct usb_endpoint_descriptor_no_audio to_ap;
-		struct usb_endpoint_descriptor_no_audio from_ap;
-	} __attribute__((packed)) fs_descs, hs_descs;
-} __attribute__((packed)) descriptors = {
-	.header = {
+#define GBSIM_INTF_DESC(endpoints) {				\
+	.bLength = USB_DT_INTERFACE_SIZE,			\
+	.bDescriptorType = USB_DT_INTERFACE,			\
+	.bNumEndpoints = endpoints,				\
+	.bInterfaceClass = USB_CLASS_VENDOR_SPEC,		\
+	.iInterface = 1,					\
+}
+
+#define GBSIM_EP_DESC(addr, attr, size, interval) {		\
+	.bLength = USB_DT_ENDPOINT_SIZE,			\
+	.bDescriptorType = USB_DT_ENDPOINT,			\
+	.bEndpointAddress = addr,				\
+	.bmAttributes = attr,					\
+	.wMaxPacketSize = htole16(size),			\
+	.bInterval = interval,					\
+}
+
+#define GBSIM_SS_COMP_DESC(burst, bytes) {			\
+	.bLength = USB_DT_SS_EP_COMP_SIZE,			\
+	.bDescriptorType = USB_DT_SS_ENDPOINT_COMP,		\
+	.bMaxBurst = burst,					\
+	.wBytesPerInterval = htole16(bytes),			\
+}
+
+/* Largest packets of the interrupt and bulk endpoints at each speed */
+struct gbsim_speed {
+	uint16_t int_size;
+	uint16_t bulk_size;
+	bool ss;
+};
+
+static const struct gbsim_speed fs_speed = { 64, 64, false };
+static const struct gbsim_speed hs_speed = { 512, 512, false };
+static const struct gbsim_speed ss_speed = { 512, 1024, true };
+
+/* Header with the flags and three counts, then every speed's descriptors */
+#define GBSIM_SPEED_DESCS_MAX					\
+	(USB_DT_INTERFACE_SIZE +				\
+	 (1 + 2 * GBSIM_EP_PAIRS_MAX) *				\
+	 (USB_DT_ENDPOINT_SIZE + USB_DT_SS_EP_COMP_SIZE))
+
+static unsigned char descriptors[6 * sizeof(__le32) +
+				 3 * GBSIM_SPEED_DESCS_MAX];
+
+static size_t descriptors_put(size_t off, const void *data, size_t size)
+{
+	memcpy(descriptors + off, data, size);
+	return off + size;
+}
+
+static size_t descriptors_put_le32(size_t off, uint32_t val)
+{
+	__le32 le = htole32(val);
+
+	return descriptors_put(off, &le, sizeof(le));
+}
+
+/* An endpoint, followed at SuperSpeed by its companion */
+static size_t descriptors_put_ep(size_t off, const struct gbsim_speed *sp,
+				 uint8_t addr, uint8_t attr, uint16_t size,
+				 uint8_t interval, uint8_t burst)
+{
+	struct usb_endpoint_descriptor_no_audio ep =
+		GBSIM_EP_DESC(addr, attr, size, interval);
+	struct usb_ss_ep_comp_descriptor comp =
+		GBSIM_SS_COMP_DESC(burst,
+				   attr == USB_ENDPOINT_XFER_INT ? size : 0);
+
+	off = descriptors_put(off, &ep, sizeof(ep));
+	if (sp->ss)
+		off = descriptors_put(off, &comp, sizeof(comp));
+
+	return off;
+}
+
+static size_t descriptors_put_speed(size_t off, const struct gbsim_speed *sp)
+{
+	struct usb_interface_descriptor intf =
+		GBSIM_INTF_DESC(1 + 2 * ep_pairs);
+	uint16_t bulk_size = sp->bulk_size;
+	uint8_t burst = sp->ss ? max_burst : 0;
+	int i;
+
+	/* High speed and SuperSpeed bulk endpoints have one valid size */
+	if (bulk_packet_size && sp == &fs_speed)
+		bulk_size = bulk_packet_size;
+
+	off = descriptors_put(off, &intf, sizeof(intf));
+	off = descriptors_put_ep(off, sp, 1 | USB_DIR_IN,
+				 USB_ENDPOINT_XFER_INT, sp->int_size, 10, 0);
+	for (i = 0; i < ep_pairs; i++) {
+		off = descriptors_put_ep(off, sp, (2 * i + 2) | USB_DIR_IN,
+					 USB_ENDPOINT_XFER_BULK, bulk_size, 0,
+					 burst);
+		off = descriptors_put_ep(off, sp, (2 * i + 3) | USB_DIR_OUT,
+					 USB_ENDPOINT_XFER_BULK, bulk_size, 0,
+					 burst);
+	}
+
+	return off;
+}
+
+/* Returns the length of the descriptors to write to ep0 */
+static size_t descriptors_build(void)
+{
+	bool super = usb_max_speed == USB_SPEED_SUPER;
+	int count = 2 + 2 * ep_pairs;
+	size_t off, length_off;
+
 #ifdef GBSIM_LEGACY_DESCRIPTORS
-		.magic = htole32(FUNCTIONFS_DESCRIPTORS_MAGIC),
+	off = descriptors_put_le32(0, FUNCTIONFS_DESCRIPTORS_MAGIC);
+	length_off = off;
+	off = descriptors_put_le32(off, 0);
 #else
-		.magic = htole32(FUNCTIONFS_DESCRIPTORS_MAGIC_V2),
-		.flags = htole32(FUNCTIONFS_HAS_FS_DESC |
-				     FUNCTIONFS_HAS_HS_DESC),
+	off = descriptors_put_le32(0, FUNCTIONFS_DESCRIPTORS_MAGIC_V2);
+	length_off = off;
+	off = descriptors_put_le32(off, 0);
+	off = descriptors_put_le32(off, FUNCTIONFS_HAS_FS_DESC |
+				   FUNCTIONFS_HAS_HS_DESC |
+				   (super ? FUNCTIONFS_HAS_SS_DESC : 0));
 #endif
-		.length = htole32(sizeof descriptors),
-		.fs_count = htole32(4),
-		.hs_count = htole32(4),
-	},
-	.fs_descs = {
-		.intf = {
-			.bLength = sizeof descriptors.fs_descs.intf,
-			.bDescriptorType = USB_DT_INTERFACE,
-			.bNumEndpoints = 3,
-			.bInterfaceClass = USB_CLASS_VENDOR_SPEC,
-			.iInterface = 1,
-		},
-		.svc_in = {
-			.bLength = sizeof descriptors.fs_descs.svc_in,
-			.bDescriptorType = USB_DT_ENDPOINT,
-			.bEndpointAddress = 1 | USB_DIR_IN,
-			.bmAttributes = USB_ENDPOINT_XFER_INT,
-			.bInterval = 10,
-			.wMaxPacketSize = 64
-		},
-		.to_ap = {
-			.bLength = sizeof descriptors.fs_descs.to_ap,
-			.bDescriptorType = USB_DT_ENDPOINT,
-			.bEndpointAddress = 2 | USB_DIR_IN,
-			.bmAttributes = USB_ENDPOINT_XFER_BULK,
-			.wMaxPacketSize = 64
-		},
-		.from_ap = {
-			.bLength = sizeof descriptors.fs_descs.from_ap,
-			.bDescriptorType = USB_DT_ENDPOINT,
-			.bEndpointAddress = 3 | USB_DIR_OUT,
-			.bmAttributes = USB_ENDPOINT_XFER_BULK,
-			.wMaxPacketSize = 64
-		},
-	},
-	.hs_descs = {
-		.intf = {
-			.bLength = sizeof descriptors.hs_descs.intf,
-			.bDescriptorType = USB_DT_INTERFACE,
-			.bNumEndpoints = 3,
-			.bInterfaceClass = USB_CLASS_VENDOR_SPEC,
-			.iInterface = 1,
-		},
-		.svc_in = {
-			.bLength = sizeof descriptors.hs_descs.svc_in,
-			.bDescriptorType = USB_DT_ENDPOINT,
-			.bEndpointAddress = 1 | USB_DIR_IN,
-			.bmAttributes = USB_ENDPOINT_XFER_INT,
-			.bInterval = 10,
-			.wMaxPacketSize = 512,
-		},
-		.to_ap = {
-			.bLength = sizeof descriptors.hs_descs.to_ap,
-			.bDescriptorType = USB_DT_ENDPOINT,
-			.bEndpointAddress = 2 | USB_DIR_IN,
-			.bmAttributes = USB_ENDPOINT_XFER_BULK,
-			.wMaxPacketSize = 512,
-		},
-		.from_ap = {
-			.bLength = sizeof descriptors.hs_descs.from_ap,
-			.bDescriptorType = USB_DT_ENDPOINT,
-			.bEndpointAddress = 3 | USB_DIR_OUT,
-			.bmAttributes = USB_ENDPOINT_XFER_BULK,
-			.wMaxPacketSize = 512,
-		},
-	},
-};
+	off = descriptors_put_le32(off, count);
+	off = descriptors_put_le32(off, count);
+	if (super)
+		off = descriptors_put_le32(off, 2 * count - 1);
+
+	off = descriptors_put_speed(off, &fs_speed);
+	off = descriptors_put_speed(off, &hs_speed);
+	if (super)
+		off = descriptors_put_speed(off, &ss_speed);
+
+	descriptors_put_le32(length_off, off);
+
+	return off;
+}
 
 static const struct {
 	struct usb_functionfs_strings_head header;
@@ -191,33 +252,76 @@ void cleanup_endpoint(int ep_fd, char *ep_name)
 		gbsim_error("%s: close \n", ep_name);
 }
 
-static int enable_endpoints(void)
+/* Spreads a bridge's CPorts over its bulk pairs; the AP has to agree */
+int ep_pair(uint16_t hd_cport_id)
 {
-	int ret;
+	return cport_wire_id(hd_cport_id) % ep_pairs;
+}
 
-	/* Start SVC/CPort endpoints here */
-	gbsim_debug("Start SVC/CPort endpoints\n");
+static int open_endpoints(struct gbsim_bridge *bridge)
+{
+	char name[sizeof(bridge->ffs_dir) + 8];
+	int i, ret;
+
+	for (i = 0; i < ep_pairs; i++) {
+		snprintf(name, sizeof(name), FFS_GBEMU_EP, bridge->ffs_dir,
+			 2 * i + 2);
+		bridge->to_ap[i] = open(name, O_RDWR);
+		if (bridge->to_ap[i] < 0)
+			return bridge->to_ap[i];
+
+		snprintf(name, sizeof(name), FFS_GBEMU_EP, bridge->ffs_dir,
+			 2 * i + 3);
+		bridge->from_ap[i] = open(name, O_RDWR);
+		if (bridge->from_ap[i] < 0)
+			return bridge->from_ap[i];
+	}
 
-	to_ap = open(FFS_GBEMU_IN, O_RDWR);
-	if (to_ap < 0)
-		return to_ap;
+	if (aio_depth) {
+		ret = ffs_aio_start(bridge);
+		if (ret < 0)
+			return ret;
+	} else {
+		/* Each bulk-OUT endpoint has its own receive thread */
+		for (i = 0; i < ep_pairs; i++) {
+			ret = pthread_create(&bridge->recv_pthread[i], NULL,
+					     recv_thread,
+					     (void *)(intptr_t)(bridge->id * GBSIM_EP_PAIRS_MAX + i));
+			if (ret < 0) {
+				perror("can't create cport thread");
+				return ret;
+			}
+		}
+	}
 
-	from_ap = open(FFS_GBEMU_OUT, O_RDWR);
-	if (from_ap < 0)
-		return from_ap;
+	bridge->endpoints_open = true;
 
-	ret = pthread_create(&recv_pthread, NULL, recv_thread, NULL);
-	if (ret < 0) {
-		perror("can't create cport thread");
-		return ret;
+	return 0;
+}
+
+static int enable_endpoints(struct gbsim_bridge *bridge)
+{
+	int ret;
+
+	if (bridge->endpoints_open) {
+		gbsim_debug("Resume SVC/CPort endpoints\n");
+	} else {
+		/* Start SVC/CPort endpoints here */
+		gbsim_debug("Start SVC/CPort endpoints\n");
+
+		ret = open_endpoints(bridge);
+		if (ret < 0)
+			return ret;
 	}
+	__atomic_store_n(&bridge->link_up, true, __ATOMIC_RELEASE);
 
 	/*
 	 * Start communication with the AP in following sequence:
 	 * - Send a svc protocol version request
 	 * - For a valid response, send the 'hello' message.
 	 */
-	ret = svc_request_send(GB_SVC_TYPE_PROTOCOL_VERSION, AP_INTF_ID);
+	ret = svc_request_send(bridge, GB_SVC_TYPE_PROTOCOL_VERSION,
+			       AP_INTF_ID);
 	if (ret) {
 		gbsim_error("Failed to send svc version request (%d)\n", ret);
 		return ret;
@@ -226,23 +330,60 @@ static int enable_endpoints(void)
 	return 0;
 }
 
-static void disable_endpoints(void)
+/* With AIO, writes stop too: from then on they are dropped */
+static void stop_receiving(struct gbsim_bridge *bridge)
 {
-	gbsim_debug("Disable SVC/CPort endpoints\n");
+	int i;
 
-	if (to_ap < 0 || from_ap < 0)
+	if (aio_depth) {
+		ffs_aio_stop();
 		return;
+	}
+
+	for (i = 0; i < ep_pairs; i++) {
+		pthread_cancel(bridge->recv_pthread[i]);
+		pthread_join(bridge->recv_pthread[i], NULL);
+	}
+}
+
+static void disable_endpoints(struct gbsim_bridge *bridge)
+{
+	int i;
+
+	gbsim_debug("Disable SVC/CPort endpoints\n");
 
-	pthread_cancel(recv_pthread);
-	pthread_join(recv_pthread, NULL);
+	__atomic_store_n(&bridge->link_up, false, __ATOMIC_RELEASE);
+	bridge->endpoints_open = false;
 
-	close(from_ap);
-	from_ap = -EINVAL;
-	close(to_ap);
-	to_ap = -EINVAL;
+	for (i = 0; i < ep_pairs; i++)
+		if (bridge->to_ap[i] < 0 || bridge->from_ap[i] < 0)
+			return;
+
+	stop_receiving(bridge);
+
+	/* A write that saw the link up before it went down is done with */
+	pthread_mutex_lock(&send_lock);
+	for (i = 0; i < ep_pairs; i++) {
+		close(bridge->from_ap[i]);
+		bridge->from_ap[i] = -EINVAL;
+		close(bridge->to_ap[i]);
+		bridge->to_ap[i] = -EINVAL;
+	}
+	pthread_mutex_unlock(&send_lock);
 }
 
-static int read_control(void)
+/* Warm restart: keep everything but what the AP will have forgotten */
+static void suspend_endpoints(struct gbsim_bridge *bridge)
+{
+	gbsim_debug("Suspend SVC/CPort endpoints\n");
+
+	__atomic_store_n(&bridge->link_up, false, __ATOMIC_RELEASE);
+
+	/* No answers will come for these; give their credits back now */
+	operation_cancel_all(bridge);
+}
+
+static int read_control(struct gbsim_bridge *bridge)
 {
 	struct usb_functionfs_event event[NEVENT];
 	int i, nevent, ret;
@@ -257,13 +398,11 @@ static int read_control(void)
 		[FUNCTIONFS_RESUME] = "RESUME",
 	};
 
-	ret = read(control, &event, sizeof(event));
+	ret = read(bridge->control, &event, sizeof(event));
 	if (ret < 0) {
-		if (errno == EAGAIN) {
-			sleep(1);
-			return ret;
-		}
-		perror("ep0 read after poll");
+		if (errno == EAGAIN || errno == EINTR)
+			return 0;
+		perror("ep0 read");
 		return ret;
 	}
 	nevent = ret/ sizeof event[0];
@@ -277,10 +416,13 @@ static int read_control(void)
 		case FUNCTIONFS_UNBIND:
 			break;
 		case FUNCTIONFS_ENABLE:
-			enable_endpoints();
+			enable_endpoints(bridge);
 			break;
 		case FUNCTIONFS_DISABLE:
-			disable_endpoints();
+			if (warm_restart)
+				suspend_endpoints(bridge);
+			else
+				disable_endpoints(bridge);
 			break;
 		case FUNCTIONFS_SETUP:
 			break;
@@ -296,84 +438,197 @@ static int read_control(void)
 	return ret;
 }
 
-static void functionfs_init_gb(void)
+static void functionfs_init_gb(struct gbsim_bridge *bridge)
 {
+	char name[sizeof(bridge->ffs_dir) + 8];
 	int ret;
 
-	control = open(FFS_GBEMU_EP0, O_RDWR);
-	if (control < 0) {
-		perror(FFS_GBEMU_EP0);
-		control = -errno;
+	snprintf(name, sizeof(name), FFS_GBEMU_EP0, bridge->ffs_dir);
+	bridge->control = open(name, O_RDWR);
+	if (bridge->control < 0) {
+		perror(name);
+		bridge->control = -errno;
 		return;
 	}
 
-	ret = write(control, &descriptors, sizeof(descriptors));
+	ret = write(bridge->control, descriptors, descriptors_build());
 	if (ret < 0) {
 		perror("write dev descriptors");
-		close(control);
-		control = -errno;
+		close(bridge->control);
+		bridge->control = -errno;
 		return;
 	}
 
-	ret = write(control, &strings, sizeof(strings));
+	ret = write(bridge->control, &strings, sizeof(strings));
 	if (ret < 0) {
 		perror("write dev strings");
-		close(control);
-		control = -errno;
+		close(bridge->control);
+		bridge->control = -errno;
 		return;
 	}
 
 	return;
 }
 
-int functionfs_loop(void)
+static void functionfs_control_cb(int fd, uint32_t events, void *arg)
 {
-	struct pollfd ep_poll[1];
-	int ret;
+	/* TODO: What to do with HUP? */
+	if (!(events & EPOLLIN))
+		return;
 
-	do {
-		/* Always listen on control */
-		ep_poll[0].fd = control;
-		ep_poll[0].events = POLLIN | POLLHUP;
+	if (read_control(arg) < 0)
+		reactor_stop();
+}
 
-		ret = poll(ep_poll, 1, -1);
-		if (ret < 0) {
-			perror("poll");
-			break;
+static int functionfs_loop(void)
+{
+	int i, ret;
+
+	/* Always listen on every bridge's control */
+	for (i = 0; i < bridge_count; i++) {
+		ret = reactor_add(bridges[i].control, EPOLLIN,
+				  functionfs_control_cb, &bridges[i]);
+		if (ret < 0)
+			return ret;
+	}
+
+	ret = reactor_run();
+
+	/*
+	 * Nothing more is handed to the workers. The endpoints stay open
+	 * for what they still send, until functionfs_cleanup().
+	 */
+	for (i = 0; i < bridge_count; i++)
+		if (bridges[i].endpoints_open) {
+			stop_receiving(&bridges[i]);
+			bridges[i].endpoints_open = false;
 		}
 
-		/* TODO: What to do with HUP? */
-		if (ep_poll[0].revents & POLLIN) {
-			ret = read_control();
-			if (ret < 0) {
-				if (errno == EAGAIN)
-					continue;
-				goto done;
-			}
+	return ret;
+}
+
+static void functionfs_send(struct gbsim_txbuf **batch, int count)
+{
+	struct gbsim_bridge *bridge;
+	struct iovec iov[count];
+	int fd[count];
+	ssize_t nbytes;
+	int i, n, first;
+
+	pthread_mutex_lock(&send_lock);
+
+	/* Nothing written while its bridge's link is down would reach the AP */
+	for (i = n = 0; i < count; i++) {
+		bridge = cport_bridge(batch[i]->hd_cport_id);
+		if (!__atomic_load_n(&bridge->link_up, __ATOMIC_ACQUIRE)) {
+			txbuf_release(batch[i]);
+			continue;
 		}
-	} while (1);
+		txbuf_to_wire(batch[i]);
+		batch[n++] = batch[i];
+	}
 
-	return 0;
+	/* Asynchronous writes are already pipelined, one per buffer */
+	if (aio_depth) {
+		for (i = 0; i < n; i++)
+			ffs_aio_write(batch[i], batch[i]->size);
+		pthread_mutex_unlock(&send_lock);
+		return;
+	}
 
-done:
-	return ret;
+	for (i = 0; i < n; i++) {
+		bridge = cport_bridge(batch[i]->hd_cport_id);
+		fd[i] = bridge->to_ap[ep_pair(batch[i]->hd_cport_id)];
+		iov[i].iov_base = batch[i]->buf;
+		iov[i].iov_len = batch[i]->size;
+	}
+
+	/* One write per run of messages for the same bulk-IN endpoint */
+	for (first = 0; first < n; first = i) {
+		for (i = first + 1; i < n; i++)
+			if (fd[i] != fd[first])
+				break;
+
+		nbytes = writev(fd[first], &iov[first], i - first);
+		if (nbytes < 0)
+			gbsim_error("failed to send %d messages to AP: %s\n",
+				    i - first, strerror(errno));
+	}
+	pthread_mutex_unlock(&send_lock);
+
+	for (i = 0; i < n; i++)
+		txbuf_release(batch[i]);
 }
 
-int functionfs_init(void)
+static int functionfs_init_bridge(struct gbsim_bridge *bridge)
 {
-	/* Mount functionfs */
-	mkdir(FFS_PREFIX, S_IRWXU|S_IRWXG|S_IRWXO);
-	mount("gbsim", FFS_PREFIX, "functionfs", 0, NULL);
+	unsigned long configfs_us, mount_us, descs_us, enable_us;
+	struct timespec t;
+	int ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+
+	ret = gadget_create(&s, bridge);
+	if (ret < 0)
+		return ret;
+	configfs_us = phase_us(&t);
+
+	/* Mount functionfs; a reused gadget's instance is still mounted */
+	mkdir(bridge->ffs_dir, S_IRWXU|S_IRWXG|S_IRWXO);
+	mount(bridge->ffs_name, bridge->ffs_dir, "functionfs", 0, NULL);
+	mount_us = phase_us(&t);
 
 	/* Configure the Greybus emulator */
-	functionfs_init_gb();
+	functionfs_init_gb(bridge);
+	descs_us = phase_us(&t);
 
-	return 0;
+	ret = gadget_enable(s, bridge->g);
+	enable_us = phase_us(&t);
+
+	gbsim_event(GBSIM_LOG_INFO, "gadget_up",
+		    "gadget=%s us=%lu configfs_us=%lu mount_us=%lu descriptors_us=%lu enable_us=%lu",
+		    bridge->gadget_name,
+		    configfs_us + mount_us + descs_us + enable_us,
+		    configfs_us, mount_us, descs_us, enable_us);
+
+	return ret;
 }
 
-int functionfs_cleanup(void)
+static int functionfs_init(void)
 {
-	recv_thread_cleanup(NULL);
+	int i, ret;
+
+#ifdef GBSIM_LEGACY_DESCRIPTORS
+	if (usb_max_speed == USB_SPEED_SUPER) {
+		gbsim_error("SuperSpeed needs the V2 descriptor format\n");
+		return -EINVAL;
+	}
+#endif
+
+	for (i = 0; i < bridge_count; i++) {
+		ret = functionfs_init_bridge(&bridges[i]);
+		if (ret < 0)
+			return ret;
+	}
 
 	return 0;
 }
+
+static void functionfs_cleanup(void)
+{
+	int i;
+
+	for (i = 0; i < bridge_count; i++)
+		gadget_cleanup(bridges[i].g);
+	if (s)
+		usbg_cleanup(s);
+	recv_thread_cleanup(NULL);
+}
+
+const struct gbsim_transport functionfs_transport = {
+	.name		= "functionfs",
+	.init		= functionfs_init,
+	.loop		= functionfs_loop,
+	.send		= functionfs_send,
+	.cleanup	= functionfs_cleanup,
+};
@@ -8,16 +8,45 @@
  */
 
 #include <errno.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <usbg/usbg.h>
 
+#include <linux/usb/ch9.h>
+
 #include "gbsim.h"
 
 #define VENDOR		0xffff
 #define PRODUCT		0x0001
 
-int gadget_create(usbg_state **s, usbg_gadget **g)
+/*
+ * A gadget left behind by an earlier run with -k can be bound again as it
+ * is, provided it is the one this run would have built: same device
+ * attributes, and the functionfs function and the configuration present.
+ */
+static bool gadget_reusable(usbg_gadget *g, const char *ffs_name,
+			    const usbg_gadget_attrs *want)
 {
+	usbg_gadget_attrs have;
+
+	if (usbg_get_gadget_attrs(g, &have) != USBG_SUCCESS)
+		return false;
+
+	if (have.bcdUSB != want->bcdUSB ||
+	    have.bMaxPacketSize0 != want->bMaxPacketSize0 ||
+	    have.idVendor != want->idVendor ||
+	    have.idProduct != want->idProduct ||
+	    have.bcdDevice != want->bcdDevice)
+		return false;
+
+	return usbg_get_function(g, F_FFS, ffs_name) &&
+	       usbg_get_config(g, 1, NULL);
+}
+
+/* Create the bridge's gadget, and the library state first if need be */
+int gadget_create(usbg_state **s, struct gbsim_bridge *bridge)
+{
+	usbg_gadget **g = &bridge->g;
 	usbg_config *c;
 	usbg_function *f;
 	int ret = -EINVAL;
@@ -44,15 +73,43 @@ int gadget_create(usbg_state **s, usbg_gadget **g)
 			"AP Bridge"
 	};
 
-	usbg_ret = usbg_init("/sys/kernel/config", s);
-	if (usbg_ret != USBG_SUCCESS) {
-		gbsim_error("Error on USB gadget init\n");
-		gbsim_error("Error: %s : %s\n", usbg_error_name(usbg_ret),
-			    usbg_strerror(usbg_ret));
-		goto out1;
+	/* SuperSpeed needs USB 3.0, with a 512 byte (2^9) ep0 */
+	if (usb_max_speed == USB_SPEED_SUPER) {
+		g_attrs.bcdUSB = 0x0300;
+		g_attrs.bMaxPacketSize0 = 0x09;
+	}
+
+	if (!*s) {
+		usbg_ret = usbg_init("/sys/kernel/config", s);
+		if (usbg_ret != USBG_SUCCESS) {
+			gbsim_error("Error on USB gadget init\n");
+			gbsim_error("Error: %s : %s\n", usbg_error_name(usbg_ret),
+				    usbg_strerror(usbg_ret));
+			goto out1;
+		}
+	}
+
+	if (gadget_keep) {
+		*g = usbg_get_gadget(*s, bridge->gadget_name);
+		if (*g && gadget_reusable(*g, bridge->ffs_name, &g_attrs)) {
+			/* Still bound if the last run did not exit cleanly */
+			if (usbg_get_gadget_udc(*g))
+				usbg_disable_gadget(*g);
+			gbsim_info("USB gadget %s reused\n", bridge->gadget_name);
+			return 0;
+		}
+
+		if (*g) {
+			gbsim_info("USB gadget %s does not match, recreating it\n",
+				   bridge->gadget_name);
+			usbg_disable_gadget(*g);
+			usbg_rm_gadget(*g, USBG_RM_RECURSE);
+			*g = NULL;
+		}
 	}
 
-	usbg_ret = usbg_create_gadget(*s, "g1", &g_attrs, &g_strs, g);
+	usbg_ret = usbg_create_gadget(*s, bridge->gadget_name, &g_attrs, &g_strs,
+				      g);
 	if (usbg_ret != USBG_SUCCESS) {
 		gbsim_error("Error on create gadget\n");
 		gbsim_error("Error: %s : %s\n", usbg_error_name(usbg_ret),
@@ -60,7 +117,7 @@ int gadget_create(usbg_state **s, usbg_gadget **g)
 		goto out2;
 	}
 
-	usbg_ret = usbg_create_function(*g, F_FFS, "gbsim", NULL, &f);
+	usbg_ret = usbg_create_function(*g, F_FFS, bridge->ffs_name, NULL, &f);
 	if (usbg_ret != USBG_SUCCESS) {
 		gbsim_error("Error creating gbsim function\n");
 		gbsim_error("Error: %s : %s\n", usbg_error_name(usbg_ret),
@@ -76,7 +133,7 @@ int gadget_create(usbg_state **s, usbg_gadget **g)
 		goto out2;
 	}
 
-	usbg_ret = usbg_add_config_function(c, "gbsim", f);
+	usbg_ret = usbg_add_config_function(c, bridge->ffs_name, f);
 	if (usbg_ret != USBG_SUCCESS) {
 		gbsim_error("Error adding gbsim configuration\n");
 		gbsim_error("Error: %s : %s\n", usbg_error_name(usbg_ret),
@@ -84,32 +141,38 @@ int gadget_create(usbg_state **s, usbg_gadget **g)
 		goto out2;
 	}
 
-	gbsim_info("USB gadget created\n");
+	gbsim_info("USB gadget %s created\n", bridge->gadget_name);
 
 	return 0;
 
 out2:
-	gadget_cleanup(*s, *g);
+	gadget_cleanup(*g);
+	*g = NULL;
 
 out1:
 	return ret;
 }
 
-int gadget_enable(usbg_gadget *g)
+/* Bind the gadget to the first UDC no other gadget is bound to */
+int gadget_enable(usbg_state *s, usbg_gadget *g)
 {
-	return usbg_enable_gadget(g, NULL);	
+	usbg_udc *u;
+
+	for (u = usbg_get_first_udc(s); u; u = usbg_get_next_udc(u))
+		if (!usbg_get_udc_gadget(u))
+			break;
+
+	return usbg_enable_gadget(g, u);
 }
 
-int gadget_cleanup(usbg_state *s, usbg_gadget *g)
+void gadget_cleanup(usbg_gadget *g)
 {
 	gbsim_debug("gadget_cleanup\n");
 
 	if (g) {
 		usbg_disable_gadget(g);
-		usbg_rm_gadget(g, USBG_RM_RECURSE);
+		/* With -k the gadget stays, unbound, for the next run */
+		if (!gadget_keep)
+			usbg_rm_gadget(g, USBG_RM_RECURSE);
 	}
-
-	usbg_cleanup(s);
-
-	return 0;
 }
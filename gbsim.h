@@ -11,11 +11,20 @@
 #ifndef __GBSIM_H
 #define __GBSIM_H
 
+/* Build options from configure, e.g. GBSIM_LOG_LEVEL, for every file */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #define __packed  __attribute__((__packed__))
 
 #include <endian.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <time.h>
 #include <usbg/usbg.h>
 
 #include <greybus_manifest.h>
@@ -25,6 +34,15 @@
 #define BIT(n)	(1UL << (n))
 #endif
 
+#ifndef ARRAY_SIZE
+#define ARRAY_SIZE(a)	(sizeof(a) / sizeof((a)[0]))
+#endif
+
+#ifndef container_of
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+#endif
+
 /* Wouldn't support types larger than 4 bytes */
 #define _ALIGNBYTES		(sizeof(uint32_t) - 1)
 #define ALIGN(p)		((typeof(p))(((unsigned)(p) + _ALIGNBYTES) & ~_ALIGNBYTES))
@@ -34,6 +52,24 @@ extern int i2c_adapter;
 extern int uart_portno;
 extern int uart_count;
 extern int verbose;
+extern int worker_count;
+extern size_t rx_size;
+extern int aio_depth;
+extern size_t coalesce_size;
+extern int credit_window;
+extern char *socket_path;
+extern unsigned long shm_requests;
+extern int usb_max_speed;
+extern int bulk_packet_size;
+extern int max_burst;
+extern int warm_restart;
+extern int gadget_keep;
+extern char *trace_path;
+extern char *stats_path;
+extern char *capture_path;
+extern char *record_path;
+extern char *replay_path;
+extern int replay_paced;
 extern char *hotplug_basedir;
 
 /* Matches up with the Greybus Protocol specification document */
@@ -44,15 +80,17 @@ extern char *hotplug_basedir;
 #define ENDO_ID 0x4755
 #define AP_INTF_ID 0x5
 
-extern int control;
-extern int to_ap;
-extern int from_ap;
+/* Bulk in/out endpoint pairs carrying CPort messages */
+#define GBSIM_EP_PAIRS_MAX	8
+
+extern int ep_pairs;
 
 struct gbsim_cport {
 	TAILQ_ENTRY(gbsim_cport) cnode;
 	uint16_t id;
 	uint16_t hd_cport_id;
 	int protocol;
+	const struct gbsim_protocol *proto;
 };
 
 struct gbsim_info {
@@ -61,7 +99,100 @@ struct gbsim_info {
 	TAILQ_HEAD(chead, gbsim_cport) cports;
 };
 
-extern struct gbsim_info info;
+/*
+ * Simulated AP bridges. Each has its own gadget, functionfs instance,
+ * hotplug directory, manifest and CPorts, and hands out hd_cport_ids from
+ * 0 on its link to the AP. Within gbsim, those are prefixed with the
+ * bridge number so that one hd_cport_id names a CPort of one bridge; the
+ * workers, the operation tracker and the outbound queues are shared.
+ */
+#define GBSIM_BRIDGES_MAX	16
+#define GBSIM_BRIDGE_SHIFT	12
+#define GBSIM_BRIDGE_CPORTS	(1 << GBSIM_BRIDGE_SHIFT)
+
+struct gbsim_bridge {
+	int id;
+	char gadget_name[16];
+	char ffs_name[16];
+	char ffs_dir[32];
+	char hotplug_dir[256];
+	struct gbsim_info info;
+	uint16_t hd_cport_id_counter;
+
+	/* functionfs */
+	usbg_gadget *g;
+	int control;
+	int to_ap[GBSIM_EP_PAIRS_MAX];
+	int from_ap[GBSIM_EP_PAIRS_MAX];
+	pthread_t recv_pthread[GBSIM_EP_PAIRS_MAX];
+	bool endpoints_open;
+	bool link_up;
+
+	/* Hotplug, and the interfaces to announce again to an AP starting over */
+	int notify_fd;
+	bool intf_present[UINT8_MAX + 1];
+};
+
+extern int bridge_count;
+extern struct gbsim_bridge bridges[GBSIM_BRIDGES_MAX];
+
+void bridges_init(void);
+
+/* The bridge a gbsim-wide hd_cport_id belongs to */
+static inline struct gbsim_bridge *cport_bridge(uint16_t hd_cport_id)
+{
+	return &bridges[hd_cport_id >> GBSIM_BRIDGE_SHIFT];
+}
+
+/* The gbsim-wide hd_cport_id of a bridge's own hd_cport_id */
+static inline uint16_t bridge_cport_id(const struct gbsim_bridge *bridge,
+				       uint16_t hd_cport_id)
+{
+	return bridge->id << GBSIM_BRIDGE_SHIFT | hd_cport_id;
+}
+
+/* The hd_cport_id the bridge's AP knows a CPort by */
+static inline uint16_t cport_wire_id(uint16_t hd_cport_id)
+{
+	return hd_cport_id & (GBSIM_BRIDGE_CPORTS - 1);
+}
+
+#define ES1_MSG_SIZE	(2 * 1024)
+
+/* Largest message to or from the AP, ES1_MSG_SIZE unless raised with -m */
+extern size_t msg_size_max;
+
+/* A message received from the AP, waiting to be handled by a CPort worker */
+struct gbsim_msg {
+	struct gbsim_msg *next;
+	uint16_t hd_cport_id;
+	size_t size;
+	uint64_t rx_ns;		/* when it was read, with -L */
+	char *buf;		/* msg_size_max bytes */
+};
+
+/* A link in a lock-free multi-producer, single-consumer queue */
+struct gbsim_qnode {
+	struct gbsim_qnode *next;
+};
+
+/* A message to the AP, built in place and written without further copies */
+struct gbsim_txbuf {
+	struct gbsim_txbuf *next;
+	struct gbsim_qnode qnode;
+	uint16_t hd_cport_id;
+	size_t size;
+	uint64_t rx_ns;		/* when the message it answers was read */
+	char *buf;		/* msg_size_max bytes */
+};
+
+/* Reassembles messages from the byte stream read from a bridge's AP */
+struct gbsim_framer {
+	struct gbsim_bridge *bridge;
+	char *buf;
+	size_t size;
+	size_t len;
+};
 
 /* CPorts */
 
@@ -134,24 +265,71 @@ struct op_msg {
 
 #define OP_RESPONSE			0x80
 
+/*
+ * Log levels. Messages above GBSIM_LOG_LEVEL, chosen with configure's
+ * --with-log-level, are compiled out together with the work done for
+ * their arguments; debug messages that are compiled in are still only
+ * printed with -v.
+ */
+#define GBSIM_LOG_ERROR		0
+#define GBSIM_LOG_INFO		1
+#define GBSIM_LOG_DEBUG		2
+
+#ifndef GBSIM_LOG_LEVEL
+#define GBSIM_LOG_LEVEL		GBSIM_LOG_DEBUG
+#endif
+
+#define gbsim_log_enabled(level)					\
+	(GBSIM_LOG_LEVEL >= (level) &&					\
+	 ((level) < GBSIM_LOG_DEBUG || verbose))
+
+/* Whether gbsim_debug() prints; guards work done only to log */
+#define gbsim_debug_enabled()	gbsim_log_enabled(GBSIM_LOG_DEBUG)
+
+extern int log_structured;
+
+void gbsim_log(int level, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+void gbsim_log_event(int level, const char *event, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
 /* debug/info/error macros */
 #define gbsim_debug(fmt, ...)						\
-        do { if (verbose) { fprintf(stdout, "[D] GBSIM: " fmt,  	\
-				  ##__VA_ARGS__); fflush(stdout); } } while (0)
+	do { if (gbsim_log_enabled(GBSIM_LOG_DEBUG))			\
+		gbsim_log(GBSIM_LOG_DEBUG, fmt, ##__VA_ARGS__); } while (0)
 #define gbsim_info(fmt, ...)						\
-        do { fprintf(stdout, "[I] GBSIM: " fmt, ##__VA_ARGS__); fflush(stdout); } while (0)
+	do { if (gbsim_log_enabled(GBSIM_LOG_INFO))			\
+		gbsim_log(GBSIM_LOG_INFO, fmt, ##__VA_ARGS__); } while (0)
 #define gbsim_error(fmt, ...)						\
-        do { fprintf(stderr, "[E] GBSIM: " fmt, ##__VA_ARGS__); fflush(stderr); } while (0)
+	do { gbsim_log(GBSIM_LOG_ERROR, fmt, ##__VA_ARGS__); } while (0)
 
+/*
+ * A structured record: an event name and key=value pairs, e.g.
+ * gbsim_event(GBSIM_LOG_INFO, "protocol_start", "protocol=%s us=%lu", ...)
+ */
+#define gbsim_event(level, event, fmt, ...)				\
+	do { if (gbsim_log_enabled(level))				\
+		gbsim_log_event(level, event, fmt, ##__VA_ARGS__); } while (0)
+
+/* Formats a line's worth of bytes at a time, not a call per byte */
 static inline void gbsim_dump(void *data, size_t size)
 {
-	char *buf = data;
-	int i;
-
-	fprintf(stdout, "[R] GBSIM: DUMP -> ");
-	for (i = 0; i < size; i++)
-		fprintf(stdout, "%02x ", buf[i]);
-	fprintf(stdout, "\n");
+	static const char hex[] = "0123456789abcdef";
+	unsigned char *buf = data;
+	char line[3 * 32];
+	size_t i, n;
+
+	fputs(log_structured ? "level=debug event=dump data=\"" :
+			       "[R] GBSIM: DUMP -> ", stdout);
+	for (i = 0; i < size; i += n) {
+		for (n = 0; n < 32 && i + n < size; n++) {
+			line[3 * n] = hex[buf[i + n] >> 4];
+			line[3 * n + 1] = hex[buf[i + n] & 0xf];
+			line[3 * n + 2] = ' ';
+		}
+		fwrite(line, 3, n, stdout);
+	}
+	fputs(log_structured ? "\"\n" : "\n", stdout);
 	fflush(stdout);
 }
 
@@ -161,72 +339,204 @@ static inline uint8_t cport_to_module_id(uint16_t cport)
 	return 1;
 }
 
-struct gbsim_cport *cport_find(uint16_t cport_id);
+void cport_read_lock(void);
+void cport_read_unlock(void);
+struct gbsim_cport *cport_find(uint16_t hd_cport_id);
 void allocate_cport(uint16_t cport_id, uint16_t hd_cport_id, int protocol_id);
 void free_cport(struct gbsim_cport *cport);
-void free_cports(void);
+void free_cports(struct gbsim_bridge *bridge);
+
+/*
+ * How messages travel between gbsim and the AP. init() sets the link up,
+ * loop() runs in the main thread for as long as gbsim does, receiving
+ * messages and handing them to rx_frame(), and has stopped receiving by
+ * the time it returns. send() writes a batch of pooled buffers, releasing
+ * them once written. cleanup() is only called once nothing sends anymore.
+ */
+struct gbsim_transport {
+	const char *name;
+	int (*init)(void);
+	int (*loop)(void);
+	void (*send)(struct gbsim_txbuf **batch, int count);
+	void (*cleanup)(void);
+};
+
+extern const struct gbsim_transport *transport;
+extern const struct gbsim_transport functionfs_transport;
+extern const struct gbsim_transport socket_transport;
+extern const struct gbsim_transport shm_transport;
+extern const struct gbsim_transport replay_transport;
 
-int gadget_create(usbg_state **, usbg_gadget **);
-int gadget_enable(usbg_gadget *);
-int gadget_cleanup(usbg_state *, usbg_gadget *);
+int gadget_create(usbg_state **, struct gbsim_bridge *);
+int gadget_enable(usbg_state *, usbg_gadget *);
+void gadget_cleanup(usbg_gadget *);
 
-int functionfs_init(void);
-int functionfs_loop(void);
-int functionfs_cleanup(void);
 void cleanup_endpoint(int, char *);
+int ep_pair(uint16_t hd_cport_id);
+void txbuf_to_wire(struct gbsim_txbuf *tb);
+
+int ffs_aio_start(struct gbsim_bridge *bridge);
+void ffs_aio_stop(void);
+int ffs_aio_write(struct gbsim_txbuf *tb, size_t size);
+
+size_t buf_stride(size_t size);
+void *buf_alloc(size_t size);
+void *buf_pool_alloc(int count, size_t size);
+
+struct gbsim_txbuf *txbuf_acquire(void);
+struct gbsim_txbuf *txbuf_try_acquire(void);
+void txbuf_release(struct gbsim_txbuf *tb);
+int txbuf_submit(struct gbsim_txbuf *tb, size_t size);
+void txbuf_set_current(struct gbsim_txbuf *tb);
+void txbuf_put_current(void);
+int txbuf_send(void *buf, size_t size);
+void txbuf_discard(void *buf);
+int txbuf_init(void);
+
+/* Round trips of the requests a CPort sent to the AP */
+struct gbsim_op_stats {
+	unsigned long requests;
+	unsigned long responses;
+	unsigned long timeouts;
+	unsigned long unmatched;
+	unsigned long stalls;
+	uint64_t stall_ns;
+	uint64_t latency_min_ns;
+	uint64_t latency_max_ns;
+	uint64_t latency_total_ns;
+};
 
-int inotify_start(char *);
+int operation_start(uint16_t hd_cport_id, uint8_t type);
+int operation_try_start(uint16_t hd_cport_id, uint8_t type);
+void operation_cancel(uint16_t hd_cport_id, uint16_t id);
+void operation_cancel_all(struct gbsim_bridge *bridge);
+bool operation_complete(uint16_t hd_cport_id, uint16_t id, uint8_t type);
+int operation_credits(uint16_t hd_cport_id);
+bool operation_get_stats(uint16_t hd_cport_id, struct gbsim_op_stats *stats);
+int operation_init(void);
+void operation_stop(void);
+void operation_cleanup(void);
+
+int outbound_queue(struct gbsim_txbuf *tb, size_t size);
+int outbound_init(void);
+void outbound_cleanup(void);
+
+/* Called from the main loop with the events pending on fd */
+typedef void (*reactor_cb)(int fd, uint32_t events, void *arg);
+
+int reactor_add(int fd, uint32_t events, reactor_cb cb, void *arg);
+int reactor_mod(int fd, uint32_t events);
+void reactor_del(int fd);
+int reactor_timer_add(reactor_cb cb, void *arg);
+int reactor_timer_arm(int tfd, uint64_t ns, bool periodic);
+void reactor_timer_del(int tfd);
+int reactor_run(void);
+bool reactor_current(void);
+void reactor_stop(void);
+int reactor_init(void);
+
+int inotify_start(struct gbsim_bridge *bridge);
+void inotify_replay(struct gbsim_bridge *bridge);
 
 void *recv_thread(void *);
 void recv_thread_cleanup(void *);
+void recv_handler(uint16_t hd_cport_id, void *rbuf, size_t rsize, void *tbuf,
+		  size_t tsize);
+int rx_frame(struct gbsim_framer *f, size_t nbytes);
+int rx_stream(struct gbsim_bridge *bridge, int fd, bool closable);
+
+struct gbsim_msg *msg_get(void);
+void msg_put(struct gbsim_msg *msg);
+void dispatch_submit(struct gbsim_msg *msg);
+int dispatch_init(void);
+void dispatch_cleanup(void);
+
+struct gbsim_protocol {
+	uint8_t id;
+	const char *name;
+	int (*handler)(uint16_t, uint16_t, void *, size_t, void *, size_t);
+	const char * const *operations;
+	size_t operation_count;
+	void (*init)(void);
+	void (*cleanup)(void);
+	void (*unthrottle)(uint16_t hd_cport_id);
+};
+
+void protocol_register(const struct gbsim_protocol *proto);
+const struct gbsim_protocol *protocol_find(uint8_t id);
+void protocol_start(const struct gbsim_protocol *proto);
+const char *protocol_get_operation(const struct gbsim_protocol *proto,
+				   uint8_t type);
+void protocols_init(void);
+void protocols_cleanup(void);
+
+extern const struct gbsim_protocol control_protocol;
+extern const struct gbsim_protocol svc_protocol;
+extern const struct gbsim_protocol gpio_protocol;
+extern const struct gbsim_protocol i2c_protocol;
+extern const struct gbsim_protocol uart_protocol;
+extern const struct gbsim_protocol pwm_protocol;
+extern const struct gbsim_protocol sdio_protocol;
+extern const struct gbsim_protocol i2s_mgmt_protocol;
+extern const struct gbsim_protocol i2s_receiver_protocol;
+extern const struct gbsim_protocol i2s_transmitter_protocol;
+extern const struct gbsim_protocol loopback_protocol;
+
+/* One message to or from the AP, as recorded in a -T trace file */
+#define GBSIM_TRACE_RX		0
+#define GBSIM_TRACE_TX		1
+
+struct gbsim_trace_rec {
+	uint64_t ns;			/* CLOCK_MONOTONIC */
+	uint32_t thread;
+	uint16_t hd_cport_id;
+	uint16_t operation_id;
+	uint16_t size;
+	uint8_t type;
+	uint8_t result;
+	uint8_t dir;
+	uint8_t pad[3];
+};
 
-int control_handler(uint16_t, uint16_t, void *, size_t, void *, size_t);
-char *control_get_operation(uint8_t type);
-
-int svc_handler(uint16_t, uint16_t, void *, size_t, void *, size_t);
-int svc_request_send(uint8_t, uint8_t);
-char *svc_get_operation(uint8_t type);
-void svc_init(void);
-void svc_exit(void);
-
-int gpio_handler(uint16_t, uint16_t, void *, size_t, void *, size_t);
-char *gpio_get_operation(uint8_t type);
-void gpio_init(void);
-
-int i2c_handler(uint16_t, uint16_t, void *, size_t, void *, size_t);
-char *i2c_get_operation(uint8_t type);
-void i2c_init(void);
-
-int pwm_handler(uint16_t, uint16_t, void *, size_t, void *, size_t);
-char *pwm_get_operation(uint8_t type);
-void pwm_init(void);
-
-int sdio_handler(uint16_t, uint16_t, void *, size_t, void *, size_t);
-char *sdio_get_operation(uint8_t type);
-void sdio_init(void);
-
-int i2s_mgmt_handler(uint16_t, uint16_t, void *, size_t, void *, size_t);
-int i2s_data_handler(uint16_t, uint16_t, void *, size_t, void *, size_t);
-char *i2s_mgmt_get_operation(uint8_t type);
-char *i2s_data_get_operation(uint8_t type);
-void i2s_init(void);
-
-int uart_handler(uint16_t, uint16_t, void *, size_t, void *, size_t);
-char *uart_get_operation(uint8_t type);
-void uart_init(void);
-void uart_cleanup(void);
-
-int loopback_handler(uint16_t, uint16_t, void *, size_t, void *, size_t);
-char *loopback_get_operation(uint8_t type);
-void loopback_init(void);
-void loopback_cleanup(void);
-
-bool manifest_parse(void *data, size_t size);
-void reset_hd_cport_id(void);
+void trace_msg(uint8_t dir, uint16_t hd_cport_id,
+	       const struct gb_operation_msg_hdr *hdr);
+int trace_init(void);
+void trace_cleanup(void);
+int trace_decode(const char *path);
+
+void capture_msg(uint8_t dir, uint16_t hd_cport_id, const void *buf,
+		 size_t size);
+int capture_init(void);
+void capture_cleanup(void);
+
+void record_msg(uint16_t hd_cport_id, const void *buf, uint16_t size);
+int record_init(void);
+void record_cleanup(void);
+
+/* Latencies of the messages from the AP, served with -L */
+#define GBSIM_STATS_HANDLER	0	/* the protocol handler ran */
+#define GBSIM_STATS_REPLY	1	/* read until its response was written */
+#define GBSIM_STATS_KINDS	2
+
+uint64_t stats_now(void);
+void stats_record(int kind, uint8_t protocol, uint8_t type, uint64_t ns);
+void stats_reply(struct gbsim_txbuf *tb);
+int stats_init(void);
+void stats_cleanup(void);
+
+unsigned long phase_us(struct timespec *t);
+void startup_begin(void);
+void startup_phase(const char *name);
+void startup_report(void);
+
+int svc_request_send(struct gbsim_bridge *, uint8_t, uint8_t);
+
+bool manifest_parse(struct gbsim_bridge *bridge, void *data, size_t size);
+void reset_hd_cport_id(struct gbsim_bridge *bridge);
 int send_response(struct op_msg *op, uint16_t hd_cport_id,
 		   uint16_t message_size, struct gb_operation_msg_hdr *oph,
 		   uint8_t result);
 int send_request(struct op_msg *op, uint16_t hd_cport_id,
-		 uint16_t message_size, uint16_t id, uint8_t type);
+		 uint16_t message_size, uint8_t type);
 
 #endif /* __GBSIM_H */
@@ -24,8 +24,8 @@
 static int gpio_dir[6];
 static gpio *gpios[6];
 
-int gpio_handler(uint16_t cport_id, uint16_t hd_cport_id, void *rbuf,
-		 size_t rsize, void *tbuf, size_t tsize)
+static int gpio_handler(uint16_t cport_id, uint16_t hd_cport_id, void *rbuf,
+			size_t rsize, void *tbuf, size_t tsize)
 {
 	struct gb_operation_msg_hdr *oph;
 	struct op_msg *op_req = rbuf;
@@ -134,7 +134,7 @@ int gpio_handler(uint16_t cport_id, uint16_t hd_cport_id, void *rbuf,
 		op_req->gpio_irq_event_req.which = 1;	/* XXX HACK */
 
 		message_size = sizeof(struct gb_operation_msg_hdr) + payload_size;
-		return send_request(op_req, hd_cport_id, message_size, 0,
+		return send_request(op_req, hd_cport_id, message_size,
 				    GB_GPIO_TYPE_IRQ_EVENT);
 	}
 #endif
@@ -142,45 +142,25 @@ int gpio_handler(uint16_t cport_id, uint16_t hd_cport_id, void *rbuf,
 	return 0;
 }
 
-char *gpio_get_operation(uint8_t type)
-{
-	switch (type) {
-	case GB_GPIO_TYPE_INVALID:
-		return "GB_GPIO_TYPE_INVALID";
-	case GB_GPIO_TYPE_PROTOCOL_VERSION:
-		return "GB_GPIO_TYPE_PROTOCOL_VERSION";
-	case GB_GPIO_TYPE_LINE_COUNT:
-		return "GB_GPIO_TYPE_LINE_COUNT";
-	case GB_GPIO_TYPE_ACTIVATE:
-		return "GB_GPIO_TYPE_ACTIVATE";
-	case GB_GPIO_TYPE_DEACTIVATE:
-		return "GB_GPIO_TYPE_DEACTIVATE";
-	case GB_GPIO_TYPE_GET_DIRECTION:
-		return "GB_GPIO_TYPE_GET_DIRECTION";
-	case GB_GPIO_TYPE_DIRECTION_IN:
-		return "GB_GPIO_TYPE_DIRECTION_IN";
-	case GB_GPIO_TYPE_DIRECTION_OUT:
-		return "GB_GPIO_TYPE_DIRECTION_OUT";
-	case GB_GPIO_TYPE_GET_VALUE:
-		return "GB_GPIO_TYPE_GET_VALUE";
-	case GB_GPIO_TYPE_SET_VALUE:
-		return "GB_GPIO_TYPE_SET_VALUE";
-	case GB_GPIO_TYPE_SET_DEBOUNCE:
-		return "GB_GPIO_TYPE_SET_DEBOUNCE";
-	case GB_GPIO_TYPE_IRQ_TYPE:
-		return "GB_GPIO_TYPE_IRQ_TYPE";
-	case GB_GPIO_TYPE_IRQ_MASK:
-		return "GB_GPIO_TYPE_IRQ_MASK";
-	case GB_GPIO_TYPE_IRQ_UNMASK:
-		return "GB_GPIO_TYPE_IRQ_UNMASK";
-	case GB_GPIO_TYPE_IRQ_EVENT:
-		return "GB_GPIO_TYPE_IRQ_EVENT";
-	default:
-		return "(Unknown operation)";
-	}
-}
+static const char * const gpio_operations[] = {
+	[GB_GPIO_TYPE_INVALID] = "GB_GPIO_TYPE_INVALID",
+	[GB_GPIO_TYPE_PROTOCOL_VERSION] = "GB_GPIO_TYPE_PROTOCOL_VERSION",
+	[GB_GPIO_TYPE_LINE_COUNT] = "GB_GPIO_TYPE_LINE_COUNT",
+	[GB_GPIO_TYPE_ACTIVATE] = "GB_GPIO_TYPE_ACTIVATE",
+	[GB_GPIO_TYPE_DEACTIVATE] = "GB_GPIO_TYPE_DEACTIVATE",
+	[GB_GPIO_TYPE_GET_DIRECTION] = "GB_GPIO_TYPE_GET_DIRECTION",
+	[GB_GPIO_TYPE_DIRECTION_IN] = "GB_GPIO_TYPE_DIRECTION_IN",
+	[GB_GPIO_TYPE_DIRECTION_OUT] = "GB_GPIO_TYPE_DIRECTION_OUT",
+	[GB_GPIO_TYPE_GET_VALUE] = "GB_GPIO_TYPE_GET_VALUE",
+	[GB_GPIO_TYPE_SET_VALUE] = "GB_GPIO_TYPE_SET_VALUE",
+	[GB_GPIO_TYPE_SET_DEBOUNCE] = "GB_GPIO_TYPE_SET_DEBOUNCE",
+	[GB_GPIO_TYPE_IRQ_TYPE] = "GB_GPIO_TYPE_IRQ_TYPE",
+	[GB_GPIO_TYPE_IRQ_MASK] = "GB_GPIO_TYPE_IRQ_MASK",
+	[GB_GPIO_TYPE_IRQ_UNMASK] = "GB_GPIO_TYPE_IRQ_UNMASK",
+	[GB_GPIO_TYPE_IRQ_EVENT] = "GB_GPIO_TYPE_IRQ_EVENT",
+};
 
-void gpio_init(void)
+static void gpio_init(void)
 {
 	int i;
 
@@ -195,3 +175,12 @@ void gpio_init(void)
 			gpios[i] = libsoc_gpio_request(56+i, LS_GREEDY);
 	}
 }
+
+const struct gbsim_protocol gpio_protocol = {
+	.id		= GREYBUS_PROTOCOL_GPIO,
+	.name		= "GPIO",
+	.handler	= gpio_handler,
+	.operations	= gpio_operations,
+	.operation_count = ARRAY_SIZE(gpio_operations),
+	.init		= gpio_init,
+};
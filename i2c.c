@@ -12,9 +12,11 @@
 #include <linux/fs.h>
 #include <linux/i2c.h>
 #include <linux/i2c-dev.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -24,9 +26,10 @@
 
 static __u8 data_byte;
 static int ifd;
+static pthread_mutex_t i2c_lock = PTHREAD_MUTEX_INITIALIZER;
 
-int i2c_handler(uint16_t cport_id, uint16_t hd_cport_id, void *rbuf,
-		size_t rsize, void *tbuf, size_t tsize)
+static int i2c_handler(uint16_t cport_id, uint16_t hd_cport_id, void *rbuf,
+		       size_t rsize, void *tbuf, size_t tsize)
 {
 	struct gb_operation_msg_hdr *oph;
 	struct op_msg *op_req = rbuf;
@@ -63,6 +66,7 @@ int i2c_handler(uint16_t cport_id, uint16_t hd_cport_id, void *rbuf,
 		op_count = le16toh(op_req->i2c_xfer_req.op_count);
 		write_data = (__u8 *)&op_req->i2c_xfer_req.ops[op_count];
 		gbsim_debug("Number of transfer ops %d\n", op_count);
+		pthread_mutex_lock(&i2c_lock);
 		for (i = 0; i < op_count; i++) {
 			struct gb_i2c_transfer_op *op;
 			__u16 addr;
@@ -86,8 +90,14 @@ int i2c_handler(uint16_t cport_id, uint16_t hd_cport_id, void *rbuf,
 					int count;
 					ioctl(ifd, BLKFLSBUF);
 					count = read(ifd, &op_rsp->i2c_xfer_rsp.data[read_count], size);
-					if (count != size)
+					if (count != size) {
 						gbsim_error("op %d: failed to read %04x bytes\n", i, size);
+						/* Don't send back what was not read */
+						if (count < 0)
+							count = 0;
+						memset(&op_rsp->i2c_xfer_rsp.data[read_count + count],
+						       0, size - count);
+					}
 				} else {
 					for (i = read_count; i < (read_count + size); i++)
 					op_rsp->i2c_xfer_rsp.data[i] = data_byte++;
@@ -106,6 +116,8 @@ int i2c_handler(uint16_t cport_id, uint16_t hd_cport_id, void *rbuf,
 			}
 		}
 
+		pthread_mutex_unlock(&i2c_lock);
+
 		/* FIXME: handle read failure */
 		if (write_fail)
 			result = PROTOCOL_STATUS_RETRY;
@@ -120,27 +132,16 @@ int i2c_handler(uint16_t cport_id, uint16_t hd_cport_id, void *rbuf,
 	return send_response(op_rsp, hd_cport_id, message_size, oph, result);
 }
 
-char *i2c_get_operation(uint8_t type)
-{
-	switch (type) {
-	case GB_I2C_TYPE_INVALID:
-		return "GB_I2C_TYPE_INVALID";
-	case GB_I2C_TYPE_PROTOCOL_VERSION:
-		return "GB_I2C_TYPE_PROTOCOL_VERSION";
-	case GB_I2C_TYPE_FUNCTIONALITY:
-		return "GB_I2C_TYPE_FUNCTIONALITY";
-	case GB_I2C_TYPE_TIMEOUT:
-		return "GB_I2C_TYPE_TIMEOUT";
-	case GB_I2C_TYPE_RETRIES:
-		return "GB_I2C_TYPE_RETRIES";
-	case GB_I2C_TYPE_TRANSFER:
-		return "GB_I2C_TYPE_TRANSFER";
-	default:
-		return "(Unknown operation)";
-	}
-}
+static const char * const i2c_operations[] = {
+	[GB_I2C_TYPE_INVALID] = "GB_I2C_TYPE_INVALID",
+	[GB_I2C_TYPE_PROTOCOL_VERSION] = "GB_I2C_TYPE_PROTOCOL_VERSION",
+	[GB_I2C_TYPE_FUNCTIONALITY] = "GB_I2C_TYPE_FUNCTIONALITY",
+	[GB_I2C_TYPE_TIMEOUT] = "GB_I2C_TYPE_TIMEOUT",
+	[GB_I2C_TYPE_RETRIES] = "GB_I2C_TYPE_RETRIES",
+	[GB_I2C_TYPE_TRANSFER] = "GB_I2C_TYPE_TRANSFER",
+};
 
-void i2c_init(void)
+static void i2c_init(void)
 {
 	char filename[20];
 
@@ -151,3 +152,12 @@ void i2c_init(void)
 			gbsim_error("failed opening i2c-dev node read/write\n");
 	}
 }
+
+const struct gbsim_protocol i2c_protocol = {
+	.id		= GREYBUS_PROTOCOL_I2C,
+	.name		= "I2C",
+	.handler	= i2c_handler,
+	.operations	= i2c_operations,
+	.operation_count = ARRAY_SIZE(i2c_operations),
+	.init		= i2c_init,
+};
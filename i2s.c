@@ -15,6 +15,7 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <errno.h>
@@ -23,8 +24,8 @@
 
 #define CONFIG_COUNT_MAX 20
 
-int i2s_mgmt_handler(uint16_t cport_id, uint16_t hd_cport_id, void *rbuf,
-		     size_t rsize, void *tbuf, size_t tsize)
+static int i2s_mgmt_handler(uint16_t cport_id, uint16_t hd_cport_id, void *rbuf,
+			    size_t rsize, void *tbuf, size_t tsize)
 {
 	struct gb_operation_msg_hdr *oph;
 	struct op_msg *op_req = rbuf;
@@ -47,6 +48,8 @@ int i2s_mgmt_handler(uint16_t cport_id, uint16_t hd_cport_id, void *rbuf,
 		payload_size = sizeof(struct gb_i2s_mgmt_get_supported_configurations_response) +
 			sizeof(struct gb_i2s_mgmt_configuration) * CONFIG_COUNT_MAX;
 
+		/* Only the first configuration is filled in, clear the rest */
+		memset(&op_rsp->i2s_mgmt_get_sup_conf_rsp, 0, payload_size);
 		op_rsp->i2s_mgmt_get_sup_conf_rsp.config_count = 1;
 
 		conf = &op_rsp->i2s_mgmt_get_sup_conf_rsp.config[0];
@@ -92,8 +95,8 @@ int i2s_mgmt_handler(uint16_t cport_id, uint16_t hd_cport_id, void *rbuf,
 }
 
 
-int i2s_data_handler(uint16_t cport_id, uint16_t hd_cport_id, void *rbuf,
-		     size_t rsize, void *tbuf, size_t tsize)
+static int i2s_data_handler(uint16_t cport_id, uint16_t hd_cport_id, void *rbuf,
+			    size_t rsize, void *tbuf, size_t tsize)
 {
 	struct gb_operation_msg_hdr *oph;
 	struct op_msg *op_req = rbuf;
@@ -123,45 +126,49 @@ int i2s_data_handler(uint16_t cport_id, uint16_t hd_cport_id, void *rbuf,
 	return send_response(op_rsp, hd_cport_id, message_size, oph, result);
 }
 
-char *i2s_mgmt_get_operation(uint8_t type)
+static const char * const i2s_mgmt_operations[] = {
+	[GB_I2S_MGMT_TYPE_PROTOCOL_VERSION] = "GB_I2S_MGMT_TYPE_PROTOCOL_VERSION",
+	[GB_I2S_MGMT_TYPE_GET_SUPPORTED_CONFIGURATIONS] = "GB_I2S_MGMT_TYPE_GET_SUPPORTED_CONFIGURATIONS",
+	[GB_I2S_MGMT_TYPE_SET_CONFIGURATION] = "GB_I2S_MGMT_TYPE_SET_CONFIGURATION",
+	[GB_I2S_MGMT_TYPE_SET_SAMPLES_PER_MESSAGE] = "GB_I2S_MGMT_TYPE_SET_SAMPLES_PER_MESSAGE",
+	[GB_I2S_MGMT_TYPE_GET_PROCESSING_DELAY] = "GB_I2S_MGMT_TYPE_GET_PROCESSING_DELAY",
+	[GB_I2S_MGMT_TYPE_SET_START_DELAY] = "GB_I2S_MGMT_TYPE_SET_START_DELAY",
+	[GB_I2S_MGMT_TYPE_ACTIVATE_CPORT] = "GB_I2S_MGMT_TYPE_ACTIVATE_CPORT",
+	[GB_I2S_MGMT_TYPE_DEACTIVATE_CPORT] = "GB_I2S_MGMT_TYPE_DEACTIVATE_CPORT",
+	[GB_I2S_MGMT_TYPE_REPORT_EVENT] = "GB_I2S_MGMT_TYPE_REPORT_EVENT",
+};
+
+static const char * const i2s_data_operations[] = {
+	[GB_I2S_DATA_TYPE_PROTOCOL_VERSION] = "GB_I2S_DATA_TYPE_PROTOCOL_VERSION",
+	[GB_I2S_DATA_TYPE_SEND_DATA] = "GB_I2S_DATA_TYPE_SEND_DATA",
+};
+
+static void i2s_init(void)
 {
-	switch (type) {
-	case GB_I2S_MGMT_TYPE_PROTOCOL_VERSION:
-		return "GB_I2S_MGMT_TYPE_PROTOCOL_VERSION";
-	case GB_I2S_MGMT_TYPE_GET_SUPPORTED_CONFIGURATIONS:
-		return "GB_I2S_MGMT_TYPE_GET_SUPPORTED_CONFIGURATIONS";
-	case GB_I2S_MGMT_TYPE_SET_CONFIGURATION:
-		return "GB_I2S_MGMT_TYPE_SET_CONFIGURATION";
-	case GB_I2S_MGMT_TYPE_SET_SAMPLES_PER_MESSAGE:
-		return "GB_I2S_MGMT_TYPE_SET_SAMPLES_PER_MESSAGE";
-	case GB_I2S_MGMT_TYPE_GET_PROCESSING_DELAY:
-		return "GB_I2S_MGMT_TYPE_GET_PROCESSING_DELAY";
-	case GB_I2S_MGMT_TYPE_SET_START_DELAY:
-		return "GB_I2S_MGMT_TYPE_SET_START_DELAY";
-	case GB_I2S_MGMT_TYPE_ACTIVATE_CPORT:
-		return "GB_I2S_MGMT_TYPE_ACTIVATE_CPORT";
-	case GB_I2S_MGMT_TYPE_DEACTIVATE_CPORT:
-		return "GB_I2S_MGMT_TYPE_DEACTIVATE_CPORT";
-	case GB_I2S_MGMT_TYPE_REPORT_EVENT:
-		return "GB_I2S_MGMT_TYPE_REPORT_EVENT";
-	default:
-		return "(Unknown operation)";
-	}
-}
 
-char *i2s_data_get_operation(uint8_t type)
-{
-	switch (type) {
-	case GB_I2S_DATA_TYPE_PROTOCOL_VERSION:
-		return "GB_I2S_DATA_TYPE_PROTOCOL_VERSION";
-	case GB_I2S_DATA_TYPE_SEND_DATA:
-		return "GB_I2S_DATA_TYPE_SEND_DATA";
-	default:
-		return "(Unknown operation)";
-	}
 }
 
-void i2s_init(void)
-{
-
-}
+const struct gbsim_protocol i2s_mgmt_protocol = {
+	.id		= GREYBUS_PROTOCOL_I2S_MGMT,
+	.name		= "I2S_MGMT",
+	.handler	= i2s_mgmt_handler,
+	.operations	= i2s_mgmt_operations,
+	.operation_count = ARRAY_SIZE(i2s_mgmt_operations),
+	.init		= i2s_init,
+};
+
+const struct gbsim_protocol i2s_receiver_protocol = {
+	.id		= GREYBUS_PROTOCOL_I2S_RECEIVER,
+	.name		= "I2S_RECEIVER",
+	.handler	= i2s_data_handler,
+	.operations	= i2s_data_operations,
+	.operation_count = ARRAY_SIZE(i2s_data_operations),
+};
+
+const struct gbsim_protocol i2s_transmitter_protocol = {
+	.id		= GREYBUS_PROTOCOL_I2S_TRANSMITTER,
+	.name		= "I2S_TRANSMITTER",
+	.handler	= i2s_data_handler,
+	.operations	= i2s_data_operations,
+	.operation_count = ARRAY_SIZE(i2s_data_operations),
+};
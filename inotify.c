@@ -8,15 +8,18 @@
  */
 
 #include <errno.h>
+#include <dirent.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/inotify.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
-#include <pthread.h>
 
 #include <linux/types.h>
 
@@ -26,10 +29,6 @@
 #define INOTIFY_EVENT_SIZE  ( sizeof(struct inotify_event) )
 #define INOTIFY_EVENT_BUF   ( INOTIFY_EVENT_SIZE + MAX_NAME + 1 )
 
-static pthread_t inotify_pthread;
-int notify_fd = -ENXIO;
-static char root[256];
-
 static struct greybus_manifest_header *get_manifest_blob(char *mnfs)
 {
 	struct greybus_manifest_header *mh;
@@ -63,7 +62,7 @@ out:
 	return NULL;
 }
 
-static int get_interface_id(char *fname)
+static int get_interface_id(const char *fname)
 {
 	char *iid_str;
 	int iid = 0;
@@ -77,47 +76,88 @@ static int get_interface_id(char *fname)
 	return iid;
 }
 
-static void *inotify_thread(void *param)
+static void hotplug_module(struct gbsim_bridge *bridge, const char *name)
+{
+	char mnfs[256];
+	struct greybus_manifest_header *mh;
+	int iid;
+
+	strcpy(mnfs, bridge->hotplug_dir);
+	strcat(mnfs, "/");
+	strcat(mnfs, name);
+	mh = get_manifest_blob(mnfs);
+	if (!mh) {
+		gbsim_error("missing manifest blob, no hotplug event sent\n");
+		return;
+	}
+
+	bridge->info.manifest = mh;
+	bridge->info.manifest_size = le16toh(mh->size);
+	manifest_parse(bridge, mh, le16toh(mh->size));
+
+	iid = get_interface_id(name);
+	if (iid > 0 && iid <= UINT8_MAX) {
+		gbsim_info("%s Interface inserted\n", name);
+		bridge->intf_present[iid] = true;
+		svc_request_send(bridge, GB_SVC_TYPE_INTF_HOTPLUG, iid);
+	} else
+		gbsim_error("invalid interface ID, no hotplug plug event sent\n");
+}
+
+static int hotplug_filter(const struct dirent *d)
+{
+	return d->d_type == DT_REG || d->d_type == DT_UNKNOWN;
+}
+
+/*
+ * A replay has no one to write modules in while it runs: those already
+ * in the directory are plugged in at the start, in name order.
+ */
+static void hotplug_scan(struct gbsim_bridge *bridge)
+{
+	struct dirent **names;
+	int i, n;
+
+	n = scandir(bridge->hotplug_dir, &names, hotplug_filter, alphasort);
+	if (n < 0) {
+		gbsim_error("can't scan %s: %s\n", bridge->hotplug_dir,
+			    strerror(errno));
+		return;
+	}
+
+	for (i = 0; i < n; i++) {
+		hotplug_module(bridge, names[i]->d_name);
+		free(names[i]);
+	}
+	free(names);
+}
+
+static void inotify_cb(int fd, uint32_t events, void *arg)
 {
+	struct gbsim_bridge *bridge = arg;
 	char buffer[16 * INOTIFY_EVENT_BUF];
 	int i, length;
-	(void) param;
 
 	do {
-		length = read(notify_fd, buffer, sizeof(buffer));
+		length = read(fd, buffer, sizeof(buffer));
 
-		if (length < 0)
-			gbsim_error("inotify read: %s\n", strerror(errno));
+		if (length < 0) {
+			if (errno != EAGAIN)
+				gbsim_error("inotify read: %s\n", strerror(errno));
+			break;
+		}
 
 		i = 0;
 		while (i < length) {
 			struct inotify_event *event = (struct inotify_event *)&buffer[i];
 			if (event->len) {
-				if (event->mask & IN_CLOSE_WRITE) {
-					char mnfs[256];
-					struct greybus_manifest_header *mh;
-					strcpy(mnfs, root);
-					strcat(mnfs, "/");
-					strcat(mnfs, event->name);
-					mh = get_manifest_blob(mnfs);
-					if (mh) {
-						info.manifest = mh;
-						info.manifest_size = le16toh(mh->size);
-						manifest_parse(mh, le16toh(mh->size));
-
-						int iid = get_interface_id(event->name);
-						if (iid > 0) {
-							gbsim_info("%s Interface inserted\n", event->name);
-							svc_request_send(GB_SVC_TYPE_INTF_HOTPLUG, iid);
-						} else
-							gbsim_error("invalid interface ID, no hotplug plug event sent\n");
-					} else
-						gbsim_error("missing manifest blob, no hotplug event sent\n");
-				}
+				if (event->mask & IN_CLOSE_WRITE)
+					hotplug_module(bridge, event->name);
 				else if (event->mask & IN_DELETE) {
 					int iid = get_interface_id(event->name);
-					if (iid > 0) {
-						svc_request_send(GB_SVC_TYPE_INTF_HOT_UNPLUG, iid);
+					if (iid > 0 && iid <= UINT8_MAX) {
+						bridge->intf_present[iid] = false;
+						svc_request_send(bridge, GB_SVC_TYPE_INTF_HOT_UNPLUG, iid);
 						gbsim_info("%s interface removed\n", event->name);
 					} else
 						gbsim_error("invalid interface ID, no hotplug unplug event sent\n");
@@ -125,21 +165,34 @@ static void *inotify_thread(void *param)
 			}
 			i += INOTIFY_EVENT_SIZE + event->len;
 		}
-	} while (length >= 0);
+	} while (length > 0);
+}
 
-	return NULL;
+/* Send hotplug events for the interfaces present, to an AP starting over */
+void inotify_replay(struct gbsim_bridge *bridge)
+{
+	int iid;
+
+	for (iid = 1; iid <= UINT8_MAX; iid++) {
+		if (bridge->intf_present[iid]) {
+			gbsim_debug("IID%d interface announced again\n", iid);
+			svc_request_send(bridge, GB_SVC_TYPE_INTF_HOTPLUG, iid);
+		}
+	}
 }
 
-int inotify_start(char *base_dir)
+int inotify_start(struct gbsim_bridge *bridge)
 {
+	char *root = bridge->hotplug_dir;
 	int ret;
 	struct stat root_stat;
-	int notify_wd;
+	int notify_fd, notify_wd;
 
-	/* Our inotify directory */
-	strcpy(root, base_dir);
-	strcat(root, "/");
-	strcat(root, "hotplug-module");
+	/* The AP may say hello again, e.g. after reconnecting */
+	if (bridge->notify_fd >= 0) {
+		inotify_replay(bridge);
+		return 0;
+	}
 
 	ret = stat(root, &root_stat);
 	if (ret < 0 || !S_ISDIR(root_stat.st_mode) || access(root, R_OK|W_OK) < 0) {
@@ -147,17 +200,22 @@ int inotify_start(char *base_dir)
 		exit(EXIT_FAILURE);
 	}
 
-	if ((notify_fd = inotify_init()) < 0)
+	if ((notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)
 		perror("inotify init failed");
 
 	if ((notify_wd = inotify_add_watch(notify_fd, root, IN_CLOSE_WRITE|IN_DELETE)) < 0)
 		perror("inotify add watch failed");
 
-	ret = pthread_create(&inotify_pthread, NULL, inotify_thread, NULL);
+	bridge->notify_fd = notify_fd;
+
+	ret = reactor_add(notify_fd, EPOLLIN, inotify_cb, bridge);
 	if (ret < 0) {
-		perror("can't create inotify thread");
+		gbsim_error("can't watch for hotplug events\n");
 		exit(EXIT_FAILURE);
 	}
 
+	if (replay_path)
+		hotplug_scan(bridge);
+
 	return 0;
 }
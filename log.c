@@ -0,0 +1,115 @@
+/*
+ * Greybus Simulator: logging
+ *
+ * Copyright 2015 Google Inc.
+ * Copyright 2015 Linaro Ltd.
+ *
+ * Provided under the three clause BSD license found in the LICENSE file.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "gbsim.h"
+
+/*
+ * Messages above GBSIM_LOG_LEVEL never get here, they are compiled out in
+ * gbsim.h. Those that do are printed as they always were, one line with
+ * a [D], [I] or [E] prefix, or with -l as logfmt records: a timestamp,
+ * the level, and either the event's key=value pairs or the text as msg.
+ * Each line is written with a single call, so lines from different
+ * threads do not interleave.
+ */
+#define LOG_LINE_MAX		1024
+
+static const char * const log_prefixes[] = {
+	[GBSIM_LOG_ERROR]	= "[E] GBSIM: ",
+	[GBSIM_LOG_INFO]	= "[I] GBSIM: ",
+	[GBSIM_LOG_DEBUG]	= "[D] GBSIM: ",
+};
+
+static const char * const log_levels[] = {
+	[GBSIM_LOG_ERROR]	= "error",
+	[GBSIM_LOG_INFO]	= "info",
+	[GBSIM_LOG_DEBUG]	= "debug",
+};
+
+static FILE *log_stream(int level)
+{
+	return level == GBSIM_LOG_ERROR ? stderr : stdout;
+}
+
+static int log_header(char *buf, size_t size, int level)
+{
+	struct timespec ts;
+
+	if (!log_structured)
+		return snprintf(buf, size, "%s", log_prefixes[level]);
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return snprintf(buf, size, "ts=%lld.%09ld level=%s ",
+			(long long)ts.tv_sec, ts.tv_nsec, log_levels[level]);
+}
+
+static void log_write(int level, char *line, size_t len)
+{
+	FILE *f = log_stream(level);
+
+	if (len >= LOG_LINE_MAX - 1)
+		len = LOG_LINE_MAX - 2;
+	if (!len || line[len - 1] != '\n')
+		line[len++] = '\n';
+
+	fwrite(line, 1, len, f);
+	fflush(f);
+}
+
+void gbsim_log(int level, const char *fmt, ...)
+{
+	char line[LOG_LINE_MAX], text[LOG_LINE_MAX];
+	size_t len, i;
+	va_list ap;
+
+	len = log_header(line, sizeof(line), level);
+
+	va_start(ap, fmt);
+	if (!log_structured) {
+		vsnprintf(line + len, sizeof(line) - len, fmt, ap);
+		va_end(ap);
+		log_write(level, line, strlen(line));
+		return;
+	}
+	vsnprintf(text, sizeof(text), fmt, ap);
+	va_end(ap);
+
+	/* Free text goes in a quoted msg, trailing newline dropped */
+	len += snprintf(line + len, sizeof(line) - len, "msg=\"");
+	for (i = 0; text[i] && len < sizeof(line) - 4; i++) {
+		if (text[i] == '\n' && !text[i + 1])
+			break;
+		if (text[i] == '"' || text[i] == '\\')
+			line[len++] = '\\';
+		line[len++] = text[i] == '\n' ? ' ' : text[i];
+	}
+	line[len++] = '"';
+	log_write(level, line, len);
+}
+
+void gbsim_log_event(int level, const char *event, const char *fmt, ...)
+{
+	char line[LOG_LINE_MAX];
+	size_t len;
+	va_list ap;
+
+	len = log_header(line, sizeof(line), level);
+	len += snprintf(line + len, sizeof(line) - len,
+			log_structured ? "event=%s " : "%s ", event);
+
+	va_start(ap, fmt);
+	vsnprintf(line + len, sizeof(line) - len, fmt, ap);
+	va_end(ap);
+
+	log_write(level, line, strlen(line));
+}
@@ -14,6 +14,7 @@
 #include <linux/fs.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -26,8 +27,10 @@
 
 /* Misc */
 #define GB_LOOPBACK_MAX				4
+/* The echoed data has to fit in one response to the AP */
 #define GB_OPERATION_DATA_SIZE_MAX		\
-	(0x800 - sizeof(struct gb_loopback_transfer_request))
+	(msg_size_max - sizeof(struct gb_operation_msg_hdr) - \
+	 sizeof(struct gb_loopback_transfer_response))
 
 enum {
 	LOOPBACK_FSM_IDLE = 0,
@@ -49,11 +52,8 @@ struct gb_loopback {
 };
 
 static struct gb_loopback gblb;
-static bool terminate_thread;
-static int thread_started;
+static int loopback_timer = -1;
 static int port_count;
-static pthread_t loopback_pthread;
-static pthread_barrier_t loopback_barrier;
 
 static int gb_loopback_ping_host(struct gb_loopback *gblbp)
 {
@@ -73,58 +73,73 @@ static int gb_loopback_sink_host(struct gb_loopback *gblbp, size_t size)
 	return 0;
 }
 
-/* Analog based on the firmware loop */
-static void *loopback_thread(void *param)
+/*
+ * Analog based on the firmware loop, run one step at a time from a timer
+ * on the main loop. The timer is only armed while there is something to
+ * do, so an idle loopback CPort costs no wakeups. Whatever changes init or
+ * state calls loopback_schedule(), and nothing else does.
+ */
+static void loopback_schedule(void)
 {
-	int state;
-
-	pthread_barrier_wait(&loopback_barrier);
-
-	while (!terminate_thread) {
-		if (!gblb.init)
-			state = LOOPBACK_FSM_IDLE;
-		else
-			state = gblb.state;
-
-		switch (state) {
-		case LOOPBACK_FSM_PING_HOST:
-			gb_loopback_ping_host(&gblb);
-			break;
-		case LOOPBACK_FSM_TRANSFER_HOST:
-			gb_loopback_transfer_host(&gblb, gblb.size);
-			break;
-		case LOOPBACK_FSM_SINK_HOST:
-			gb_loopback_sink_host(&gblb, gblb.size);
-			break;
-		case LOOPBACK_FSM_IDLE:
-		default:
-			sleep(1);
-			continue;
-		}
+	uint64_t ns = gblb.ms ? gblb.ms * 1000000ULL : 1;
+
+	if (loopback_timer < 0)
+		return;
+
+	if (!gblb.init || gblb.state == LOOPBACK_FSM_IDLE)
+		ns = 0;
+
+	reactor_timer_arm(loopback_timer, ns, false);
+}
+
+static void loopback_timer_cb(int fd, uint32_t events, void *arg)
+{
+	switch (gblb.state) {
+	case LOOPBACK_FSM_PING_HOST:
+		gb_loopback_ping_host(&gblb);
+		break;
+	case LOOPBACK_FSM_TRANSFER_HOST:
+		gb_loopback_transfer_host(&gblb, gblb.size);
+		break;
+	case LOOPBACK_FSM_SINK_HOST:
+		gb_loopback_sink_host(&gblb, gblb.size);
+		break;
+	case LOOPBACK_FSM_IDLE:
+	default:
+		break;
 	}
 
-	gbsim_info("Loopback thread exit\n");
-	pthread_exit(NULL);
-	return NULL;
+	loopback_schedule();
 }
 
+/* Only the first message on a port changes anything, the rest take no lock */
 static void loopback_init_port(uint8_t module_id, uint16_t cport_id,
-			  uint16_t hd_cport_id, uint8_t id)
+			       uint16_t hd_cport_id, uint8_t id)
 {
+	bool first;
+
+	if (__atomic_load_n(&gblb.init, __ATOMIC_ACQUIRE) &&
+	    __atomic_load_n(&gblb.hd_cport_id, __ATOMIC_RELAXED) == hd_cport_id)
+		return;
+
+	pthread_mutex_lock(&gblb.loopback_data);
 	gblb.module_id = module_id;
 	gblb.cport_id = cport_id;
-	gblb.hd_cport_id = hd_cport_id;
+	__atomic_store_n(&gblb.hd_cport_id, hd_cport_id, __ATOMIC_RELAXED);
 	gblb.id = id;
-	gblb.init = true;
+	first = !gblb.init;
+	__atomic_store_n(&gblb.init, true, __ATOMIC_RELEASE);
+	if (first)
+		loopback_schedule();
+	pthread_mutex_unlock(&gblb.loopback_data);
 	gbsim_debug("Loopback Module %hu Cport %hhu HDCport %hhu index %d\n",
 		    module_id, cport_id, hd_cport_id, port_count);
 }
 
 
-int loopback_handler(uint16_t cport_id, uint16_t hd_cport_id, void *rbuf,
-		 size_t rsize, void *tbuf, size_t tsize)
+static int loopback_handler(uint16_t cport_id, uint16_t hd_cport_id, void *rbuf,
+			    size_t rsize, void *tbuf, size_t tsize)
 {
-	char data[GB_OPERATION_DATA_SIZE_MAX];
 	struct gb_operation_msg_hdr *oph;
 	struct op_msg *op_req = rbuf;
 	struct op_msg *op_rsp;
@@ -153,7 +168,7 @@ int loopback_handler(uint16_t cport_id, uint16_t hd_cport_id, void *rbuf,
 		break;
 	case GB_LOOPBACK_TYPE_TRANSFER:
 		request = &op_req->loopback_xfer_req;
-		response = (struct gb_loopback_transfer_response *)&data[0];
+		response = &op_rsp->loopback_xfer_resp;
 		gbsim_debug("%s: LOOPBACK xfer rx %hu\n", __func__,
 			    request->len);
 		if (request->len > GB_OPERATION_DATA_SIZE_MAX) {
@@ -178,50 +193,37 @@ int loopback_handler(uint16_t cport_id, uint16_t hd_cport_id, void *rbuf,
 	return send_response(op_rsp, hd_cport_id, message_size, oph, result);
 }
 
-char *loopback_get_operation(uint8_t type)
-{
-	switch (type) {
-	case GB_LOOPBACK_TYPE_INVALID:
-		return "GB_LOOPBACK_TYPE_INVALID";
-	case GB_LOOPBACK_TYPE_PROTOCOL_VERSION:
-		return "GB_LOOPBACK_TYPE_PROTOCOL_VERSION";
-	case GB_LOOPBACK_TYPE_PING:
-		return "GB_LOOPBACK_TYPE_PING";
-	case GB_LOOPBACK_TYPE_TRANSFER:
-		return "GB_LOOPBACK_TYPE_TRANSFER";
-	case GB_LOOPBACK_TYPE_SINK:
-		return "GB_LOOPBACK_TYPE_SINK";
-	default:
-		return "(Unknown operation)";
-	}
-}
+static const char * const loopback_operations[] = {
+	[GB_LOOPBACK_TYPE_INVALID] = "GB_LOOPBACK_TYPE_INVALID",
+	[GB_LOOPBACK_TYPE_PROTOCOL_VERSION] = "GB_LOOPBACK_TYPE_PROTOCOL_VERSION",
+	[GB_LOOPBACK_TYPE_PING] = "GB_LOOPBACK_TYPE_PING",
+	[GB_LOOPBACK_TYPE_TRANSFER] = "GB_LOOPBACK_TYPE_TRANSFER",
+	[GB_LOOPBACK_TYPE_SINK] = "GB_LOOPBACK_TYPE_SINK",
+};
 
-void loopback_cleanup(void)
+static void loopback_cleanup(void)
 {
-	if (thread_started) {
-		/* signal termination */
-		terminate_thread = true;
-
-		/* sync */
-		pthread_join(loopback_pthread, NULL);
-		pthread_barrier_destroy(&loopback_barrier);
+	if (loopback_timer >= 0) {
+		reactor_timer_del(loopback_timer);
+		loopback_timer = -1;
 	}
 }
 
-void loopback_init(void)
+static void loopback_init(void)
 {
-	int ret;
-
-	/* Init thread */
-	pthread_barrier_init(&loopback_barrier, 0, 2);
-	ret = pthread_create(&loopback_pthread, NULL, loopback_thread, NULL);
-	if (ret < 0) {
-		perror("can't create loopback thread");
-		loopback_cleanup();
-		return;
-	}
+	pthread_mutex_init(&gblb.loopback_data, NULL);
 
-	/* Sync thread startup */
-	thread_started = 1;
-	pthread_barrier_wait(&loopback_barrier);
+	loopback_timer = reactor_timer_add(loopback_timer_cb, NULL);
+	if (loopback_timer < 0)
+		gbsim_error("can't create loopback timer\n");
 }
+
+const struct gbsim_protocol loopback_protocol = {
+	.id		= GREYBUS_PROTOCOL_LOOPBACK,
+	.name		= "LOOPBACK",
+	.handler	= loopback_handler,
+	.operations	= loopback_operations,
+	.operation_count = ARRAY_SIZE(loopback_operations),
+	.init		= loopback_init,
+	.cleanup	= loopback_cleanup,
+};
@@ -9,12 +9,17 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
 #include <unistd.h>
 
-#include <usbg/usbg.h>
+#include <linux/usb/ch9.h>
 
 #include "gbsim.h"
 
@@ -24,39 +29,103 @@ int uart_portno = 0;
 int uart_count = 0;
 char *hotplug_basedir;
 int verbose = 0;
+int log_structured;
+int worker_count = 4;
+size_t rx_size = 64 * 1024;
+size_t msg_size_max = ES1_MSG_SIZE;
+int aio_depth = 0;
+size_t coalesce_size = 0;
+int credit_window = 16;
+char *socket_path;
+unsigned long shm_requests;
+int usb_max_speed = USB_SPEED_HIGH;
+int bulk_packet_size;
+int max_burst;
+int ep_pairs = 1;
+int warm_restart;
+int gadget_keep;
+int bridge_count = 1;
+char *trace_path;
+char *stats_path;
+char *capture_path;
+char *record_path;
+char *replay_path;
+int replay_paced;
 
-static usbg_state *s;
-static usbg_gadget *g;
-
-static struct sigaction sigact;
-
-struct gbsim_info info;
+const struct gbsim_transport *transport = &functionfs_transport;
 
 static void cleanup(void)
 {
 	printf("cleaning up\n");
-	sigemptyset(&sigact.sa_mask);
 
-	uart_cleanup();
-	gadget_cleanup(s, g);
-	functionfs_cleanup();
-	svc_exit();
+	/*
+	 * The main loop and the transport's receivers are done. Stop what
+	 * is left in the order each feeds the next: workers waiting for
+	 * credits would never be joined otherwise, the workers queue to the
+	 * scheduler, and the scheduler writes to the transport.
+	 */
+	operation_stop();
+	dispatch_cleanup();
+	outbound_cleanup();
+	transport->cleanup();
+	operation_cleanup();
+	protocols_cleanup();
+	record_cleanup();
+	capture_cleanup();
+	stats_cleanup();
+	trace_cleanup();
 }
 
-static void signal_handler(int sig)
+static void protocols_register(void)
 {
-	if (sig == SIGINT || sig == SIGHUP || sig == SIGTERM)
-		cleanup();
+	protocol_register(&control_protocol);
+	protocol_register(&svc_protocol);
+	protocol_register(&gpio_protocol);
+	protocol_register(&i2c_protocol);
+	protocol_register(&uart_protocol);
+	protocol_register(&pwm_protocol);
+	protocol_register(&sdio_protocol);
+	protocol_register(&i2s_mgmt_protocol);
+	protocol_register(&i2s_receiver_protocol);
+	protocol_register(&i2s_transmitter_protocol);
+	protocol_register(&loopback_protocol);
 }
 
-static void signals_init(void)
+static void signal_cb(int fd, uint32_t events, void *arg)
 {
-	sigact.sa_handler = signal_handler;
-	sigemptyset(&sigact.sa_mask);
-	sigact.sa_flags = 0;
-	sigaction(SIGINT, &sigact, (struct sigaction *)NULL);
-	sigaction(SIGHUP, &sigact, (struct sigaction *)NULL);
-	sigaction(SIGTERM, &sigact, (struct sigaction *)NULL);
+	struct signalfd_siginfo si;
+
+	if (read(fd, &si, sizeof(si)) != sizeof(si))
+		return;
+
+	if (si.ssi_signo == SIGINT || si.ssi_signo == SIGHUP ||
+	    si.ssi_signo == SIGTERM)
+		reactor_stop();
+}
+
+/*
+ * Signals are taken from the main loop rather than in a handler. They are
+ * blocked before any thread is created, so every thread inherits the mask
+ * and only the signalfd sees them.
+ */
+static int signals_init(void)
+{
+	sigset_t mask;
+	int fd;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGHUP);
+	sigaddset(&mask, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (fd < 0) {
+		gbsim_error("signalfd: %s\n", strerror(errno));
+		return -errno;
+	}
+
+	return reactor_add(fd, EPOLLIN, signal_cb, NULL);
 }
 
 int main(int argc, char *argv[])
@@ -64,12 +133,35 @@ int main(int argc, char *argv[])
 	int ret = -EINVAL;
 	int o;
 
-	while ((o = getopt(argc, argv, ":bh:i:u:U:v")) != -1) {
+	while ((o = getopt(argc, argv, ":a:bB:c:C:D:e:h:i:klL:m:M:n:o:O:p:P:rR:s:S:tT:u:U:vw:")) != -1) {
 		switch (o) {
+		case 'a':
+			aio_depth = atoi(optarg);
+			printf("aio_depth %d\n", aio_depth);
+			break;
 		case 'b':
 			bbb_backend = 1;
 			printf("bbb_backend %d\n", bbb_backend);
 			break;
+		case 'B':
+			shm_requests = strtoul(optarg, NULL, 0);
+			printf("shm_requests %lu\n", shm_requests);
+			break;
+		case 'c':
+			coalesce_size = strtoul(optarg, NULL, 0);
+			printf("coalesce_size %zu\n", coalesce_size);
+			break;
+		case 'C':
+			credit_window = atoi(optarg);
+			printf("credit_window %d\n", credit_window);
+			break;
+		case 'D':
+			/* Decode a trace file and exit */
+			return trace_decode(optarg) ? 1 : 0;
+		case 'e':
+			ep_pairs = atoi(optarg);
+			printf("ep_pairs %d\n", ep_pairs);
+			break;
 		case 'h':
 			hotplug_basedir = optarg;
 			printf("hotplug_basedir %s\n", hotplug_basedir);
@@ -78,6 +170,79 @@ int main(int argc, char *argv[])
 			i2c_adapter = atoi(optarg);
 			printf("i2c_adapter %d\n", i2c_adapter);
 			break;
+		case 'k':
+			gadget_keep = 1;
+			printf("gadget_keep %d\n", gadget_keep);
+			break;
+		case 'l':
+			log_structured = 1;
+			printf("log_structured %d\n", log_structured);
+			break;
+		case 'L':
+			stats_path = optarg;
+			printf("stats_path %s\n", stats_path);
+			break;
+		case 'm':
+			msg_size_max = strtoul(optarg, NULL, 0);
+			printf("msg_size_max %zu\n", msg_size_max);
+			break;
+		case 'M':
+			max_burst = atoi(optarg);
+			printf("max_burst %d\n", max_burst);
+			break;
+		case 'n':
+			bridge_count = atoi(optarg);
+			printf("bridge_count %d\n", bridge_count);
+			break;
+		case 'o':
+			record_path = optarg;
+			printf("record_path %s\n", record_path);
+			break;
+		case 'O':
+			replay_path = optarg;
+			printf("replay_path %s\n", replay_path);
+			break;
+		case 'p':
+			capture_path = optarg;
+			printf("capture_path %s\n", capture_path);
+			break;
+		case 'P':
+			bulk_packet_size = atoi(optarg);
+			printf("bulk_packet_size %d\n", bulk_packet_size);
+			break;
+		case 'r':
+			warm_restart = 1;
+			printf("warm_restart %d\n", warm_restart);
+			break;
+		case 'R':
+			rx_size = strtoul(optarg, NULL, 0);
+			printf("rx_size %zu\n", rx_size);
+			break;
+		case 's':
+			if (!strcmp(optarg, "full"))
+				usb_max_speed = USB_SPEED_FULL;
+			else if (!strcmp(optarg, "high"))
+				usb_max_speed = USB_SPEED_HIGH;
+			else if (!strcmp(optarg, "super"))
+				usb_max_speed = USB_SPEED_SUPER;
+			else {
+				gbsim_error("unknown USB speed %s\n", optarg);
+				return 1;
+			}
+			printf("usb_max_speed %s\n", optarg);
+			break;
+		case 'S':
+			socket_path = optarg;
+			printf("socket_path %s\n", socket_path);
+			break;
+		case 't':
+			replay_paced = 1;
+			printf("replay_paced %d\n", replay_paced);
+			break;
+		case 'T':
+			trace_path = optarg;
+			printf("trace_path %s\n", trace_path);
+			break;
 		case 'u':
 			uart_portno = atoi(optarg);
 			printf("uart_portno %d\n", uart_portno);
@@ -90,15 +255,57 @@ int main(int argc, char *argv[])
 			verbose = 1;
 			printf("verbose %d\n", verbose);
 			break;
+		case 'w':
+			worker_count = atoi(optarg);
+			printf("worker_count %d\n", worker_count);
+			break;
 		case ':':
-			if (optopt == 'i')
+			if (optopt == 'a')
+				gbsim_error("aio_depth required\n");
+			else if (optopt == 'B')
+				gbsim_error("shm_requests required\n");
+			else if (optopt == 'c')
+				gbsim_error("coalesce_size required\n");
+			else if (optopt == 'C')
+				gbsim_error("credit_window required\n");
+			else if (optopt == 'D')
+				gbsim_error("trace file required\n");
+			else if (optopt == 'e')
+				gbsim_error("ep_pairs required\n");
+			else if (optopt == 'i')
 				gbsim_error("i2c_adapter required\n");
 			else if (optopt == 'h')
 				gbsim_error("hotplug_basedir required\n");
+			else if (optopt == 'L')
+				gbsim_error("stats_path required\n");
+			else if (optopt == 'm')
+				gbsim_error("msg_size_max required\n");
+			else if (optopt == 'M')
+				gbsim_error("max_burst required\n");
+			else if (optopt == 'n')
+				gbsim_error("bridge_count required\n");
+			else if (optopt == 'o')
+				gbsim_error("record_path required\n");
+			else if (optopt == 'O')
+				gbsim_error("replay_path required\n");
+			else if (optopt == 'p')
+				gbsim_error("capture_path required\n");
+			else if (optopt == 'P')
+				gbsim_error("bulk_packet_size required\n");
+			else if (optopt == 'R')
+				gbsim_error("rx_size required\n");
+			else if (optopt == 's')
+				gbsim_error("usb_max_speed required\n");
+			else if (optopt == 'S')
+				gbsim_error("socket_path required\n");
+			else if (optopt == 'T')
+				gbsim_error("trace_path required\n");
 			else if (optopt == 'u')
 				gbsim_error("uart_portno required\n");
 			else if (optopt == 'U')
 				gbsim_error("uart_count required\n");
+			else if (optopt == 'w')
+				gbsim_error("worker_count required\n");
 			else
 				gbsim_error("-%c requires an argument\n",
 					optopt);
@@ -120,32 +327,180 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
-	signals_init();
+	if (worker_count < 1) {
+		gbsim_error("invalid worker count %d, aborting\n", worker_count);
+		return 1;
+	}
+
+	if (aio_depth < 0) {
+		gbsim_error("invalid aio depth %d, aborting\n", aio_depth);
+		return 1;
+	}
+
+	if (credit_window < 0) {
+		gbsim_error("invalid credit window %d, aborting\n",
+			    credit_window);
+		return 1;
+	}
+
+	if (bridge_count < 1 || bridge_count > GBSIM_BRIDGES_MAX) {
+		gbsim_error("invalid number of bridges %d, aborting\n",
+			    bridge_count);
+		return 1;
+	}
+
+	if (ep_pairs < 1 || ep_pairs > GBSIM_EP_PAIRS_MAX) {
+		gbsim_error("invalid number of endpoint pairs %d, aborting\n",
+			    ep_pairs);
+		return 1;
+	}
+
+	if (max_burst < 0 || max_burst > 15) {
+		gbsim_error("invalid max burst %d, aborting\n", max_burst);
+		return 1;
+	}
+
+	/* One of the full speed bulk packet sizes, the only speed it applies to */
+	if (bulk_packet_size && (bulk_packet_size < 8 || bulk_packet_size > 64 ||
+				 bulk_packet_size & (bulk_packet_size - 1))) {
+		gbsim_error("invalid bulk packet size %d, aborting\n",
+			    bulk_packet_size);
+		return 1;
+	}
+
+	if (socket_path && shm_requests) {
+		gbsim_error("-S and -B select different transports, aborting\n");
+		return 1;
+	}
+
+	if ((socket_path || shm_requests) && replay_path) {
+		gbsim_error("-O replaces the AP, it cannot be used with -S or -B, aborting\n");
+		return 1;
+	}
+
+	if (replay_paced && !replay_path) {
+		gbsim_error("-t needs a recording to replay with -O, aborting\n");
+		return 1;
+	}
+
+	/* The host driver takes one message per bulk-IN transfer */
+	if (coalesce_size && !socket_path && !shm_requests && !replay_path) {
+		gbsim_error("coalescing needs a transport other than functionfs, aborting\n");
+		return 1;
+	}
+
+	if ((socket_path || shm_requests || replay_path) && aio_depth) {
+		gbsim_error("asynchronous I/O needs the functionfs transport, aborting\n");
+		return 1;
+	}
+
+	if ((socket_path || shm_requests || replay_path) && gadget_keep) {
+		gbsim_error("keeping the gadget needs the functionfs transport, aborting\n");
+		return 1;
+	}
+
+	if ((socket_path || shm_requests || replay_path) && warm_restart) {
+		gbsim_error("warm restart needs the functionfs transport, aborting\n");
+		return 1;
+	}
+
+	if ((socket_path || shm_requests || replay_path) && bridge_count > 1) {
+		gbsim_error("several bridges need the functionfs transport, aborting\n");
+		return 1;
+	}
+
+	if (aio_depth && bridge_count > 1) {
+		gbsim_error("asynchronous I/O only serves one bridge, aborting\n");
+		return 1;
+	}
 
-	TAILQ_INIT(&info.cports);
+	if ((socket_path || shm_requests || replay_path) && ep_pairs > 1) {
+		gbsim_error("endpoint pairs need the functionfs transport, aborting\n");
+		return 1;
+	}
+
+	/* The message header carries the size in 16 bits */
+	if (msg_size_max < ES1_MSG_SIZE || msg_size_max > UINT16_MAX) {
+		gbsim_error("invalid max message size %zu, aborting\n",
+			    msg_size_max);
+		return 1;
+	}
+
+	if (rx_size < msg_size_max) {
+		gbsim_error("receive size %zu smaller than a message, aborting\n",
+			    rx_size);
+		return 1;
+	}
+
+	startup_begin();
+
+	ret = reactor_init();
+	if (ret < 0)
+		goto out;
+
+	ret = signals_init();
+	if (ret < 0)
+		goto out;
+
+	ret = trace_init();
+	if (ret < 0)
+		goto out;
+
+	ret = stats_init();
+	if (ret < 0)
+		goto out;
+	startup_phase("reactor");
+
+	bridges_init();
+	protocols_register();
+
+	ret = capture_init();
+	if (ret < 0)
+		goto out;
+
+	ret = record_init();
+	if (ret < 0)
+		goto out;
+
+	if (socket_path)
+		transport = &socket_transport;
+	else if (shm_requests)
+		transport = &shm_transport;
+	else if (replay_path)
+		transport = &replay_transport;
+
+	ret = transport->init();
+	if (ret < 0)
+		goto out;
+	startup_phase(transport->name);
+
+	/* Protocol handlers; the others start with their first CPort */
+	protocols_init();
+	startup_phase("svc");
+
+	ret = txbuf_init();
+	if (ret < 0)
+		goto out;
 
-	ret = gadget_create(&s, &g);
+	ret = outbound_init();
 	if (ret < 0)
 		goto out;
 
-	ret = functionfs_init();
+	ret = operation_init();
 	if (ret < 0)
 		goto out;
+	startup_phase("queues");
 
-	ret = gadget_enable(g);
+	ret = dispatch_init();
 	if (ret < 0)
 		goto out;
+	startup_phase("workers");
 
-	/* Protocol handlers */
-	svc_init();
-	gpio_init();
-	i2c_init();
-	i2s_init();
-	uart_init();
-	sdio_init();
-	loopback_init();
+	startup_report();
 
-	ret = functionfs_loop();
+	/* Returns once stopped by a signal, or when a benchmark or replay ends */
+	ret = transport->loop();
+	cleanup();
 
 out:
 	return ret;
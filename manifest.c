@@ -17,26 +17,26 @@
 
 /*
  * Greybus kernel assigns hd-cport-ids to cports in the order they are present
- * in manifest. To match that here, we can just use a simple counter.
+ * in manifest. To match that here, we can just use a simple counter, one per
+ * bridge.
  */
-static uint16_t hd_cport_id_counter;
 static int control_done;
 
-static uint16_t allocate_hd_cport_id(void)
+static uint16_t allocate_hd_cport_id(struct gbsim_bridge *bridge)
 {
 	/*
 	 * AP's hd_cport_id GB_SVC_CPORT_ID is reserved and must not be used for
 	 * other protocols.
 	 */
-	if (hd_cport_id_counter == GB_SVC_CPORT_ID)
-		++hd_cport_id_counter;
+	if (bridge->hd_cport_id_counter == GB_SVC_CPORT_ID)
+		++bridge->hd_cport_id_counter;
 
-	return hd_cport_id_counter++;
+	return bridge_cport_id(bridge, bridge->hd_cport_id_counter++);
 }
 
-void reset_hd_cport_id(void)
+void reset_hd_cport_id(struct gbsim_bridge *bridge)
 {
-	hd_cport_id_counter = 0;
+	bridge->hd_cport_id_counter = 0;
 }
 
 /*
@@ -49,7 +49,8 @@ void reset_hd_cport_id(void)
  * Returns the number of bytes consumed by the descriptor, or a
  * negative errno.
  */
-static int identify_descriptor(struct greybus_descriptor *desc, size_t size)
+static int identify_descriptor(struct gbsim_bridge *bridge,
+			       struct greybus_descriptor *desc, size_t size)
 {
 	struct greybus_descriptor_header *desc_header = &desc->header;
 	size_t expected_size;
@@ -86,6 +87,12 @@ static int identify_descriptor(struct greybus_descriptor *desc, size_t size)
 	case GREYBUS_TYPE_CPORT:
 		expected_size += sizeof(struct greybus_descriptor_cport);
 
+		/* Room for this CPort, and the control one it may bring */
+		if (bridge->hd_cport_id_counter >= GBSIM_BRIDGE_CPORTS - 2) {
+			gbsim_error("out of hd cport ids\n");
+			return -ENOSPC;
+		}
+
 		/*
 		 * Module's control protocol's node might not be present in
 		 * manifest, and the first allocated cport should be for control
@@ -94,12 +101,13 @@ static int identify_descriptor(struct greybus_descriptor *desc, size_t size)
 		if (!control_done &&
 			(le16toh(desc->cport.id) != GB_CONTROL_CPORT_ID)) {
 			allocate_cport(GB_CONTROL_CPORT_ID,
-					allocate_hd_cport_id(),
+					allocate_hd_cport_id(bridge),
 					GREYBUS_PROTOCOL_CONTROL);
 		}
 
 		control_done = 1;
-		allocate_cport(le16toh(desc->cport.id), allocate_hd_cport_id(),
+		allocate_cport(le16toh(desc->cport.id),
+				allocate_hd_cport_id(bridge),
 				desc->cport.protocol_id);
 		break;
 	case GREYBUS_TYPE_INVALID:
@@ -146,7 +154,7 @@ static int identify_descriptor(struct greybus_descriptor *desc, size_t size)
  *
  * Returns true if parsing was successful, false otherwise.
  */
-bool manifest_parse(void *data, size_t size)
+bool manifest_parse(struct gbsim_bridge *bridge, void *data, size_t size)
 {
 	struct greybus_manifest *manifest;
 	struct greybus_manifest_header *header;
@@ -187,7 +195,7 @@ bool manifest_parse(void *data, size_t size)
 	while (size) {
 		int desc_size;
 
-		desc_size = identify_descriptor(desc, size);
+		desc_size = identify_descriptor(bridge, desc, size);
 		if (desc_size < 0)
 			return false;
 
@@ -0,0 +1,503 @@
+/*
+ * Greybus Simulator: tracking of module-initiated operations
+ *
+ * Copyright 2015 Google Inc.
+ * Copyright 2015 Linaro Ltd.
+ *
+ * Provided under the three clause BSD license found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gbsim.h"
+
+/*
+ * Requests sent to the AP (SVC hotplug, GPIO IRQ events, SDIO card events,
+ * UART receive data) get a real operation id, allocated per CPort, and are
+ * entered in a table keyed by (hd_cport_id, operation id) until the AP
+ * responds. Responses are matched by the receive path as soon as they are
+ * framed, so the round-trip time does not include any queueing behind the
+ * CPort workers. A request left unanswered for OPERATION_TIMEOUT_MS is
+ * dropped from the table and counted as timed out.
+ *
+ * Each outstanding request holds one of its CPort's credit_window credits,
+ * given back when the request completes or times out. A sender finding no
+ * credit left waits for one, which pushes back on whatever generates the
+ * traffic. Senders that must not block, like anything on the main loop,
+ * use operation_try_start() and get -EAGAIN instead. Backends that can
+ * simply stop producing, like the UART reading its tty, check
+ * operation_credits() first and have their protocol's unthrottle hook
+ * called once credits are returned.
+ */
+#define OPERATION_TIMEOUT_MS	2000
+#define OPERATION_HASH_SIZE	256
+
+struct gbsim_operation {
+	TAILQ_ENTRY(gbsim_operation) node;
+	struct gbsim_operation *hnext;
+	uint16_t hd_cport_id;
+	uint16_t id;
+	uint8_t type;
+	struct timespec start;
+};
+
+struct gbsim_op_cport {
+	uint16_t next_id;
+	unsigned int in_flight;
+	bool throttled;
+	struct gbsim_op_stats stats;
+};
+
+/* Pending operations, oldest first, which is also the order they expire */
+static TAILQ_HEAD(, gbsim_operation) op_pending =
+	TAILQ_HEAD_INITIALIZER(op_pending);
+static struct gbsim_operation *op_hash[OPERATION_HASH_SIZE];
+static struct gbsim_op_cport *op_cports[UINT16_MAX + 1];
+static pthread_mutex_t op_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t op_cond;
+static pthread_cond_t op_credit_cond;
+static bool op_terminate;
+static bool op_started;
+static pthread_t op_pthread;
+
+static inline unsigned int op_hash_index(uint16_t hd_cport_id, uint16_t id)
+{
+	return (hd_cport_id * 31 + id) % OPERATION_HASH_SIZE;
+}
+
+static uint64_t timespec_diff_ns(const struct timespec *end,
+				 const struct timespec *start)
+{
+	return (end->tv_sec - start->tv_sec) * 1000000000ULL +
+	       end->tv_nsec - start->tv_nsec;
+}
+
+static struct gbsim_operation **op_lookup(uint16_t hd_cport_id, uint16_t id)
+{
+	struct gbsim_operation **pp;
+
+	pp = &op_hash[op_hash_index(hd_cport_id, id)];
+	for (; *pp; pp = &(*pp)->hnext)
+		if ((*pp)->hd_cport_id == hd_cport_id && (*pp)->id == id)
+			break;
+
+	return pp;
+}
+
+/* Must be called with op_lock held */
+static struct gbsim_op_cport *op_cport_get(uint16_t hd_cport_id)
+{
+	struct gbsim_op_cport *oc = op_cports[hd_cport_id];
+
+	if (!oc) {
+		oc = calloc(1, sizeof(*oc));
+		if (!oc)
+			return NULL;
+		oc->stats.latency_min_ns = UINT64_MAX;
+		op_cports[hd_cport_id] = oc;
+	}
+
+	return oc;
+}
+
+/*
+ * Let the CPort's protocol know it can start sending again. Protocol code
+ * is called without op_lock, and outside any CPort read section.
+ */
+static void op_unthrottle(int hd_cport_id)
+{
+	const struct gbsim_protocol *proto = NULL;
+	struct gbsim_cport *cport;
+
+	if (hd_cport_id < 0)
+		return;
+
+	cport_read_lock();
+	cport = cport_find(hd_cport_id);
+	if (cport)
+		proto = cport->proto;
+	cport_read_unlock();
+
+	if (proto && proto->unthrottle)
+		proto->unthrottle(hd_cport_id);
+}
+
+/*
+ * Must be called with op_lock held. Returns the hd_cport_id to pass to
+ * op_unthrottle() once op_lock has been dropped, or -1.
+ */
+static int op_remove(struct gbsim_operation **pp)
+{
+	struct gbsim_operation *op = *pp;
+	struct gbsim_op_cport *oc = op_cports[op->hd_cport_id];
+	int unthrottle = -1;
+
+	*pp = op->hnext;
+	TAILQ_REMOVE(&op_pending, op, node);
+
+	/* Return the operation's credit */
+	oc->in_flight--;
+	pthread_cond_broadcast(&op_credit_cond);
+	if (oc->throttled) {
+		oc->throttled = false;
+		unthrottle = op->hd_cport_id;
+	}
+
+	free(op);
+
+	return unthrottle;
+}
+
+/* Must be called with op_lock held */
+static bool op_has_credit(struct gbsim_op_cport *oc)
+{
+	return !credit_window || oc->in_flight < (unsigned int)credit_window;
+}
+
+static int op_start(uint16_t hd_cport_id, uint8_t type, bool wait)
+{
+	struct gbsim_operation *op;
+	struct gbsim_op_cport *oc;
+	struct timespec stall, now;
+	int tries;
+
+	op = calloc(1, sizeof(*op));
+	if (!op)
+		return -ENOMEM;
+
+	pthread_mutex_lock(&op_lock);
+	oc = op_cport_get(hd_cport_id);
+	if (!oc) {
+		pthread_mutex_unlock(&op_lock);
+		free(op);
+		return -ENOMEM;
+	}
+
+	if (!op_has_credit(oc)) {
+		oc->stats.stalls++;
+		if (!wait) {
+			/* Unthrottled like a caller of operation_credits() */
+			oc->throttled = true;
+			pthread_mutex_unlock(&op_lock);
+			free(op);
+			return -EAGAIN;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &stall);
+		while (!op_has_credit(oc) && !op_terminate)
+			pthread_cond_wait(&op_credit_cond, &op_lock);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		oc->stats.stall_ns += timespec_diff_ns(&now, &stall);
+		if (op_terminate) {
+			pthread_mutex_unlock(&op_lock);
+			free(op);
+			return -ESHUTDOWN;
+		}
+	}
+
+	/* Skip 0 and the ids of operations still outstanding on this CPort */
+	for (tries = 0; tries < UINT16_MAX; tries++) {
+		if (++oc->next_id == 0)
+			oc->next_id = 1;
+		if (!*op_lookup(hd_cport_id, oc->next_id))
+			break;
+	}
+	if (tries == UINT16_MAX) {
+		pthread_mutex_unlock(&op_lock);
+		free(op);
+		return -EBUSY;
+	}
+
+	op->hd_cport_id = hd_cport_id;
+	op->id = oc->next_id;
+	op->type = type;
+	clock_gettime(CLOCK_MONOTONIC, &op->start);
+
+	op->hnext = op_hash[op_hash_index(hd_cport_id, op->id)];
+	op_hash[op_hash_index(hd_cport_id, op->id)] = op;
+	if (TAILQ_EMPTY(&op_pending))
+		pthread_cond_signal(&op_cond);
+	TAILQ_INSERT_TAIL(&op_pending, op, node);
+	oc->in_flight++;
+	oc->stats.requests++;
+	pthread_mutex_unlock(&op_lock);
+
+	return op->id;
+}
+
+/*
+ * Start tracking a request about to be sent to the AP on the given CPort,
+ * waiting for a credit if the CPort has used up its window. Returns the
+ * operation id to send it with, which is never 0 as that marks
+ * unidirectional operations, or a negative error.
+ */
+int operation_start(uint16_t hd_cport_id, uint8_t type)
+{
+	return op_start(hd_cport_id, type, true);
+}
+
+/* As operation_start(), but -EAGAIN rather than waiting for a credit */
+int operation_try_start(uint16_t hd_cport_id, uint8_t type)
+{
+	return op_start(hd_cport_id, type, false);
+}
+
+/* Stop tracking a request that could not be sent */
+void operation_cancel(uint16_t hd_cport_id, uint16_t id)
+{
+	struct gbsim_operation **pp;
+	int unthrottle = -1;
+
+	pthread_mutex_lock(&op_lock);
+	pp = op_lookup(hd_cport_id, id);
+	if (*pp) {
+		unthrottle = op_remove(pp);
+		op_cports[hd_cport_id]->stats.requests--;
+	}
+	pthread_mutex_unlock(&op_lock);
+
+	op_unthrottle(unthrottle);
+}
+
+/*
+ * Match a response from the AP with the request it answers, and account
+ * for its round-trip time. Returns false if no such request is pending,
+ * e.g. because it already timed out.
+ */
+bool operation_complete(uint16_t hd_cport_id, uint16_t id, uint8_t type)
+{
+	struct gbsim_operation **pp;
+	struct gbsim_op_stats *stats;
+	struct timespec now;
+	int unthrottle;
+	uint64_t ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	pthread_mutex_lock(&op_lock);
+	pp = op_lookup(hd_cport_id, id);
+	if (!*pp || (*pp)->type != (type & ~OP_RESPONSE)) {
+		if (op_cports[hd_cport_id])
+			op_cports[hd_cport_id]->stats.unmatched++;
+		pthread_mutex_unlock(&op_lock);
+		gbsim_error("unexpected response %02x id %hu on cport %hu\n",
+			    type, id, hd_cport_id);
+		return false;
+	}
+
+	ns = timespec_diff_ns(&now, &(*pp)->start);
+	stats = &op_cports[hd_cport_id]->stats;
+	stats->responses++;
+	stats->latency_total_ns += ns;
+	if (ns < stats->latency_min_ns)
+		stats->latency_min_ns = ns;
+	if (ns > stats->latency_max_ns)
+		stats->latency_max_ns = ns;
+
+	unthrottle = op_remove(pp);
+	pthread_mutex_unlock(&op_lock);
+
+	op_unthrottle(unthrottle);
+
+	return true;
+}
+
+/*
+ * Drop every request of the bridge's CPorts still waiting for an answer,
+ * e.g. once its AP has gone away, returning their credits. They are
+ * counted as timed out.
+ */
+void operation_cancel_all(struct gbsim_bridge *bridge)
+{
+	struct gbsim_operation *op, *next;
+	int unthrottle;
+
+	pthread_mutex_lock(&op_lock);
+again:
+	for (op = TAILQ_FIRST(&op_pending); op; op = next) {
+		next = TAILQ_NEXT(op, node);
+		if (cport_bridge(op->hd_cport_id) != bridge)
+			continue;
+		op_cports[op->hd_cport_id]->stats.timeouts++;
+		unthrottle = op_remove(op_lookup(op->hd_cport_id, op->id));
+		if (unthrottle >= 0) {
+			/* The list may change meanwhile, so start over */
+			pthread_mutex_unlock(&op_lock);
+			op_unthrottle(unthrottle);
+			pthread_mutex_lock(&op_lock);
+			goto again;
+		}
+	}
+	pthread_mutex_unlock(&op_lock);
+}
+
+/*
+ * The number of requests the CPort can send before running out of credit,
+ * or INT_MAX if there is no window. A caller finding none left is throttled:
+ * its protocol's unthrottle hook is called once a credit comes back.
+ */
+int operation_credits(uint16_t hd_cport_id)
+{
+	struct gbsim_op_cport *oc;
+	int credits;
+
+	if (!credit_window)
+		return INT_MAX;
+
+	pthread_mutex_lock(&op_lock);
+	oc = op_cport_get(hd_cport_id);
+	if (!oc) {
+		credits = credit_window;
+	} else {
+		credits = credit_window - oc->in_flight;
+		if (credits <= 0) {
+			credits = 0;
+			oc->throttled = true;
+		}
+	}
+	pthread_mutex_unlock(&op_lock);
+
+	return credits;
+}
+
+/* Copy the operation statistics of a CPort; false if it never sent any */
+bool operation_get_stats(uint16_t hd_cport_id, struct gbsim_op_stats *stats)
+{
+	bool found = false;
+
+	pthread_mutex_lock(&op_lock);
+	if (op_cports[hd_cport_id]) {
+		*stats = op_cports[hd_cport_id]->stats;
+		found = true;
+	}
+	pthread_mutex_unlock(&op_lock);
+
+	return found;
+}
+
+static void *operation_timeout_thread(void *param)
+{
+	struct gbsim_operation *op;
+	struct timespec now, deadline;
+	int unthrottle;
+
+	pthread_mutex_lock(&op_lock);
+	while (!op_terminate) {
+		op = TAILQ_FIRST(&op_pending);
+		if (!op) {
+			pthread_cond_wait(&op_cond, &op_lock);
+			continue;
+		}
+
+		deadline = op->start;
+		deadline.tv_sec += OPERATION_TIMEOUT_MS / 1000;
+		deadline.tv_nsec += (OPERATION_TIMEOUT_MS % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (now.tv_sec < deadline.tv_sec ||
+		    (now.tv_sec == deadline.tv_sec &&
+		     now.tv_nsec < deadline.tv_nsec)) {
+			pthread_cond_timedwait(&op_cond, &op_lock, &deadline);
+			continue;
+		}
+
+		gbsim_error("operation %02x id %hu on cport %hu timed out\n",
+			    op->type, op->id, op->hd_cport_id);
+		op_cports[op->hd_cport_id]->stats.timeouts++;
+		unthrottle = op_remove(op_lookup(op->hd_cport_id, op->id));
+		if (unthrottle >= 0) {
+			pthread_mutex_unlock(&op_lock);
+			op_unthrottle(unthrottle);
+			pthread_mutex_lock(&op_lock);
+		}
+	}
+	pthread_mutex_unlock(&op_lock);
+
+	return NULL;
+}
+
+int operation_init(void)
+{
+	pthread_condattr_t attr;
+	int ret;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&op_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_cond_init(&op_credit_cond, NULL);
+
+	ret = pthread_create(&op_pthread, NULL, operation_timeout_thread, NULL);
+	if (ret) {
+		gbsim_error("can't create operation timeout thread\n");
+		return -ret;
+	}
+	op_started = true;
+
+	return 0;
+}
+
+/*
+ * Wake up every sender waiting for a credit, and make it fail, so that the
+ * CPort workers can be joined; operation_cleanup() finishes the job.
+ */
+void operation_stop(void)
+{
+	pthread_mutex_lock(&op_lock);
+	op_terminate = true;
+	pthread_cond_signal(&op_cond);
+	pthread_cond_broadcast(&op_credit_cond);
+	pthread_mutex_unlock(&op_lock);
+}
+
+void operation_cleanup(void)
+{
+	struct gbsim_op_stats *stats;
+	struct gbsim_operation *op;
+	int i;
+
+	if (!op_started)
+		return;
+	op_started = false;
+
+	operation_stop();
+	pthread_join(op_pthread, NULL);
+
+	pthread_mutex_lock(&op_lock);
+	while ((op = TAILQ_FIRST(&op_pending)))
+		op_remove(op_lookup(op->hd_cport_id, op->id));
+	pthread_mutex_unlock(&op_lock);
+
+	for (i = 0; i <= UINT16_MAX; i++) {
+		if (!op_cports[i])
+			continue;
+		stats = &op_cports[i]->stats;
+		if (stats->responses)
+			gbsim_event(GBSIM_LOG_INFO, "cport_requests",
+				    "hd_cport_id=%d requests=%lu responses=%lu timeouts=%lu min_us=%llu avg_us=%llu max_us=%llu",
+				    i, stats->requests, stats->responses,
+				    stats->timeouts,
+				    (unsigned long long)stats->latency_min_ns / 1000,
+				    (unsigned long long)(stats->latency_total_ns /
+							 stats->responses) / 1000,
+				    (unsigned long long)stats->latency_max_ns / 1000);
+		if (stats->stalls)
+			gbsim_event(GBSIM_LOG_INFO, "cport_stalls",
+				    "hd_cport_id=%d stalls=%lu us=%llu",
+				    i, stats->stalls,
+				    (unsigned long long)stats->stall_ns / 1000);
+		free(op_cports[i]);
+		op_cports[i] = NULL;
+	}
+}
@@ -0,0 +1,339 @@
+/*
+ * Greybus Simulator: outbound message scheduler
+ *
+ * Copyright 2015 Google Inc.
+ * Copyright 2015 Linaro Ltd.
+ *
+ * Provided under the three clause BSD license found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "gbsim.h"
+
+/*
+ * Every message to the AP, be it a response from a CPort worker or an
+ * unsolicited request from the UART, GPIO, SDIO or hotplug threads, is
+ * queued here rather than written by the thread that built it. Each CPort
+ * has its own lock-free multi-producer, single-consumer queue, and a CPort
+ * with messages pending is put once on a ready queue. A single scheduler
+ * thread is the only writer to the transport: it serves the ready
+ * CPorts round-robin, one message per CPort per turn, so a chatty CPort
+ * cannot starve the others. When coalescing is enabled, messages picked
+ * in the same round are handed to the transport together, to be written
+ * at once (e.g. in one write to the socket), up to coalesce_size bytes.
+ */
+#define OUTBOUND_BATCH_MAX	16
+
+/*
+ * Intrusive MPSC queue: producers swap themselves in at the head, the
+ * consumer walks from the tail. The stub node keeps the queue non-empty so
+ * that neither side ever has to update both ends.
+ */
+struct gbsim_mpsc {
+	struct gbsim_qnode *head;
+	struct gbsim_qnode *tail;
+	struct gbsim_qnode stub;
+};
+
+struct gbsim_outq {
+	struct gbsim_mpsc	msgs;
+	struct gbsim_qnode	ready_node;
+	struct gbsim_outq	*rr_next;
+	bool			scheduled;
+};
+
+static struct gbsim_outq *outqs[UINT16_MAX + 1];
+static struct gbsim_mpsc ready;
+static int outbound_efd = -1;
+static bool outbound_started;
+static bool outbound_terminate;
+static pthread_t outbound_pthread;
+
+static void mpsc_init(struct gbsim_mpsc *q)
+{
+	q->stub.next = NULL;
+	q->head = &q->stub;
+	q->tail = &q->stub;
+}
+
+static void mpsc_push(struct gbsim_mpsc *q, struct gbsim_qnode *n)
+{
+	struct gbsim_qnode *prev;
+
+	n->next = NULL;
+	prev = __atomic_exchange_n(&q->head, n, __ATOMIC_ACQ_REL);
+	__atomic_store_n(&prev->next, n, __ATOMIC_RELEASE);
+}
+
+/*
+ * Only called from the scheduler thread. May return NULL while a producer
+ * is half way through a push; that producer then goes on to mark its CPort
+ * scheduled, which the callers rely on to pick the message up later.
+ */
+static struct gbsim_qnode *mpsc_pop(struct gbsim_mpsc *q)
+{
+	struct gbsim_qnode *tail = q->tail;
+	struct gbsim_qnode *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+	if (tail == &q->stub) {
+		if (!next)
+			return NULL;
+		q->tail = next;
+		tail = next;
+		next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	}
+
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+
+	if (tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	mpsc_push(q, &q->stub);
+
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+
+	return NULL;
+}
+
+static struct gbsim_outq *outq_get(uint16_t hd_cport_id)
+{
+	struct gbsim_outq *q, *expected = NULL;
+
+	q = __atomic_load_n(&outqs[hd_cport_id], __ATOMIC_ACQUIRE);
+	if (q)
+		return q;
+
+	q = calloc(1, sizeof(*q));
+	if (!q)
+		return NULL;
+	mpsc_init(&q->msgs);
+
+	if (!__atomic_compare_exchange_n(&outqs[hd_cport_id], &expected, q,
+					 false, __ATOMIC_ACQ_REL,
+					 __ATOMIC_ACQUIRE)) {
+		free(q);
+		q = expected;
+	}
+
+	return q;
+}
+
+/* Put a CPort on the ready queue, unless it is already scheduled */
+static void outq_schedule(struct gbsim_outq *q)
+{
+	uint64_t one = 1;
+
+	if (__atomic_exchange_n(&q->scheduled, true, __ATOMIC_SEQ_CST))
+		return;
+
+	mpsc_push(&ready, &q->ready_node);
+	if (write(outbound_efd, &one, sizeof(one)) != sizeof(one))
+		gbsim_error("failed to wake outbound scheduler\n");
+}
+
+/*
+ * Queue a buffer for the AP. The CPort is taken from the header pad bytes
+ * of the message. Ownership of the buffer passes to the scheduler, which
+ * releases it once written.
+ */
+int outbound_queue(struct gbsim_txbuf *tb, size_t size)
+{
+	struct op_msg *op = (struct op_msg *)tb->buf;
+	struct gbsim_outq *q;
+
+	tb->size = size;
+	tb->hd_cport_id = op->header.pad[1] << 8 | op->header.pad[0];
+
+	q = outq_get(tb->hd_cport_id);
+	if (!q) {
+		gbsim_error("failed to allocate outbound queue for cport %hu\n",
+			    tb->hd_cport_id);
+		txbuf_release(tb);
+		return -ENOMEM;
+	}
+
+	mpsc_push(&q->msgs, &tb->qnode);
+	outq_schedule(q);
+
+	return 0;
+}
+
+/*
+ * Take the next message of a ready CPort. *keep tells the caller whether
+ * the CPort stays on its round-robin list; once its queue is found empty it
+ * is unscheduled, and a producer queueing to it afterwards reschedules it.
+ */
+static struct gbsim_txbuf *outq_next(struct gbsim_outq *q, bool *keep)
+{
+	struct gbsim_qnode *n;
+
+	n = mpsc_pop(&q->msgs);
+	if (n) {
+		*keep = true;
+		return container_of(n, struct gbsim_txbuf, qnode);
+	}
+
+	__atomic_store_n(&q->scheduled, false, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	/* Catch a message queued while the CPort was being unscheduled */
+	n = mpsc_pop(&q->msgs);
+	if (!n) {
+		*keep = false;
+		return NULL;
+	}
+
+	*keep = !__atomic_exchange_n(&q->scheduled, true, __ATOMIC_SEQ_CST);
+	return container_of(n, struct gbsim_txbuf, qnode);
+}
+
+static void outbound_flush(struct gbsim_txbuf **batch, int count)
+{
+	if (count)
+		transport->send(batch, count);
+}
+
+static void *outbound_thread(void *param)
+{
+	struct gbsim_txbuf *batch[OUTBOUND_BATCH_MAX];
+	struct gbsim_outq *rr_head = NULL, **rr_tail = &rr_head;
+	struct gbsim_outq *q;
+	struct gbsim_qnode *n;
+	struct gbsim_txbuf *tb;
+	size_t batch_size = 0;
+	int count = 0;
+	uint64_t ready_count;
+	bool keep;
+
+	while (1) {
+		/* Newly ready CPorts join the end of the round-robin list */
+		while ((n = mpsc_pop(&ready))) {
+			q = container_of(n, struct gbsim_outq, ready_node);
+			q->rr_next = NULL;
+			*rr_tail = q;
+			rr_tail = &q->rr_next;
+		}
+
+		if (!rr_head) {
+			outbound_flush(batch, count);
+			count = 0;
+			batch_size = 0;
+
+			/* Only stopped once everything queued has been sent */
+			if (__atomic_load_n(&outbound_terminate,
+					    __ATOMIC_ACQUIRE))
+				break;
+
+			if (read(outbound_efd, &ready_count,
+				 sizeof(ready_count)) < 0 && errno != EINTR) {
+				gbsim_error("outbound eventfd read: %s\n",
+					    strerror(errno));
+				return NULL;
+			}
+			continue;
+		}
+
+		q = rr_head;
+		rr_head = q->rr_next;
+		if (!rr_head)
+			rr_tail = &rr_head;
+
+		tb = outq_next(q, &keep);
+		if (keep) {
+			q->rr_next = NULL;
+			*rr_tail = q;
+			rr_tail = &q->rr_next;
+		}
+		if (!tb)
+			continue;
+
+		if (count && (count == OUTBOUND_BATCH_MAX ||
+			      batch_size + tb->size > coalesce_size)) {
+			outbound_flush(batch, count);
+			count = 0;
+			batch_size = 0;
+		}
+
+		batch[count++] = tb;
+		batch_size += tb->size;
+
+		if (!coalesce_size) {
+			outbound_flush(batch, count);
+			count = 0;
+			batch_size = 0;
+		}
+	}
+
+	return NULL;
+}
+
+int outbound_init(void)
+{
+	int ret;
+
+	mpsc_init(&ready);
+
+	outbound_efd = eventfd(0, 0);
+	if (outbound_efd < 0) {
+		gbsim_error("outbound eventfd: %s\n", strerror(errno));
+		return -errno;
+	}
+
+	ret = pthread_create(&outbound_pthread, NULL, outbound_thread, NULL);
+	if (ret) {
+		gbsim_error("can't create outbound thread\n");
+		close(outbound_efd);
+		outbound_efd = -1;
+		return -ret;
+	}
+	outbound_started = true;
+
+	if (coalesce_size)
+		gbsim_debug("coalescing messages to the AP up to %zu bytes\n",
+			    coalesce_size);
+
+	return 0;
+}
+
+/*
+ * Must be called once nothing queues messages anymore. The scheduler is
+ * never cancelled, it may be holding a transport's lock.
+ */
+void outbound_cleanup(void)
+{
+	uint64_t one = 1;
+	int i;
+
+	if (!outbound_started)
+		return;
+	outbound_started = false;
+
+	__atomic_store_n(&outbound_terminate, true, __ATOMIC_RELEASE);
+	if (write(outbound_efd, &one, sizeof(one)) != sizeof(one))
+		gbsim_error("failed to wake outbound scheduler\n");
+	pthread_join(outbound_pthread, NULL);
+
+	close(outbound_efd);
+	outbound_efd = -1;
+
+	for (i = 0; i <= UINT16_MAX; i++) {
+		free(outqs[i]);
+		outqs[i] = NULL;
+	}
+}
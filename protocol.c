@@ -0,0 +1,101 @@
+/*
+ * Greybus Simulator: protocol registration
+ *
+ * Copyright 2015 Google Inc.
+ * Copyright 2015 Linaro Ltd.
+ *
+ * Provided under the three clause BSD license found in the LICENSE file.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "gbsim.h"
+
+/*
+ * Each protocol describes itself with a struct gbsim_protocol: its handler,
+ * a table of operation names for logging, and its init/cleanup hooks. The
+ * protocols are registered once at startup into a table indexed by
+ * protocol id, and every CPort resolves its entry when it is allocated, so
+ * dispatching a message is a single indirect call.
+ *
+ * A protocol's backend is only started, by its init hook, once a CPort
+ * using it is allocated, so protocols no module uses cost nothing. Only
+ * the SVC protocol, which gbsim needs before any module appears, is
+ * started up front, outside the lock, as its init hook allocates the SVC
+ * CPorts.
+ */
+static const struct gbsim_protocol *protocols[UINT8_MAX + 1];
+static bool protocol_started[UINT8_MAX + 1];
+static pthread_mutex_t protocol_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void protocol_register(const struct gbsim_protocol *proto)
+{
+	if (protocols[proto->id])
+		gbsim_error("protocol 0x%02x registered twice\n", proto->id);
+	protocols[proto->id] = proto;
+}
+
+const struct gbsim_protocol *protocol_find(uint8_t id)
+{
+	return protocols[id];
+}
+
+const char *protocol_get_operation(const struct gbsim_protocol *proto,
+				   uint8_t type)
+{
+	if (type >= proto->operation_count || !proto->operations[type])
+		return "(Unknown operation)";
+
+	return proto->operations[type];
+}
+
+static void protocol_init(const struct gbsim_protocol *proto)
+{
+	struct timespec t;
+
+	if (!proto->init)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	proto->init();
+	gbsim_event(GBSIM_LOG_INFO, "protocol_start", "protocol=%s us=%lu",
+		    proto->name, phase_us(&t));
+}
+
+/* Start the protocol's backend, unless a CPort already did */
+void protocol_start(const struct gbsim_protocol *proto)
+{
+	pthread_mutex_lock(&protocol_lock);
+	if (!protocol_started[proto->id]) {
+		protocol_started[proto->id] = true;
+		protocol_init(proto);
+	}
+	pthread_mutex_unlock(&protocol_lock);
+}
+
+void protocols_init(void)
+{
+	pthread_mutex_lock(&protocol_lock);
+	protocol_started[svc_protocol.id] = true;
+	pthread_mutex_unlock(&protocol_lock);
+
+	protocol_init(&svc_protocol);
+}
+
+void protocols_cleanup(void)
+{
+	int i;
+
+	pthread_mutex_lock(&protocol_lock);
+	for (i = 0; i <= UINT8_MAX; i++) {
+		if (!protocol_started[i])
+			continue;
+		if (protocols[i]->cleanup)
+			protocols[i]->cleanup();
+		protocol_started[i] = false;
+	}
+	pthread_mutex_unlock(&protocol_lock);
+}
@@ -23,8 +23,8 @@
 static int pwm_on[2];
 static pwm *pwms[2];
 
-int pwm_handler(uint16_t cport_id, uint16_t hd_cport_id, void *rbuf,
-		size_t rsize, void *tbuf, size_t tsize)
+static int pwm_handler(uint16_t cport_id, uint16_t hd_cport_id, void *rbuf,
+		       size_t rsize, void *tbuf, size_t tsize)
 {
 	struct gb_operation_msg_hdr *oph;
 	struct op_msg *op_req = rbuf;
@@ -106,33 +106,19 @@ int pwm_handler(uint16_t cport_id, uint16_t hd_cport_id, void *rbuf,
 	return send_response(op_rsp, hd_cport_id, message_size, oph, result);
 }
 
-char *pwm_get_operation(uint8_t type)
-{
-	switch (type) {
-	case GB_PWM_TYPE_INVALID:
-		return "GB_PWM_TYPE_INVALID";
-	case GB_PWM_TYPE_PROTOCOL_VERSION:
-		return "GB_PWM_TYPE_PROTOCOL_VERSION";
-	case GB_PWM_TYPE_PWM_COUNT:
-		return "GB_PWM_TYPE_PWM_COUNT";
-	case GB_PWM_TYPE_ACTIVATE:
-		return "GB_PWM_TYPE_ACTIVATE";
-	case GB_PWM_TYPE_DEACTIVATE:
-		return "GB_PWM_TYPE_DEACTIVATE";
-	case GB_PWM_TYPE_CONFIG:
-		return "GB_PWM_TYPE_CONFIG";
-	case GB_PWM_TYPE_POLARITY:
-		return "GB_PWM_TYPE_POLARITY";
-	case GB_PWM_TYPE_ENABLE:
-		return "GB_PWM_TYPE_ENABLE";
-	case GB_PWM_TYPE_DISABLE:
-		return "GB_PWM_TYPE_DISABLE";
-	default:
-		return "(Unknown operation)";
-	}
-}
+static const char * const pwm_operations[] = {
+	[GB_PWM_TYPE_INVALID] = "GB_PWM_TYPE_INVALID",
+	[GB_PWM_TYPE_PROTOCOL_VERSION] = "GB_PWM_TYPE_PROTOCOL_VERSION",
+	[GB_PWM_TYPE_PWM_COUNT] = "GB_PWM_TYPE_PWM_COUNT",
+	[GB_PWM_TYPE_ACTIVATE] = "GB_PWM_TYPE_ACTIVATE",
+	[GB_PWM_TYPE_DEACTIVATE] = "GB_PWM_TYPE_DEACTIVATE",
+	[GB_PWM_TYPE_CONFIG] = "GB_PWM_TYPE_CONFIG",
+	[GB_PWM_TYPE_POLARITY] = "GB_PWM_TYPE_POLARITY",
+	[GB_PWM_TYPE_ENABLE] = "GB_PWM_TYPE_ENABLE",
+	[GB_PWM_TYPE_DISABLE] = "GB_PWM_TYPE_DISABLE",
+};
 
-void pwm_init(void)
+static void pwm_init(void)
 {
 	if (bbb_backend) {
 		/* Grab PWM0A and PWM0B found on P9-31 and P9-29 */
@@ -140,3 +126,12 @@ void pwm_init(void)
 		pwms[1] = libsoc_pwm_request(0, 1, LS_GREEDY);
 	}
 }
+
+const struct gbsim_protocol pwm_protocol = {
+	.id		= GREYBUS_PROTOCOL_PWM,
+	.name		= "PWM",
+	.handler	= pwm_handler,
+	.operations	= pwm_operations,
+	.operation_count = ARRAY_SIZE(pwm_operations),
+	.init		= pwm_init,
+};
@@ -0,0 +1,285 @@
+/*
+ * Greybus Simulator: event loop
+ *
+ * Copyright 2015 Google Inc.
+ * Copyright 2015 Linaro Ltd.
+ *
+ * Provided under the three clause BSD license found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/queue.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "gbsim.h"
+
+/*
+ * The main thread runs a single epoll loop which every subsystem registers
+ * its file descriptors with: the functionfs control endpoint, the hotplug
+ * inotify descriptor, the UART ttys, a signalfd, and timerfds for anything
+ * that has to happen later. Nothing wakes up unless there is work to do.
+ *
+ * Handlers may be added and removed from any thread. A removed handler is
+ * only freed by the loop itself, between two calls to epoll_wait(), so an
+ * event already fetched for it is never delivered to freed memory.
+ */
+#define REACTOR_EVENTS_MAX	16
+
+struct reactor_handler {
+	TAILQ_ENTRY(reactor_handler) node;
+	int fd;
+	bool timer;
+	bool dead;
+	reactor_cb cb;
+	void *arg;
+};
+
+static TAILQ_HEAD(, reactor_handler) handlers =
+	TAILQ_HEAD_INITIALIZER(handlers);
+static TAILQ_HEAD(, reactor_handler) dead_handlers =
+	TAILQ_HEAD_INITIALIZER(dead_handlers);
+static pthread_mutex_t handlers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int epoll_fd = -1;
+static int stop_efd = -1;
+static bool stopping;
+static __thread bool reactor_self;
+
+static struct reactor_handler *reactor_find(int fd)
+{
+	struct reactor_handler *h;
+
+	TAILQ_FOREACH(h, &handlers, node)
+		if (h->fd == fd)
+			return h;
+
+	return NULL;
+}
+
+static int reactor_register(int fd, uint32_t events, bool timer,
+			    reactor_cb cb, void *arg)
+{
+	struct epoll_event ev;
+	struct reactor_handler *h;
+
+	h = calloc(1, sizeof(*h));
+	if (!h)
+		return -ENOMEM;
+	h->fd = fd;
+	h->timer = timer;
+	h->cb = cb;
+	h->arg = arg;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = h;
+
+	pthread_mutex_lock(&handlers_lock);
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		pthread_mutex_unlock(&handlers_lock);
+		gbsim_error("epoll add fd %d: %s\n", fd, strerror(errno));
+		free(h);
+		return -errno;
+	}
+	TAILQ_INSERT_TAIL(&handlers, h, node);
+	pthread_mutex_unlock(&handlers_lock);
+
+	return 0;
+}
+
+/* Call cb from the main loop whenever one of events is pending on fd */
+int reactor_add(int fd, uint32_t events, reactor_cb cb, void *arg)
+{
+	return reactor_register(fd, events, false, cb, arg);
+}
+
+/* Change the events fd is watched for; 0 stops watching it for now */
+int reactor_mod(int fd, uint32_t events)
+{
+	struct epoll_event ev;
+	struct reactor_handler *h;
+	int ret = 0;
+
+	pthread_mutex_lock(&handlers_lock);
+	h = reactor_find(fd);
+	if (h) {
+		memset(&ev, 0, sizeof(ev));
+		ev.events = events;
+		ev.data.ptr = h;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) < 0)
+			ret = -errno;
+	} else {
+		ret = -ENOENT;
+	}
+	pthread_mutex_unlock(&handlers_lock);
+
+	return ret;
+}
+
+/* Stop watching fd. The caller still owns, and closes, the descriptor. */
+void reactor_del(int fd)
+{
+	struct reactor_handler *h;
+
+	pthread_mutex_lock(&handlers_lock);
+	h = reactor_find(fd);
+	if (h) {
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+		h->dead = true;
+		TAILQ_REMOVE(&handlers, h, node);
+		TAILQ_INSERT_TAIL(&dead_handlers, h, node);
+	}
+	pthread_mutex_unlock(&handlers_lock);
+}
+
+/*
+ * Create a timer calling cb from the main loop. It starts disarmed; returns
+ * its descriptor, to be passed to reactor_timer_arm() and
+ * reactor_timer_del(), or a negative error.
+ */
+int reactor_timer_add(reactor_cb cb, void *arg)
+{
+	int tfd, ret;
+
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (tfd < 0) {
+		gbsim_error("timerfd_create: %s\n", strerror(errno));
+		return -errno;
+	}
+
+	ret = reactor_register(tfd, EPOLLIN, true, cb, arg);
+	if (ret < 0) {
+		close(tfd);
+		return ret;
+	}
+
+	return tfd;
+}
+
+/*
+ * Fire the timer in ns nanoseconds, and then every ns if periodic. An ns
+ * of 0 disarms it.
+ */
+int reactor_timer_arm(int tfd, uint64_t ns, bool periodic)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = ns / 1000000000;
+	its.it_value.tv_nsec = ns % 1000000000;
+	if (periodic)
+		its.it_interval = its.it_value;
+
+	if (timerfd_settime(tfd, 0, &its, NULL) < 0)
+		return -errno;
+
+	return 0;
+}
+
+void reactor_timer_del(int tfd)
+{
+	reactor_del(tfd);
+	close(tfd);
+}
+
+static void reactor_stop_cb(int fd, uint32_t events, void *arg)
+{
+	uint64_t count;
+
+	if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		gbsim_error("reactor stop read: %s\n", strerror(errno));
+	stopping = true;
+}
+
+/* Make reactor_run() return; may be called from any thread */
+void reactor_stop(void)
+{
+	uint64_t one = 1;
+
+	if (write(stop_efd, &one, sizeof(one)) != sizeof(one))
+		gbsim_error("reactor stop: %s\n", strerror(errno));
+}
+
+static void reactor_reap(void)
+{
+	struct reactor_handler *h;
+
+	pthread_mutex_lock(&handlers_lock);
+	while ((h = TAILQ_FIRST(&dead_handlers))) {
+		TAILQ_REMOVE(&dead_handlers, h, node);
+		free(h);
+	}
+	pthread_mutex_unlock(&handlers_lock);
+}
+
+int reactor_run(void)
+{
+	struct epoll_event events[REACTOR_EVENTS_MAX];
+	struct reactor_handler *h;
+	uint64_t expirations;
+	int i, n;
+
+	reactor_self = true;
+
+	while (!stopping) {
+		reactor_reap();
+
+		n = epoll_wait(epoll_fd, events, REACTOR_EVENTS_MAX, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			gbsim_error("epoll_wait: %s\n", strerror(errno));
+			return -errno;
+		}
+
+		for (i = 0; i < n; i++) {
+			h = events[i].data.ptr;
+			if (__atomic_load_n(&h->dead, __ATOMIC_ACQUIRE))
+				continue;
+			if (h->timer &&
+			    read(h->fd, &expirations, sizeof(expirations)) < 0)
+				continue;
+			h->cb(h->fd, events[i].events, h->arg);
+		}
+	}
+
+	return 0;
+}
+
+/* Whether the caller is running on the loop, and so must never block */
+bool reactor_current(void)
+{
+	return reactor_self;
+}
+
+int reactor_init(void)
+{
+	int ret;
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		gbsim_error("epoll_create1: %s\n", strerror(errno));
+		return -errno;
+	}
+
+	stop_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (stop_efd < 0) {
+		gbsim_error("reactor eventfd: %s\n", strerror(errno));
+		return -errno;
+	}
+
+	ret = reactor_add(stop_efd, EPOLLIN, reactor_stop_cb, NULL);
+	if (ret < 0)
+		return ret;
+
+	return 0;
+}
@@ -0,0 +1,545 @@
+/*
+ * Greybus Simulator: record and replay of AP traffic
+ *
+ * Copyright 2015 Google Inc.
+ * Copyright 2015 Linaro Ltd.
+ *
+ * Provided under the three clause BSD license found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gbsim.h"
+
+/*
+ * With -o, every message from the AP is recorded as it is framed, in the
+ * order it arrived, with its arrival time: a small header, then the
+ * message as read. With -O, a recording is replayed to gbsim by an
+ * in-process AP stand-in instead of a USB gadget, and everything gbsim
+ * sends is taken in by it rather than written anywhere.
+ *
+ * The replay keeps the order the session had: a response from the AP is
+ * only given once gbsim has sent the request it answers, with the
+ * operation id gbsim gave that request rather than the recorded one, as
+ * the two need not match when gbsim's own requests come in another order
+ * or number than they did when recording. A message for a
+ * CPort that does not exist yet waits until all earlier requests have
+ * been answered (so a hotplug can complete first), and no more than
+ * REPLAY_WINDOW requests are in flight. Beyond that it runs as fast as
+ * gbsim answers, or with -t at the pace they were recorded at.
+ *
+ * Each CPort's responses are hashed in the order they are sent, and the
+ * hashes are combined in CPort order, so that the checksum reported at
+ * the end does not depend on how the workers interleaved: two builds that
+ * report different checksums for a recording answered differently.
+ */
+#define REPLAY_MAGIC		"GBREC001"
+#define REPLAY_WINDOW		32
+#define REPLAY_WAIT_MS		1000
+
+#define FNV_OFFSET		0xcbf29ce484222325ULL
+#define FNV_PRIME		0x100000001b3ULL
+
+struct replay_rec {
+	uint64_t ns;		/* since recording started */
+	uint16_t hd_cport_id;
+	uint16_t size;
+} __attribute__((packed));
+
+/* A request gbsim sent, waiting for the recorded response to it */
+struct replay_pending {
+	uint16_t id;
+	uint8_t type;
+	__le16 operation_id;
+};
+
+/* Recording */
+static FILE *record_file;
+static struct timespec record_start;
+static pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Replay */
+static char *replay_data;
+static size_t replay_size;
+static pthread_t replay_pthread;
+static bool replay_started;
+static bool replay_done;
+static pthread_mutex_t replay_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t replay_cond;
+
+/* Requests gbsim sent that have not been answered yet, oldest first */
+static struct replay_pending *replay_pending;
+static size_t replay_pending_count;
+static size_t replay_pending_size;
+/* Requests given to gbsim, responses it sent, and those still to come */
+static unsigned long replay_requests_in;
+static unsigned long replay_answered;
+static unsigned long replay_in_flight;
+static uint64_t replay_hash[GBSIM_BRIDGE_CPORTS];
+static bool replay_hashed[GBSIM_BRIDGE_CPORTS];
+
+static uint64_t fnv1a(uint64_t hash, const void *buf, size_t size)
+{
+	const unsigned char *p = buf;
+
+	while (size--) {
+		hash ^= *p++;
+		hash *= FNV_PRIME;
+	}
+
+	return hash;
+}
+
+static uint64_t timespec_ns(const struct timespec *ts)
+{
+	return ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+/*
+ * Record a message from the AP, as framed. The receive threads are
+ * cancelled when the function is disabled, and fwrite() may be where that
+ * happens: the write is not cancellable, so record_lock and the message
+ * being framed are never left behind.
+ */
+void record_msg(uint16_t hd_cport_id, const void *buf, uint16_t size)
+{
+	struct replay_rec rec;
+	struct timespec now;
+	int state;
+
+	if (!record_file)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	rec.ns = timespec_ns(&now) - timespec_ns(&record_start);
+	rec.hd_cport_id = hd_cport_id;
+	rec.size = size;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+	pthread_mutex_lock(&record_lock);
+	fwrite(&rec, sizeof(rec), 1, record_file);
+	fwrite(buf, size, 1, record_file);
+	pthread_mutex_unlock(&record_lock);
+	pthread_setcancelstate(state, NULL);
+}
+
+int record_init(void)
+{
+	if (!record_path)
+		return 0;
+
+	record_file = fopen(record_path, "w");
+	if (!record_file) {
+		gbsim_error("can't open recording %s: %s\n", record_path,
+			    strerror(errno));
+		return -errno;
+	}
+
+	fwrite(REPLAY_MAGIC, strlen(REPLAY_MAGIC), 1, record_file);
+	clock_gettime(CLOCK_MONOTONIC, &record_start);
+
+	return 0;
+}
+
+void record_cleanup(void)
+{
+	if (!record_file)
+		return;
+
+	pthread_mutex_lock(&record_lock);
+	fclose(record_file);
+	record_file = NULL;
+	pthread_mutex_unlock(&record_lock);
+}
+
+/* The whole recording is read in, so replaying it does no I/O */
+static int replay_init(void)
+{
+	struct replay_rec rec;
+	pthread_condattr_t attr;
+	size_t off;
+	long size;
+	FILE *f;
+
+	f = fopen(replay_path, "r");
+	if (!f) {
+		gbsim_error("can't open recording %s: %s\n", replay_path,
+			    strerror(errno));
+		return -errno;
+	}
+
+	if (fseek(f, 0, SEEK_END) < 0 || (size = ftell(f)) < 0 ||
+	    fseek(f, 0, SEEK_SET) < 0) {
+		gbsim_error("can't size recording %s: %s\n", replay_path,
+			    strerror(errno));
+		fclose(f);
+		return -errno;
+	}
+
+	replay_size = size;
+	replay_data = malloc(replay_size ? replay_size : 1);
+	if (!replay_data) {
+		fclose(f);
+		return -ENOMEM;
+	}
+
+	if (fread(replay_data, 1, replay_size, f) != replay_size) {
+		gbsim_error("can't read recording %s\n", replay_path);
+		fclose(f);
+		return -EIO;
+	}
+	fclose(f);
+
+	if (replay_size < strlen(REPLAY_MAGIC) ||
+	    memcmp(replay_data, REPLAY_MAGIC, strlen(REPLAY_MAGIC))) {
+		gbsim_error("%s is not a gbsim recording\n", replay_path);
+		return -EINVAL;
+	}
+
+	/* Check the framing once, so the replay can trust it */
+	for (off = strlen(REPLAY_MAGIC); off < replay_size;
+	     off += sizeof(rec) + rec.size) {
+		if (replay_size - off < sizeof(rec))
+			break;
+		memcpy(&rec, replay_data + off, sizeof(rec));
+		if (rec.size < sizeof(struct gb_operation_msg_hdr) ||
+		    rec.size > msg_size_max ||
+		    replay_size - off - sizeof(rec) < rec.size)
+			break;
+	}
+	if (off != replay_size) {
+		gbsim_error("recording %s is corrupt at offset %zu\n",
+			    replay_path, off);
+		return -EINVAL;
+	}
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&replay_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	return 0;
+}
+
+/* The oldest request of this type unanswered on a CPort; replay_lock held */
+static struct replay_pending *replay_pending_find(uint16_t id, uint8_t type)
+{
+	size_t i;
+
+	for (i = 0; i < replay_pending_count; i++)
+		if (replay_pending[i].id == id && replay_pending[i].type == type)
+			return &replay_pending[i];
+
+	return NULL;
+}
+
+/* Whether the replay may go on; replay_lock held */
+static bool replay_ready(uint16_t id, uint8_t type, bool *known)
+{
+	bool exists;
+
+	if (type & OP_RESPONSE)
+		return replay_pending_find(id, type & ~OP_RESPONSE) != NULL;
+
+	if (replay_in_flight >= REPLAY_WINDOW)
+		return false;
+
+	if (*known)
+		return true;
+
+	cport_read_lock();
+	exists = cport_find(bridge_cport_id(&bridges[0], id)) != NULL;
+	cport_read_unlock();
+
+	/* Give a hotplug in progress the chance to create the CPort */
+	if (exists || !replay_in_flight)
+		*known = true;
+
+	return *known;
+}
+
+static void replay_unlock(void *arg)
+{
+	pthread_mutex_unlock(&replay_lock);
+}
+
+/*
+ * Wait until the next message can be given to gbsim, and give a response
+ * the operation id of the request it answers. Waiting too long means gbsim
+ * no longer behaves as it did when recording; the message is given
+ * anyway, as recorded, and requests still unanswered are no longer waited
+ * for.
+ */
+static void replay_wait(uint16_t id, struct gb_operation_msg_hdr *hdr)
+{
+	struct replay_pending *p;
+	struct timespec deadline;
+	bool known = false;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += REPLAY_WAIT_MS / 1000;
+
+	pthread_mutex_lock(&replay_lock);
+	pthread_cleanup_push(replay_unlock, NULL);
+	while (!replay_ready(id, hdr->type, &known)) {
+		if (pthread_cond_timedwait(&replay_cond, &replay_lock,
+					   &deadline) == ETIMEDOUT) {
+			gbsim_error("replay: gave up waiting for gbsim on CPort %hu\n",
+				    id);
+			replay_in_flight = 0;
+			break;
+		}
+	}
+
+	if (hdr->type & OP_RESPONSE) {
+		p = replay_pending_find(id, hdr->type & ~OP_RESPONSE);
+		if (p) {
+			hdr->operation_id = p->operation_id;
+			replay_pending_count--;
+			memmove(p, p + 1, (replay_pending + replay_pending_count -
+					   p) * sizeof(*p));
+		}
+	} else {
+		replay_requests_in++;
+		replay_in_flight++;
+	}
+	pthread_cleanup_pop(1);
+}
+
+/* Wait for the last responses, then report */
+static void replay_report(unsigned long messages, struct timespec *start)
+{
+	struct timespec deadline, end;
+	uint64_t checksum = FNV_OFFSET;
+	unsigned long responses = 0;
+	double secs;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += REPLAY_WAIT_MS / 1000;
+
+	pthread_mutex_lock(&replay_lock);
+	pthread_cleanup_push(replay_unlock, NULL);
+	while (replay_in_flight)
+		if (pthread_cond_timedwait(&replay_cond, &replay_lock,
+					   &deadline) == ETIMEDOUT)
+			break;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	for (i = 0; i < GBSIM_BRIDGE_CPORTS; i++) {
+		if (!replay_hashed[i])
+			continue;
+		checksum = fnv1a(checksum, &i, sizeof(i));
+		checksum = fnv1a(checksum, &replay_hash[i],
+				 sizeof(replay_hash[i]));
+	}
+	responses = replay_answered;
+	pthread_cleanup_pop(1);
+
+	secs = (end.tv_sec - start->tv_sec) +
+	       (end.tv_nsec - start->tv_nsec) / 1e9;
+	gbsim_event(GBSIM_LOG_INFO, "replay",
+		    "messages=%lu secs=%.3f messages_per_sec=%.0f requests=%lu answered=%lu checksum=%016llx",
+		    messages, secs, messages / secs, replay_requests_in,
+		    responses, (unsigned long long)checksum);
+}
+
+static void *replay_thread(void *param)
+{
+	struct gbsim_framer *f = param;
+	struct gb_operation_msg_hdr *hdr;
+	struct timespec start, at, now;
+	struct replay_rec rec;
+	unsigned long messages = 0, skipped = 0;
+	uint64_t first_ns = 0;
+	uint16_t id;
+	size_t off;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (off = strlen(REPLAY_MAGIC); off < replay_size;
+	     off += sizeof(rec) + rec.size) {
+		memcpy(&rec, replay_data + off, sizeof(rec));
+
+		/* Only one bridge is replayed to */
+		if (cport_bridge(rec.hd_cport_id) != &bridges[0]) {
+			skipped++;
+			continue;
+		}
+		id = cport_wire_id(rec.hd_cport_id);
+		hdr = (struct gb_operation_msg_hdr *)(replay_data + off +
+						      sizeof(rec));
+
+		if (replay_paced) {
+			if (!messages)
+				first_ns = rec.ns;
+			at = start;
+			at.tv_sec += (rec.ns - first_ns) / 1000000000;
+			at.tv_nsec += (rec.ns - first_ns) % 1000000000;
+			if (at.tv_nsec >= 1000000000) {
+				at.tv_sec++;
+				at.tv_nsec -= 1000000000;
+			}
+
+			/* Behind the recording, catch up without sleeping */
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (timespec_ns(&now) < timespec_ns(&at))
+				while (clock_nanosleep(CLOCK_MONOTONIC,
+						       TIMER_ABSTIME, &at,
+						       NULL) == EINTR)
+					;
+		}
+
+		memcpy(f->buf, hdr, rec.size);
+		hdr = (struct gb_operation_msg_hdr *)f->buf;
+		hdr->pad[0] = id & 0xff;
+		hdr->pad[1] = (id >> 8) & 0xff;
+
+		replay_wait(id, hdr);
+		rx_frame(f, rec.size);
+		messages++;
+	}
+
+	if (skipped)
+		gbsim_info("replay: skipped %lu messages of other bridges\n",
+			   skipped);
+
+	replay_report(messages, &start);
+
+	__atomic_store_n(&replay_done, true, __ATOMIC_RELEASE);
+	reactor_stop();
+
+	return NULL;
+}
+
+static int replay_loop(void)
+{
+	struct gbsim_framer f = {
+		.bridge = &bridges[0],
+		.len = 0,
+		.size = rx_size,
+	};
+	int ret;
+
+	f.buf = buf_alloc(f.size);
+	if (!f.buf)
+		return -ENOMEM;
+
+	ret = pthread_create(&replay_pthread, NULL, replay_thread, &f);
+	if (ret) {
+		gbsim_error("can't create replay thread\n");
+		free(f.buf);
+		return -ret;
+	}
+	replay_started = true;
+
+	/* Start communication with the AP, as on USB enumeration */
+	ret = svc_request_send(&bridges[0], GB_SVC_TYPE_PROTOCOL_VERSION,
+			       AP_INTF_ID);
+	if (ret)
+		gbsim_error("Failed to send svc version request (%d)\n", ret);
+
+	ret = reactor_run();
+
+	/* Stopped by a signal, the replay is cut short */
+	if (replay_started) {
+		if (!__atomic_load_n(&replay_done, __ATOMIC_ACQUIRE))
+			pthread_cancel(replay_pthread);
+		pthread_join(replay_pthread, NULL);
+		replay_started = false;
+	}
+	free(f.buf);
+
+	return ret;
+}
+
+/* Note a request gbsim sent, for the response to it; replay_lock held */
+static void replay_pending_add(uint16_t id, struct gb_operation_msg_hdr *hdr)
+{
+	struct replay_pending *p;
+	size_t size;
+
+	/* Operation id 0 asks for no response */
+	if (!hdr->operation_id)
+		return;
+
+	if (replay_pending_count == replay_pending_size) {
+		size = replay_pending_size ? replay_pending_size * 2 : 64;
+		p = realloc(replay_pending, size * sizeof(*p));
+		if (!p) {
+			gbsim_error("replay: can't track request on CPort %hu\n",
+				    id);
+			return;
+		}
+		replay_pending = p;
+		replay_pending_size = size;
+	}
+
+	p = &replay_pending[replay_pending_count++];
+	p->id = id;
+	p->type = hdr->type;
+	p->operation_id = hdr->operation_id;
+}
+
+/* What gbsim sends only goes as far as the checksum */
+static void replay_send(struct gbsim_txbuf **batch, int count)
+{
+	struct gb_operation_msg_hdr *hdr;
+	uint16_t id;
+	int i;
+
+	pthread_mutex_lock(&replay_lock);
+	for (i = 0; i < count; i++) {
+		hdr = (struct gb_operation_msg_hdr *)batch[i]->buf;
+		id = cport_wire_id(batch[i]->hd_cport_id);
+
+		if (hdr->type & OP_RESPONSE) {
+			if (!replay_hashed[id]) {
+				replay_hash[id] = FNV_OFFSET;
+				replay_hashed[id] = true;
+			}
+			replay_hash[id] = fnv1a(replay_hash[id], batch[i]->buf,
+						batch[i]->size);
+			replay_answered++;
+			if (replay_in_flight)
+				replay_in_flight--;
+		} else {
+			replay_pending_add(id, hdr);
+		}
+	}
+	pthread_cond_broadcast(&replay_cond);
+	pthread_mutex_unlock(&replay_lock);
+
+	for (i = 0; i < count; i++)
+		txbuf_release(batch[i]);
+}
+
+static void replay_cleanup(void)
+{
+	if (replay_started) {
+		pthread_cancel(replay_pthread);
+		pthread_join(replay_pthread, NULL);
+		replay_started = false;
+	}
+
+	free(replay_data);
+	replay_data = NULL;
+	free(replay_pending);
+	replay_pending = NULL;
+	replay_pending_count = replay_pending_size = 0;
+}
+
+const struct gbsim_transport replay_transport = {
+	.name		= "replay",
+	.init		= replay_init,
+	.loop		= replay_loop,
+	.send		= replay_send,
+	.cleanup	= replay_cleanup,
+};
@@ -9,6 +9,7 @@
 
 #include <fcntl.h>
 #include <linux/fs.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <string.h>
 #include <stdio.h>
@@ -65,6 +66,9 @@ struct sd_card {
 
 static struct sd_card *sd;
 
+/* The card is shared by all SDIO CPorts, which may be handled concurrently */
+static pthread_mutex_t sd_lock = PTHREAD_MUTEX_INITIALIZER;
+
 #define CLEAR_CONDITION_A	0x02004100 /* According current state */
 #define CLEAR_CONDITION_B	0x00c01e00 /* related to previous command */
 #define CLEAR_CONDITION_C	0xfd39a028 /* clear by read */
@@ -578,7 +582,7 @@ static ssize_t sdio_send_card_event(struct op_msg *op_req, uint16_t hd_cport_id,
 
 	op_req->sdio_event_req.event = event;
 
-	return send_request(op_req, hd_cport_id, message_size, 0,
+	return send_request(op_req, hd_cport_id, message_size,
 			GB_SDIO_TYPE_EVENT);
 }
 
@@ -600,6 +604,7 @@ static ssize_t sdio_transfer_rsp(struct op_msg *op_rsp, uint16_t hd_cport_id,
 	if (!sd->xfer || sd->card_status & R1_ILLEGAL_COMMAND) {
 		sd->card_status &= ~R1_ILLEGAL_COMMAND;
 		sd->state = R1_STATE_TRAN;
+		payload_size = sizeof(struct gb_sdio_transfer_response);
 		op_rsp->sdio_xfer_rsp.data_blocks = 0;
 		op_rsp->sdio_xfer_rsp.data_blksz = 0;
 		goto send;
@@ -633,8 +638,8 @@ static ssize_t sdio_command_rsp(struct op_msg *op_rsp, uint16_t hd_cport_id,
 			     PROTOCOL_STATUS_SUCCESS);
 }
 
-int sdio_handler(uint16_t cport_id, uint16_t hd_cport_id, void *rbuf,
-		 size_t rsize, void *tbuf, size_t tsize)
+static int sdio_handler(uint16_t cport_id, uint16_t hd_cport_id, void *rbuf,
+			size_t rsize, void *tbuf, size_t tsize)
 {
 	struct gb_operation_msg_hdr *oph;
 	struct op_msg *op_req = rbuf;
@@ -675,17 +680,20 @@ int sdio_handler(uint16_t cport_id, uint16_t hd_cport_id, void *rbuf,
 			    module_id, cport_id);
 		break;
 	case GB_SDIO_TYPE_COMMAND:
+		pthread_mutex_lock(&sd_lock);
 		sd_process_cmd(op_req->sdio_cmd_req.cmd,
 			       op_req->sdio_cmd_req.cmd_flags,
 			       op_req->sdio_cmd_req.cmd_type,
 			       le32toh(op_req->sdio_cmd_req.cmd_arg));
 
 		sdio_command_rsp(op_rsp, hd_cport_id, oph);
+		pthread_mutex_unlock(&sd_lock);
 		return 0;
 	case GB_SDIO_TYPE_TRANSFER:
 		data_blocks = le16toh(op_req->sdio_xfer_req.data_blocks);
 		data_blksz = le16toh(op_req->sdio_xfer_req.data_blksz);
 		data = &op_req->sdio_xfer_req.data[0];
+		pthread_mutex_lock(&sd_lock);
 		if (op_req->sdio_xfer_req.data_flags & GB_SDIO_DATA_READ)
 			sd_transfer_read(data_blocks, data_blksz);
 		else
@@ -693,6 +701,7 @@ int sdio_handler(uint16_t cport_id, uint16_t hd_cport_id, void *rbuf,
 
 		sdio_transfer_rsp(op_rsp, hd_cport_id, oph, data_blocks,
 				  data_blksz, data);
+		pthread_mutex_unlock(&sd_lock);
 		return 0;
 	default:
 		gbsim_error("sdio operation type %02x not supported\n",
@@ -710,29 +719,26 @@ int sdio_handler(uint16_t cport_id, uint16_t hd_cport_id, void *rbuf,
 	return 0;
 }
 
-char *sdio_get_operation(uint8_t type)
-{
-	switch (type) {
-	case GB_SDIO_TYPE_INVALID:
-		return "GB_SDIO_TYPE_INVALID";
-	case GB_SDIO_TYPE_PROTOCOL_VERSION:
-		return "GB_SDIO_TYPE_PROTOCOL_VERSION";
-	case GB_SDIO_TYPE_GET_CAPABILITIES:
-		return "GB_SDIO_TYPE_GET_CAPABILITIES";
-	case GB_SDIO_TYPE_SET_IOS:
-		return "GB_SDIO_TYPE_SET_IOS";
-	case GB_SDIO_TYPE_COMMAND:
-		return "GB_SDIO_TYPE_COMMAND";
-	case GB_SDIO_TYPE_TRANSFER:
-		return "GB_SDIO_TYPE_TRANSFER";
-	case GB_SDIO_TYPE_EVENT:
-		return "GB_SDIO_TYPE_EVENT";
-	default:
-		return "(Unknown operation)";
-	}
-}
+static const char * const sdio_operations[] = {
+	[GB_SDIO_TYPE_INVALID] = "GB_SDIO_TYPE_INVALID",
+	[GB_SDIO_TYPE_PROTOCOL_VERSION] = "GB_SDIO_TYPE_PROTOCOL_VERSION",
+	[GB_SDIO_TYPE_GET_CAPABILITIES] = "GB_SDIO_TYPE_GET_CAPABILITIES",
+	[GB_SDIO_TYPE_SET_IOS] = "GB_SDIO_TYPE_SET_IOS",
+	[GB_SDIO_TYPE_COMMAND] = "GB_SDIO_TYPE_COMMAND",
+	[GB_SDIO_TYPE_TRANSFER] = "GB_SDIO_TYPE_TRANSFER",
+	[GB_SDIO_TYPE_EVENT] = "GB_SDIO_TYPE_EVENT",
+};
 
-void sdio_init(void)
+static void sdio_init(void)
 {
 	sd_init();
 }
+
+const struct gbsim_protocol sdio_protocol = {
+	.id		= GREYBUS_PROTOCOL_SDIO,
+	.name		= "SDIO",
+	.handler	= sdio_handler,
+	.operations	= sdio_operations,
+	.operation_count = ARRAY_SIZE(sdio_operations),
+	.init		= sdio_init,
+};
@@ -0,0 +1,438 @@
+/*
+ * Greybus Simulator: shared-memory ring transport
+ *
+ * Copyright 2015 Google Inc.
+ * Copyright 2015 Linaro Ltd.
+ *
+ * Provided under the three clause BSD license found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/memfd.h>
+
+#include "gbsim.h"
+
+/*
+ * Two single-producer, single-consumer byte rings in one memfd mapping,
+ * backed by huge pages when available: one carries messages to the AP,
+ * the other messages from it, with the same framing as the CPort bulk
+ * endpoints (hd_cport_id in the header pad bytes). Each ring has an
+ * eventfd doorbell, rung only when the ring goes from empty to non-empty,
+ * and another rung only when a producer is waiting for space, so a busy
+ * ring costs no system call per message.
+ *
+ * The AP end is an in-process stand-in which keeps SHM_BENCH_WINDOW SVC
+ * requests in flight until shm_requests have been answered, acks every
+ * request gbsim sends it, and reports the throughput. Since no USB stack
+ * is involved, this measures the cost of dispatch and the handlers alone.
+ */
+#define SHM_RING_SIZE		(1024 * 1024)
+#define SHM_HUGE_SIZE		(2 * 1024 * 1024)
+#define SHM_BENCH_WINDOW	32
+
+struct shm_ring {
+	uint64_t head __attribute__((aligned(64)));
+	uint64_t tail __attribute__((aligned(64)));
+	uint32_t producer_waiting __attribute__((aligned(64)));
+	char data[SHM_RING_SIZE] __attribute__((aligned(64)));
+};
+
+struct shm_area {
+	struct shm_ring to_ap;
+	struct shm_ring from_ap;
+};
+
+struct shm_chan {
+	struct shm_ring *ring;
+	int data_efd;
+	int space_efd;
+};
+
+static struct shm_area *area;
+static size_t area_size;
+static int shm_fd = -1;
+static struct shm_chan to_ap_chan = { .data_efd = -1, .space_efd = -1 };
+static struct shm_chan from_ap_chan = { .data_efd = -1, .space_efd = -1 };
+static pthread_t ap_pthread;
+static pthread_t rx_pthread;
+static bool ap_started;
+static bool rx_started;
+static bool shm_done;
+
+static inline int shm_memfd_create(const char *name, unsigned int flags)
+{
+	return syscall(__NR_memfd_create, name, flags);
+}
+
+static void doorbell_ring(int efd)
+{
+	uint64_t one = 1;
+
+	if (write(efd, &one, sizeof(one)) != sizeof(one))
+		gbsim_error("doorbell write: %s\n", strerror(errno));
+}
+
+static void doorbell_wait(int efd)
+{
+	uint64_t count;
+
+	if (read(efd, &count, sizeof(count)) < 0 && errno != EINTR)
+		gbsim_error("doorbell read: %s\n", strerror(errno));
+}
+
+/* Copy a whole message into the ring, waiting for space if need be */
+static void shm_write(struct shm_chan *c, const void *buf, size_t len)
+{
+	struct shm_ring *r = c->ring;
+	uint64_t head = r->head;
+	size_t off, first;
+
+	while (SHM_RING_SIZE - (head - __atomic_load_n(&r->tail,
+						       __ATOMIC_ACQUIRE)) < len) {
+		__atomic_store_n(&r->producer_waiting, 1, __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (SHM_RING_SIZE - (head - __atomic_load_n(&r->tail,
+							    __ATOMIC_ACQUIRE)) >= len)
+			break;
+		doorbell_wait(c->space_efd);
+	}
+	__atomic_store_n(&r->producer_waiting, 0, __ATOMIC_RELAXED);
+
+	off = head % SHM_RING_SIZE;
+	first = SHM_RING_SIZE - off < len ? SHM_RING_SIZE - off : len;
+	memcpy(r->data + off, buf, first);
+	memcpy(r->data, (const char *)buf + first, len - first);
+
+	__atomic_store_n(&r->head, head + len, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	/* Only an empty ring may have a consumer waiting for the doorbell */
+	if (__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == head)
+		doorbell_ring(c->data_efd);
+}
+
+/*
+ * Copy up to len bytes out of the ring, waiting for the doorbell while it
+ * is empty. Returns 0 only if done was set while waiting.
+ */
+static size_t shm_read(struct shm_chan *c, void *buf, size_t len,
+		       bool *done)
+{
+	struct shm_ring *r = c->ring;
+	uint64_t tail = r->tail, head;
+	size_t off, first;
+
+	while (1) {
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		if (head != tail)
+			break;
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) != tail)
+			continue;
+		if (__atomic_load_n(done, __ATOMIC_ACQUIRE))
+			return 0;
+		doorbell_wait(c->data_efd);
+	}
+
+	if (head - tail < len)
+		len = head - tail;
+
+	off = tail % SHM_RING_SIZE;
+	first = SHM_RING_SIZE - off < len ? SHM_RING_SIZE - off : len;
+	memcpy(buf, r->data + off, first);
+	memcpy((char *)buf + first, r->data, len - first);
+
+	__atomic_store_n(&r->tail, tail + len, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&r->producer_waiting, __ATOMIC_ACQUIRE))
+		doorbell_ring(c->space_efd);
+
+	return len;
+}
+
+static void ap_send_request(uint16_t id)
+{
+	struct op_msg msg;
+	uint16_t size = sizeof(msg.header) +
+			sizeof(msg.svc_intf_device_id_request);
+
+	memset(&msg, 0, size);
+	msg.header.size = htole16(size);
+	msg.header.operation_id = htole16(id);
+	msg.header.type = GB_SVC_TYPE_INTF_DEVICE_ID;
+	msg.header.pad[0] = GB_SVC_CPORT_ID & 0xff;
+	msg.header.pad[1] = (GB_SVC_CPORT_ID >> 8) & 0xff;
+	msg.svc_intf_device_id_request.intf_id = AP_INTF_ID;
+	msg.svc_intf_device_id_request.device_id = 1;
+
+	shm_write(&from_ap_chan, &msg, size);
+}
+
+/* Acknowledge a request from gbsim with an empty successful response */
+static void ap_send_ack(struct gb_operation_msg_hdr *req)
+{
+	struct gb_operation_msg_hdr rsp = *req;
+
+	rsp.size = htole16(sizeof(rsp));
+	rsp.type |= OP_RESPONSE;
+	rsp.result = 0;
+
+	shm_write(&from_ap_chan, &rsp, sizeof(rsp));
+}
+
+static void *shm_ap_thread(void *param)
+{
+	struct gbsim_framer f = { .len = 0, .size = rx_size };
+	struct gb_operation_msg_hdr *hdr;
+	struct timespec start, end;
+	unsigned long sent = 0, answered = 0;
+	bool never = false;
+	uint16_t msize;
+	size_t off;
+	double secs;
+
+	f.buf = malloc(f.size);
+	if (!f.buf) {
+		gbsim_error("failed to allocate AP receive buffer\n");
+		return NULL;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (; sent < shm_requests && sent < SHM_BENCH_WINDOW; sent++)
+		ap_send_request(sent % UINT16_MAX + 1);
+
+	while (answered < shm_requests) {
+		f.len += shm_read(&to_ap_chan, f.buf + f.len, f.size - f.len,
+				  &never);
+
+		for (off = 0; f.len - off >= sizeof(*hdr); off += msize) {
+			hdr = (struct gb_operation_msg_hdr *)(f.buf + off);
+			msize = le16toh(hdr->size);
+			if (msize < sizeof(*hdr)) {
+				gbsim_error("AP: bad message size %hu\n", msize);
+				off = f.len;
+				break;
+			}
+			if (f.len - off < msize)
+				break;
+
+			if (!(hdr->type & OP_RESPONSE)) {
+				ap_send_ack(hdr);
+				continue;
+			}
+
+			if (hdr->type != (OP_RESPONSE | GB_SVC_TYPE_INTF_DEVICE_ID))
+				continue;
+
+			answered++;
+			if (sent < shm_requests) {
+				ap_send_request(sent % UINT16_MAX + 1);
+				sent++;
+			}
+		}
+
+		f.len -= off;
+		memmove(f.buf, f.buf + off, f.len);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	gbsim_event(GBSIM_LOG_INFO, "bench",
+		    "operations=%lu secs=%.3f ops_per_sec=%.0f us_per_op=%.2f",
+		    answered, secs, answered / secs, secs * 1e6 / answered);
+
+	free(f.buf);
+
+	/* Let the receive thread and the main loop return */
+	__atomic_store_n(&shm_done, true, __ATOMIC_RELEASE);
+	doorbell_ring(from_ap_chan.data_efd);
+	reactor_stop();
+
+	return NULL;
+}
+
+static int shm_map(void)
+{
+	/* Huge pages if the system has some to spare, else normal pages */
+	area_size = (sizeof(*area) + SHM_HUGE_SIZE - 1) & ~(SHM_HUGE_SIZE - 1);
+	shm_fd = shm_memfd_create("gbsim-shm", MFD_CLOEXEC | MFD_HUGETLB);
+	if (shm_fd >= 0 && ftruncate(shm_fd, area_size) == 0) {
+		area = mmap(NULL, area_size, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, shm_fd, 0);
+		if (area != MAP_FAILED)
+			return 0;
+	}
+	if (shm_fd >= 0)
+		close(shm_fd);
+
+	area_size = sizeof(*area);
+	shm_fd = shm_memfd_create("gbsim-shm", MFD_CLOEXEC);
+	if (shm_fd < 0) {
+		gbsim_error("memfd_create: %s\n", strerror(errno));
+		return -errno;
+	}
+	if (ftruncate(shm_fd, area_size) < 0) {
+		gbsim_error("ftruncate: %s\n", strerror(errno));
+		return -errno;
+	}
+	area = mmap(NULL, area_size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, shm_fd, 0);
+	if (area == MAP_FAILED) {
+		area = NULL;
+		gbsim_error("mmap: %s\n", strerror(errno));
+		return -errno;
+	}
+
+	return 0;
+}
+
+static int shm_init(void)
+{
+	int ret;
+
+	ret = shm_map();
+	if (ret < 0)
+		return ret;
+
+	to_ap_chan.ring = &area->to_ap;
+	from_ap_chan.ring = &area->from_ap;
+
+	to_ap_chan.data_efd = eventfd(0, EFD_CLOEXEC);
+	to_ap_chan.space_efd = eventfd(0, EFD_CLOEXEC);
+	from_ap_chan.data_efd = eventfd(0, EFD_CLOEXEC);
+	from_ap_chan.space_efd = eventfd(0, EFD_CLOEXEC);
+	if (to_ap_chan.data_efd < 0 || to_ap_chan.space_efd < 0 ||
+	    from_ap_chan.data_efd < 0 || from_ap_chan.space_efd < 0) {
+		gbsim_error("shm eventfd: %s\n", strerror(errno));
+		return -errno;
+	}
+
+	gbsim_debug("shared-memory rings of %d bytes in a %zu byte mapping\n",
+		    SHM_RING_SIZE, area_size);
+
+	return 0;
+}
+
+static void *shm_rx_thread(void *param)
+{
+	struct gbsim_framer *f = param;
+	size_t nbytes;
+
+	while ((nbytes = shm_read(&from_ap_chan, f->buf + f->len,
+				  f->size - f->len, &shm_done)))
+		rx_frame(f, nbytes);
+
+	return NULL;
+}
+
+/*
+ * The rings are drained by threads of their own, so that the main loop
+ * stays free for signals and hotplug events until the benchmark is over.
+ */
+static int shm_loop(void)
+{
+	struct gbsim_framer f = {
+		.bridge = &bridges[0],
+		.len = 0,
+		.size = rx_size,
+	};
+	int ret;
+
+	f.buf = buf_alloc(f.size);
+	if (!f.buf)
+		return -ENOMEM;
+
+	ret = pthread_create(&rx_pthread, NULL, shm_rx_thread, &f);
+	if (ret) {
+		gbsim_error("can't create shm receive thread\n");
+		free(f.buf);
+		return -ret;
+	}
+	rx_started = true;
+
+	ret = pthread_create(&ap_pthread, NULL, shm_ap_thread, NULL);
+	if (ret) {
+		gbsim_error("can't create AP thread\n");
+		ret = -ret;
+		goto out;
+	}
+	ap_started = true;
+
+	/* Start communication with the AP, as on USB enumeration */
+	ret = svc_request_send(&bridges[0], GB_SVC_TYPE_PROTOCOL_VERSION,
+			       AP_INTF_ID);
+	if (ret)
+		gbsim_error("Failed to send svc version request (%d)\n", ret);
+
+	ret = reactor_run();
+
+	if (ap_started) {
+		pthread_join(ap_pthread, NULL);
+		ap_started = false;
+	}
+out:
+	/* Have the receive thread finish, before shm_cleanup() runs */
+	if (rx_started) {
+		__atomic_store_n(&shm_done, true, __ATOMIC_RELEASE);
+		doorbell_ring(from_ap_chan.data_efd);
+		pthread_join(rx_pthread, NULL);
+		rx_started = false;
+	}
+	free(f.buf);
+
+	return ret;
+}
+
+/* Once the AP stand-in is done, nothing would make room in its ring */
+static void shm_send(struct gbsim_txbuf **batch, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (!__atomic_load_n(&shm_done, __ATOMIC_ACQUIRE))
+			shm_write(&to_ap_chan, batch[i]->buf, batch[i]->size);
+		txbuf_release(batch[i]);
+	}
+}
+
+/* The mapping stays in place until gbsim exits */
+static void shm_cleanup(void)
+{
+	if (ap_started) {
+		pthread_cancel(ap_pthread);
+		pthread_join(ap_pthread, NULL);
+		ap_started = false;
+	}
+
+	if (rx_started) {
+		pthread_cancel(rx_pthread);
+		pthread_join(rx_pthread, NULL);
+		rx_started = false;
+	}
+
+	if (shm_fd >= 0) {
+		close(shm_fd);
+		shm_fd = -1;
+	}
+}
+
+const struct gbsim_transport shm_transport = {
+	.name		= "shm",
+	.init		= shm_init,
+	.loop		= shm_loop,
+	.send		= shm_send,
+	.cleanup	= shm_cleanup,
+};
@@ -0,0 +1,232 @@
+/*
+ * Greybus Simulator: Unix domain socket transport
+ *
+ * Copyright 2015 Google Inc.
+ * Copyright 2015 Linaro Ltd.
+ *
+ * Provided under the three clause BSD license found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "gbsim.h"
+
+/*
+ * Instead of a USB gadget, listen on a Unix domain stream socket for a
+ * local AP stand-in to connect to. The stream carries the same messages
+ * as the CPort bulk endpoints, with the hd_cport_id in the header pad
+ * bytes, back to back in both directions. One AP is served at a time:
+ * the main loop accepts it, and a thread of its own receives from it
+ * until it disconnects. No configfs, gadget or dummy_hcd is involved, so
+ * this runs unprivileged.
+ */
+
+static int listen_fd = -1;
+static int conn_fd = -1;
+static pthread_t rx_pthread;
+static bool rx_started;
+
+/* Keeps conn_fd from being closed under the outbound scheduler */
+static pthread_mutex_t conn_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int socket_init(void)
+{
+	struct sockaddr_un addr;
+	int ret;
+
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		gbsim_error("socket path %s too long\n", socket_path);
+		return -ENAMETOOLONG;
+	}
+
+	listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listen_fd < 0) {
+		gbsim_error("socket: %s\n", strerror(errno));
+		return -errno;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+	unlink(socket_path);
+
+	if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(listen_fd, 1) < 0) {
+		ret = -errno;
+		gbsim_error("can't listen on %s: %s\n", socket_path,
+			    strerror(errno));
+		close(listen_fd);
+		listen_fd = -1;
+		return ret;
+	}
+
+	gbsim_info("listening for the AP on %s\n", socket_path);
+
+	return 0;
+}
+
+/* Serves one AP connection until it goes away */
+static void *socket_rx_thread(void *param)
+{
+	int fd = (intptr_t)param;
+	int ret;
+
+	/* Start communication with the AP, as on USB enumeration */
+	ret = svc_request_send(&bridges[0], GB_SVC_TYPE_PROTOCOL_VERSION,
+			       AP_INTF_ID);
+	if (ret)
+		gbsim_error("Failed to send svc version request (%d)\n", ret);
+
+	rx_stream(&bridges[0], fd, true);
+
+	gbsim_info("AP disconnected\n");
+
+	pthread_mutex_lock(&conn_lock);
+	conn_fd = -1;
+	close(fd);
+	pthread_mutex_unlock(&conn_lock);
+
+	/* No answers will come for these; give their credits back now */
+	operation_cancel_all(&bridges[0]);
+
+	return NULL;
+}
+
+static void socket_accept_cb(int lfd, uint32_t events, void *arg)
+{
+	int fd, ret;
+
+	fd = accept(lfd, NULL, NULL);
+	if (fd < 0) {
+		if (errno != EINTR && errno != EAGAIN)
+			gbsim_error("accept: %s\n", strerror(errno));
+		return;
+	}
+
+	pthread_mutex_lock(&conn_lock);
+	if (conn_fd >= 0) {
+		pthread_mutex_unlock(&conn_lock);
+		gbsim_error("AP already connected, refusing another\n");
+		close(fd);
+		return;
+	}
+	conn_fd = fd;
+	pthread_mutex_unlock(&conn_lock);
+
+	gbsim_info("AP connected\n");
+
+	/* The thread of the AP before is done with its connection */
+	if (rx_started) {
+		pthread_join(rx_pthread, NULL);
+		rx_started = false;
+	}
+
+	/* Receiving blocks on the AP, so it has a thread of its own */
+	ret = pthread_create(&rx_pthread, NULL, socket_rx_thread,
+			     (void *)(intptr_t)fd);
+	if (ret) {
+		gbsim_error("can't create socket receive thread\n");
+		pthread_mutex_lock(&conn_lock);
+		conn_fd = -1;
+		close(fd);
+		pthread_mutex_unlock(&conn_lock);
+		return;
+	}
+	rx_started = true;
+}
+
+static int socket_loop(void)
+{
+	int ret;
+
+	ret = reactor_add(listen_fd, EPOLLIN, socket_accept_cb, NULL);
+	if (ret < 0)
+		return ret;
+
+	ret = reactor_run();
+
+	/* Nothing more is handed to the workers, nor sent to the AP */
+	pthread_mutex_lock(&conn_lock);
+	if (conn_fd >= 0)
+		shutdown(conn_fd, SHUT_RDWR);
+	pthread_mutex_unlock(&conn_lock);
+
+	if (rx_started) {
+		pthread_join(rx_pthread, NULL);
+		rx_started = false;
+	}
+
+	return ret;
+}
+
+/* Write all of the batch, which a stream socket may only take in parts */
+static void socket_send(struct gbsim_txbuf **batch, int count)
+{
+	struct iovec iov[count];
+	struct msghdr mh;
+	ssize_t nbytes;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		iov[i].iov_base = batch[i]->buf;
+		iov[i].iov_len = batch[i]->size;
+	}
+
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = iov;
+	mh.msg_iovlen = count;
+
+	pthread_mutex_lock(&conn_lock);
+	while (conn_fd >= 0 && mh.msg_iovlen) {
+		nbytes = sendmsg(conn_fd, &mh, MSG_NOSIGNAL);
+		if (nbytes < 0) {
+			if (errno == EINTR)
+				continue;
+			gbsim_error("failed to send %d messages to AP: %s\n",
+				    count, strerror(errno));
+			break;
+		}
+
+		while (mh.msg_iovlen && (size_t)nbytes >= mh.msg_iov->iov_len) {
+			nbytes -= mh.msg_iov->iov_len;
+			mh.msg_iov++;
+			mh.msg_iovlen--;
+		}
+		if (mh.msg_iovlen) {
+			mh.msg_iov->iov_base = (char *)mh.msg_iov->iov_base + nbytes;
+			mh.msg_iov->iov_len -= nbytes;
+		}
+	}
+	pthread_mutex_unlock(&conn_lock);
+
+	for (i = 0; i < count; i++)
+		txbuf_release(batch[i]);
+}
+
+static void socket_cleanup(void)
+{
+	if (listen_fd >= 0) {
+		reactor_del(listen_fd);
+		close(listen_fd);
+		listen_fd = -1;
+		unlink(socket_path);
+	}
+}
+
+const struct gbsim_transport socket_transport = {
+	.name		= "socket",
+	.init		= socket_init,
+	.loop		= socket_loop,
+	.send		= socket_send,
+	.cleanup	= socket_cleanup,
+};
@@ -0,0 +1,78 @@
+/*
+ * Greybus Simulator: startup timing
+ *
+ * Copyright 2015 Google Inc.
+ * Copyright 2015 Linaro Ltd.
+ *
+ * Provided under the three clause BSD license found in the LICENSE file.
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+#include "gbsim.h"
+
+/*
+ * main() marks the end of each step of bringing gbsim up, and once the
+ * main loop is about to start, the time each step took is reported on a
+ * single line. Protocol backends are started later, when a manifest first
+ * uses them, and report their own time.
+ */
+#define STARTUP_PHASES_MAX	16
+
+struct startup_phase {
+	const char *name;
+	unsigned long us;
+};
+
+static struct startup_phase phases[STARTUP_PHASES_MAX];
+static int phase_count;
+static struct timespec phase_start;
+
+/* Microseconds since *t, which is then moved on to now */
+unsigned long phase_us(struct timespec *t)
+{
+	struct timespec now;
+	unsigned long us;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	us = (now.tv_sec - t->tv_sec) * 1000000 +
+	     (now.tv_nsec - t->tv_nsec) / 1000;
+	*t = now;
+
+	return us;
+}
+
+void startup_begin(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &phase_start);
+	phase_count = 0;
+}
+
+/* The step called name has just finished */
+void startup_phase(const char *name)
+{
+	if (phase_count == STARTUP_PHASES_MAX)
+		return;
+
+	phases[phase_count].name = name;
+	phases[phase_count].us = phase_us(&phase_start);
+	phase_count++;
+}
+
+void startup_report(void)
+{
+	char line[512] = "";
+	unsigned long total = 0;
+	int i, len = 0;
+
+	for (i = 0; i < phase_count; i++) {
+		total += phases[i].us;
+		len += snprintf(line + len, sizeof(line) - len, " %s_us=%lu",
+				phases[i].name, phases[i].us);
+		if (len >= sizeof(line))
+			break;
+	}
+
+	gbsim_event(GBSIM_LOG_INFO, "startup", "us=%lu%s", total, line);
+}
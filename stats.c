@@ -0,0 +1,440 @@
+/*
+ * Greybus Simulator: latency statistics
+ *
+ * Copyright 2015 Google Inc.
+ * Copyright 2015 Linaro Ltd.
+ *
+ * Provided under the three clause BSD license found in the LICENSE file.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gbsim.h"
+
+/*
+ * With -L, every message from the AP is timed twice: how long its
+ * protocol handler ran, and how long it took from being read from the AP
+ * to its response being written back. Each is counted in a histogram of
+ * its own for the protocol and operation type, and the histograms can be
+ * read at any time from a Unix domain socket at the given path: every
+ * connection is sent a text report and closed. The report is sent from
+ * the main loop without blocking, as the socket takes it. Comparing these times with
+ * the round trips the AP sees tells whether gbsim or the host is the
+ * bottleneck.
+ *
+ * The histograms are log-linear, in the style of HdrHistogram: every
+ * power of two of nanoseconds is split into STATS_SUB_BUCKETS buckets, so
+ * a percentile is exact to within 1 / STATS_SUB_BUCKETS of its value.
+ * Recording is a few relaxed atomic additions, and the histograms of an
+ * operation type are only allocated when it is first seen.
+ */
+#define STATS_SUB_BITS		3
+#define STATS_SUB_BUCKETS	(1 << STATS_SUB_BITS)
+#define STATS_MAX_BITS		40	/* about 18 minutes */
+#define STATS_BUCKETS		\
+	((STATS_MAX_BITS - STATS_SUB_BITS + 1) << STATS_SUB_BITS)
+
+#define STATS_CONNS_MAX		8
+
+struct stats_hist {
+	uint64_t count;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	uint64_t buckets[STATS_BUCKETS];
+};
+
+/* The histograms of one message type, response bit included */
+struct stats_op {
+	struct stats_hist hist[GBSIM_STATS_KINDS];
+};
+
+struct stats_proto {
+	struct stats_op *ops[UINT8_MAX + 1];
+};
+
+/* A connection whose report has not all been sent yet */
+struct stats_conn {
+	TAILQ_ENTRY(stats_conn) node;
+	int fd;
+	char *report;
+	size_t size;
+	size_t off;
+};
+
+static struct stats_proto *stats_protos[UINT8_MAX + 1];
+static int stats_fd = -1;
+/* Only used from the main loop */
+static TAILQ_HEAD(, stats_conn) stats_conns =
+	TAILQ_HEAD_INITIALIZER(stats_conns);
+static int stats_conn_count;
+
+static const char * const stats_kind_names[GBSIM_STATS_KINDS] = {
+	[GBSIM_STATS_HANDLER]	= "handler",
+	[GBSIM_STATS_REPLY]	= "reply",
+};
+
+uint64_t stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* The object in *slot, allocating it if this is the first use */
+static void *stats_get(void **slot, size_t size)
+{
+	void *p, *expected = NULL;
+
+	p = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+	if (p)
+		return p;
+
+	p = calloc(1, size);
+	if (!p)
+		return NULL;
+
+	/* Another thread may have got there first */
+	if (!__atomic_compare_exchange_n(slot, &expected, p, false,
+					 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		free(p);
+		p = expected;
+	}
+
+	return p;
+}
+
+static int stats_bucket(uint64_t ns)
+{
+	int msb;
+
+	if (ns >= 1ULL << STATS_MAX_BITS)
+		ns = (1ULL << STATS_MAX_BITS) - 1;
+	if (ns < STATS_SUB_BUCKETS)
+		return ns;
+
+	msb = 63 - __builtin_clzll(ns);
+	return (msb - STATS_SUB_BITS + 1) << STATS_SUB_BITS |
+	       (ns >> (msb - STATS_SUB_BITS) & (STATS_SUB_BUCKETS - 1));
+}
+
+/* The largest value counted in bucket i */
+static uint64_t stats_bucket_max(int i)
+{
+	int shift = i >> STATS_SUB_BITS;
+	uint64_t sub = i & (STATS_SUB_BUCKETS - 1);
+
+	if (!shift)
+		return sub;
+
+	return ((STATS_SUB_BUCKETS + sub + 1) << (shift - 1)) - 1;
+}
+
+void stats_record(int kind, uint8_t protocol, uint8_t type, uint64_t ns)
+{
+	struct stats_proto *sp;
+	struct stats_op *so;
+	struct stats_hist *h;
+	uint64_t max;
+
+	sp = stats_get((void **)&stats_protos[protocol], sizeof(*sp));
+	if (!sp)
+		return;
+	so = stats_get((void **)&sp->ops[type], sizeof(*so));
+	if (!so)
+		return;
+
+	h = &so->hist[kind];
+	__atomic_fetch_add(&h->buckets[stats_bucket(ns)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->total_ns, ns, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+
+	max = __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED);
+	while (ns > max &&
+	       !__atomic_compare_exchange_n(&h->max_ns, &max, ns, true,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/*
+ * A response built in a pooled buffer has been written to the AP (or its
+ * write failed), rx_ns after the request was read.
+ */
+void stats_reply(struct gbsim_txbuf *tb)
+{
+	struct gb_operation_msg_hdr *hdr = (struct gb_operation_msg_hdr *)tb->buf;
+	struct gbsim_cport *cport;
+	uint64_t ns = stats_now() - tb->rx_ns;
+
+	cport_read_lock();
+	cport = cport_find(tb->hd_cport_id);
+	if (cport)
+		stats_record(GBSIM_STATS_REPLY, cport->protocol,
+			     hdr->type & ~OP_RESPONSE, ns);
+	cport_read_unlock();
+}
+
+static void stats_print_hist(FILE *f, int kind, uint8_t protocol,
+			     uint8_t type, struct stats_hist *h)
+{
+	static const unsigned int pcts[] = { 500, 900, 990, 999 };
+	const struct gbsim_protocol *proto = protocol_find(protocol);
+	uint64_t buckets[STATS_BUCKETS], count = 0, seen = 0, want, max, ns;
+	int i, p;
+
+	/* Counted from one copy, so the percentiles agree with each other */
+	for (i = 0; i < STATS_BUCKETS; i++) {
+		buckets[i] = __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+		count += buckets[i];
+	}
+	if (!count)
+		return;
+	max = __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED);
+
+	fprintf(f, "%-8s %-20s %-32s %-8s %10llu %10.1f",
+		stats_kind_names[kind], proto ? proto->name : "(unknown)",
+		proto ? protocol_get_operation(proto, type & ~OP_RESPONSE) :
+			"(unknown)",
+		type & OP_RESPONSE ? "response" : "request",
+		(unsigned long long)count,
+		__atomic_load_n(&h->total_ns, __ATOMIC_RELAXED) / 1000.0 /
+		__atomic_load_n(&h->count, __ATOMIC_RELAXED));
+
+	for (i = p = 0; p < sizeof(pcts) / sizeof(pcts[0]); p++) {
+		want = (count * pcts[p] + 999) / 1000;
+		for (; seen + buckets[i] < want; i++)
+			seen += buckets[i];
+		ns = stats_bucket_max(i);
+		fprintf(f, " %10.1f", (ns < max ? ns : max) / 1000.0);
+	}
+
+	fprintf(f, " %10.1f\n", max / 1000.0);
+}
+
+static void stats_print_cports(FILE *f)
+{
+	struct gbsim_op_stats os;
+	struct gbsim_cport *cport;
+	uint16_t hd_cport_id;
+	const char *name;
+	int b, i, id;
+
+	fprintf(f, "\n# requests to the AP, round trip in us\n");
+	fprintf(f, "# %-6s %-11s %-5s %-20s %10s %10s %10s %10s %10s %10s\n",
+		"bridge", "hd_cport_id", "cport", "protocol", "requests",
+		"responses", "timeouts", "min", "mean", "max");
+
+	for (b = 0; b < bridge_count; b++) {
+		for (i = 0; i < GBSIM_BRIDGE_CPORTS; i++) {
+			hd_cport_id = bridge_cport_id(&bridges[b], i);
+			if (!operation_get_stats(hd_cport_id, &os) ||
+			    !os.responses)
+				continue;
+
+			/* Protocols outlive CPorts, the name can be kept */
+			cport_read_lock();
+			cport = cport_find(hd_cport_id);
+			id = cport ? cport->id : -1;
+			name = cport && cport->proto ? cport->proto->name :
+						       "(none)";
+			cport_read_unlock();
+
+			fprintf(f, "  %-6d %-11d %-5d %-20s %10lu %10lu %10lu %10.1f %10.1f %10.1f\n",
+				b, i, id, name,
+				os.requests, os.responses, os.timeouts,
+				os.latency_min_ns / 1000.0,
+				(double)os.latency_total_ns / os.responses / 1000.0,
+				os.latency_max_ns / 1000.0);
+		}
+	}
+}
+
+static void stats_print(FILE *f)
+{
+	struct stats_proto *sp;
+	struct stats_op *so;
+	int kind, p, t;
+
+	fprintf(f, "# messages from the AP, times in us\n");
+	fprintf(f, "# %-6s %-20s %-32s %-8s %10s %10s %10s %10s %10s %10s %10s\n",
+		"time", "protocol", "operation", "type", "count", "mean",
+		"p50", "p90", "p99", "p99.9", "max");
+
+	for (kind = 0; kind < GBSIM_STATS_KINDS; kind++) {
+		for (p = 0; p <= UINT8_MAX; p++) {
+			sp = __atomic_load_n(&stats_protos[p], __ATOMIC_ACQUIRE);
+			if (!sp)
+				continue;
+			for (t = 0; t <= UINT8_MAX; t++) {
+				so = __atomic_load_n(&sp->ops[t],
+						     __ATOMIC_ACQUIRE);
+				if (so)
+					stats_print_hist(f, kind, p, t,
+							 &so->hist[kind]);
+			}
+		}
+	}
+
+	stats_print_cports(f);
+}
+
+static void stats_conn_close(struct stats_conn *c)
+{
+	reactor_del(c->fd);
+	close(c->fd);
+	TAILQ_REMOVE(&stats_conns, c, node);
+	stats_conn_count--;
+	free(c->report);
+	free(c);
+}
+
+/* Send what the socket takes; true once the report is sent or failed */
+static bool stats_conn_send(struct stats_conn *c)
+{
+	ssize_t nbytes;
+
+	while (c->off < c->size) {
+		nbytes = send(c->fd, c->report + c->off, c->size - c->off,
+			      MSG_NOSIGNAL);
+		if (nbytes < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno != EAGAIN && errno != EWOULDBLOCK;
+		}
+		c->off += nbytes;
+	}
+
+	return true;
+}
+
+static void stats_conn_cb(int fd, uint32_t events, void *arg)
+{
+	struct stats_conn *c = arg;
+
+	if (events & (EPOLLERR | EPOLLHUP) || stats_conn_send(c))
+		stats_conn_close(c);
+}
+
+/* Each connection gets one report, sent as the reader takes it */
+static void stats_accept_cb(int lfd, uint32_t events, void *arg)
+{
+	struct stats_conn *c;
+	FILE *f;
+	int fd;
+
+	fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0) {
+		if (errno != EINTR && errno != EAGAIN)
+			gbsim_error("accept: %s\n", strerror(errno));
+		return;
+	}
+
+	if (stats_conn_count >= STATS_CONNS_MAX) {
+		gbsim_error("too many stats readers, refusing another\n");
+		close(fd);
+		return;
+	}
+
+	c = calloc(1, sizeof(*c));
+	if (!c) {
+		close(fd);
+		return;
+	}
+	c->fd = fd;
+
+	f = open_memstream(&c->report, &c->size);
+	if (!f) {
+		gbsim_error("can't build stats report: %s\n", strerror(errno));
+		close(fd);
+		free(c);
+		return;
+	}
+	stats_print(f);
+	fclose(f);
+
+	TAILQ_INSERT_TAIL(&stats_conns, c, node);
+	stats_conn_count++;
+
+	/* The rest goes out whenever the reader makes room for it */
+	if (stats_conn_send(c) || reactor_add(fd, EPOLLOUT, stats_conn_cb, c) < 0)
+		stats_conn_close(c);
+}
+
+int stats_init(void)
+{
+	struct sockaddr_un addr;
+	int ret;
+
+	if (!stats_path)
+		return 0;
+
+	if (strlen(stats_path) >= sizeof(addr.sun_path)) {
+		gbsim_error("stats socket path %s too long\n", stats_path);
+		return -ENAMETOOLONG;
+	}
+
+	stats_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (stats_fd < 0) {
+		gbsim_error("socket: %s\n", strerror(errno));
+		return -errno;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, stats_path);
+	unlink(stats_path);
+
+	if (bind(stats_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(stats_fd, 4) < 0) {
+		ret = -errno;
+		gbsim_error("can't listen on %s: %s\n", stats_path,
+			    strerror(errno));
+		close(stats_fd);
+		stats_fd = -1;
+		return ret;
+	}
+
+	ret = reactor_add(stats_fd, EPOLLIN, stats_accept_cb, NULL);
+	if (ret < 0)
+		return ret;
+
+	gbsim_info("serving statistics on %s\n", stats_path);
+
+	return 0;
+}
+
+/* Only called once nothing records any more */
+void stats_cleanup(void)
+{
+	int p, t;
+
+	if (stats_fd >= 0) {
+		reactor_del(stats_fd);
+		close(stats_fd);
+		stats_fd = -1;
+		unlink(stats_path);
+	}
+
+	while (!TAILQ_EMPTY(&stats_conns))
+		stats_conn_close(TAILQ_FIRST(&stats_conns));
+
+	for (p = 0; p <= UINT8_MAX; p++) {
+		if (!stats_protos[p])
+			continue;
+		for (t = 0; t <= UINT8_MAX; t++)
+			free(stats_protos[p]->ops[t]);
+		free(stats_protos[p]);
+		stats_protos[p] = NULL;
+	}
+}
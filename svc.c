@@ -85,10 +85,12 @@ static int svc_handler_response(uint16_t cport_id, uint16_t hd_cport_id,
 {
 	struct op_msg *op_rsp = rbuf;
 	struct gb_operation_msg_hdr *oph = &op_rsp->header;
+	struct gbsim_bridge *bridge = cport_bridge(hd_cport_id);
 	int ret;
 
 	/* Must be AP's svc protocol's cport */
-	if (cport_id != GB_SVC_CPORT_ID || cport_id != hd_cport_id) {
+	if (cport_id != GB_SVC_CPORT_ID ||
+	    cport_wire_id(hd_cport_id) != GB_SVC_CPORT_ID) {
 		gbsim_error("%s: Error: cport-id-mismatch (%d %d %d)", __func__,
 			    cport_id, hd_cport_id, GB_SVC_CPORT_ID);
 		return -EINVAL;
@@ -100,7 +102,8 @@ static int svc_handler_response(uint16_t cport_id, uint16_t hd_cport_id,
 			    op_rsp->pv_rsp.major, op_rsp->pv_rsp.minor);
 
 		/* Version request successful, send hello msg */
-		ret = svc_request_send(GB_SVC_TYPE_SVC_HELLO, AP_INTF_ID);
+		ret = svc_request_send(bridge, GB_SVC_TYPE_SVC_HELLO,
+				       AP_INTF_ID);
 		if (ret) {
 			gbsim_error("%s: Failed to send svc hello request (%d)\n",
 				    __func__, ret);
@@ -112,12 +115,12 @@ static int svc_handler_response(uint16_t cport_id, uint16_t hd_cport_id,
 		 * AP's SVC cport is ready now, start scanning for module
 		 * hotplug.
 		 */
-		ret = inotify_start(hotplug_basedir);
+		ret = inotify_start(bridge);
 		if (ret < 0)
-			gbsim_error("Failed to start inotify thread\n");
+			gbsim_error("Failed to start inotify\n");
 		break;
 	case GB_SVC_TYPE_INTF_HOT_UNPLUG:
-		free_cports();
+		free_cports(bridge);
 		break;
 	case GB_SVC_TYPE_INTF_HOTPLUG:
 	case GB_SVC_TYPE_INTF_RESET:
@@ -131,8 +134,8 @@ static int svc_handler_response(uint16_t cport_id, uint16_t hd_cport_id,
 	return 0;
 }
 
-int svc_handler(uint16_t cport_id, uint16_t hd_cport_id, void *rbuf,
-		    size_t rsize, void *tbuf, size_t tsize)
+static int svc_handler(uint16_t cport_id, uint16_t hd_cport_id, void *rbuf,
+		       size_t rsize, void *tbuf, size_t tsize)
 {
 	struct op_msg *op = rbuf;
 	struct gb_operation_msg_hdr *oph = &op->header;
@@ -144,35 +147,21 @@ int svc_handler(uint16_t cport_id, uint16_t hd_cport_id, void *rbuf,
 					   tbuf, tsize);
 }
 
-char *svc_get_operation(uint8_t type)
-{
-	switch (type) {
-	case GB_SVC_TYPE_INVALID:
-		return "GB_SVC_TYPE_INVALID";
-	case GB_SVC_TYPE_PROTOCOL_VERSION:
-		return "GB_SVC_TYPE_PROTOCOL_VERSION";
-	case GB_SVC_TYPE_SVC_HELLO:
-		return "GB_SVC_TYPE_SVC_HELLO";
-	case GB_SVC_TYPE_INTF_DEVICE_ID:
-		return "GB_SVC_TYPE_INTF_DEVICE_ID";
-	case GB_SVC_TYPE_INTF_HOTPLUG:
-		return "GB_SVC_TYPE_INTF_HOTPLUG";
-	case GB_SVC_TYPE_INTF_HOT_UNPLUG:
-		return "GB_SVC_TYPE_INTF_HOT_UNPLUG";
-	case GB_SVC_TYPE_INTF_RESET:
-		return "GB_SVC_TYPE_INTF_RESET";
-	case GB_SVC_TYPE_CONN_CREATE:
-		return "GB_SVC_TYPE_CONN_CREATE";
-	case GB_SVC_TYPE_CONN_DESTROY:
-		return "GB_SVC_TYPE_CONN_DESTROY";
-	case GB_SVC_TYPE_ROUTE_CREATE:
-		return "GB_SVC_TYPE_ROUTE_CREATE";
-	default:
-		return "(Unknown operation)";
-	}
-}
-
-int svc_request_send(uint8_t type, uint8_t intf_id)
+static const char * const svc_operations[] = {
+	[GB_SVC_TYPE_INVALID] = "GB_SVC_TYPE_INVALID",
+	[GB_SVC_TYPE_PROTOCOL_VERSION] = "GB_SVC_TYPE_PROTOCOL_VERSION",
+	[GB_SVC_TYPE_SVC_HELLO] = "GB_SVC_TYPE_SVC_HELLO",
+	[GB_SVC_TYPE_INTF_DEVICE_ID] = "GB_SVC_TYPE_INTF_DEVICE_ID",
+	[GB_SVC_TYPE_INTF_HOTPLUG] = "GB_SVC_TYPE_INTF_HOTPLUG",
+	[GB_SVC_TYPE_INTF_HOT_UNPLUG] = "GB_SVC_TYPE_INTF_HOT_UNPLUG",
+	[GB_SVC_TYPE_INTF_RESET] = "GB_SVC_TYPE_INTF_RESET",
+	[GB_SVC_TYPE_CONN_CREATE] = "GB_SVC_TYPE_CONN_CREATE",
+	[GB_SVC_TYPE_CONN_DESTROY] = "GB_SVC_TYPE_CONN_DESTROY",
+	[GB_SVC_TYPE_ROUTE_CREATE] = "GB_SVC_TYPE_ROUTE_CREATE",
+};
+
+int svc_request_send(struct gbsim_bridge *bridge, uint8_t type,
+		     uint8_t intf_id)
 {
 	struct op_msg msg;
 	struct gb_operation_msg_hdr *oph = &msg.header;
@@ -227,16 +216,36 @@ int svc_request_send(uint8_t type, uint8_t intf_id)
 	}
 
 	message_size += payload_size;
-	return send_request(&msg, GB_SVC_CPORT_ID, message_size, 1, type);
+	return send_request(&msg, bridge_cport_id(bridge, GB_SVC_CPORT_ID),
+			    message_size, type);
 }
 
-void svc_init(void)
+static void svc_init(void)
 {
-	/* Allocate cport for svc protocol between AP and SVC */
-	allocate_cport(GB_SVC_CPORT_ID, GB_SVC_CPORT_ID, GREYBUS_PROTOCOL_SVC);
+	int i;
+
+	/* Allocate cport for svc protocol between each AP and SVC */
+	for (i = 0; i < bridge_count; i++)
+		allocate_cport(GB_SVC_CPORT_ID,
+			       bridge_cport_id(&bridges[i], GB_SVC_CPORT_ID),
+			       GREYBUS_PROTOCOL_SVC);
 }
 
-void svc_exit(void)
+static void svc_exit(void)
 {
-	free_cport(cport_find(GB_SVC_CPORT_ID));
+	int i;
+
+	for (i = 0; i < bridge_count; i++)
+		free_cport(cport_find(bridge_cport_id(&bridges[i],
+						      GB_SVC_CPORT_ID)));
 }
+
+const struct gbsim_protocol svc_protocol = {
+	.id		= GREYBUS_PROTOCOL_SVC,
+	.name		= "SVC",
+	.handler	= svc_handler,
+	.operations	= svc_operations,
+	.operation_count = ARRAY_SIZE(svc_operations),
+	.init		= svc_init,
+	.cleanup	= svc_exit,
+};
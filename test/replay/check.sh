@@ -0,0 +1,47 @@
+#!/bin/sh
+#
+# Replay a recorded session and check that gbsim still answers it the
+# same way, with one worker and with several. The recording was made with
+#
+#   gbsim -h <dir> -B 256 -o svc-bench.rec
+#
+# and the checksum below is what -O reports for it. A change to how gbsim
+# answers the AP changes the checksum: record again and update it only if
+# that change was intended.
+
+GBSIM=${GBSIM:-./gbsim}
+RECORDING=${srcdir:-.}/test/replay/svc-bench.rec
+CHECKSUM=d28e001c2aeed2ac
+
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+mkdir "$dir/hotplug-module"
+
+for workers in 1 4; do
+	"$GBSIM" -h "$dir" -w $workers -O "$RECORDING" > "$dir/out" 2>&1
+	ret=$?
+	if [ $ret != 0 ]; then
+		cat "$dir/out"
+		echo "replay with $workers workers failed ($ret)"
+		exit 1
+	fi
+
+	report=$(grep 'replay messages=' "$dir/out")
+	if [ -z "$report" ]; then
+		# Built with --with-log-level=error: the report is compiled out
+		echo "no replay report, skipping"
+		exit 77
+	fi
+
+	case "$report" in
+	*" answered=256 checksum=$CHECKSUM")
+		;;
+	*)
+		echo "$report"
+		echo "replay with $workers workers: expected checksum $CHECKSUM"
+		exit 1
+		;;
+	esac
+done
+
+exit 0
@@ -0,0 +1,270 @@
+/*
+ * Greybus Simulator: binary message trace
+ *
+ * Copyright 2015 Google Inc.
+ * Copyright 2015 Linaro Ltd.
+ *
+ * Provided under the three clause BSD license found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gbsim.h"
+
+/*
+ * With -T, every message to and from the AP is recorded as a fixed-size
+ * binary record instead of being logged as text. Each thread appends to
+ * a ring of its own, without locks or system calls beyond reading the
+ * clock, and the main loop drains all the rings to the trace file every
+ * TRACE_DRAIN_NS. A full ring drops records, which are counted.
+ *
+ * The file starts with struct gbsim_trace_header, followed by records in
+ * host byte order, in the order they were drained: records of different
+ * threads can be ordered by their timestamps. gbsim -D decodes a file.
+ */
+#define TRACE_RING_SIZE		32768	/* records, a power of two */
+#define TRACE_DRAIN_NS		10000000ULL
+#define TRACE_MAGIC		"GBTRACE1"
+
+struct gbsim_trace_header {
+	char magic[8];
+	uint32_t record_size;
+	uint32_t reserved;
+};
+
+struct trace_ring {
+	struct trace_ring *next;
+	uint32_t thread;
+	bool dead;			/* its thread has exited */
+	unsigned long head;		/* written by the thread */
+	unsigned long tail;		/* written by the drain */
+	unsigned long dropped;
+	struct gbsim_trace_rec *recs;
+};
+
+static FILE *trace_file;
+static int trace_timer = -1;
+
+static struct trace_ring *trace_rings;
+static uint32_t trace_threads;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t trace_key;
+static __thread struct trace_ring *trace_self;
+
+static void trace_ring_exit(void *arg)
+{
+	struct trace_ring *r = arg;
+
+	/* The drain frees it once it is empty */
+	__atomic_store_n(&r->dead, true, __ATOMIC_RELEASE);
+}
+
+static struct trace_ring *trace_ring_register(void)
+{
+	struct trace_ring *r;
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return NULL;
+
+	r->recs = buf_alloc(TRACE_RING_SIZE * sizeof(*r->recs));
+	if (!r->recs) {
+		free(r);
+		return NULL;
+	}
+
+	pthread_setspecific(trace_key, r);
+
+	pthread_mutex_lock(&trace_lock);
+	r->thread = trace_threads++;
+	r->next = trace_rings;
+	trace_rings = r;
+	pthread_mutex_unlock(&trace_lock);
+
+	trace_self = r;
+	return r;
+}
+
+/* Record a message to (tx) or from (rx) the AP on the calling thread's ring */
+void trace_msg(uint8_t dir, uint16_t hd_cport_id,
+	       const struct gb_operation_msg_hdr *hdr)
+{
+	struct trace_ring *r = trace_self;
+	struct gbsim_trace_rec *rec;
+	struct timespec ts;
+	unsigned long head;
+
+	if (!trace_file)
+		return;
+
+	if (!r) {
+		r = trace_ring_register();
+		if (!r)
+			return;
+	}
+
+	head = r->head;
+	if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) ==
+	    TRACE_RING_SIZE) {
+		r->dropped++;
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	rec = &r->recs[head & (TRACE_RING_SIZE - 1)];
+	rec->ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	rec->thread = r->thread;
+	rec->hd_cport_id = hd_cport_id;
+	rec->operation_id = le16toh(hdr->operation_id);
+	rec->size = le16toh(hdr->size);
+	rec->type = hdr->type;
+	rec->result = hdr->result;
+	rec->dir = dir;
+
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void trace_drain(void)
+{
+	struct trace_ring *r, **p;
+	unsigned long head, tail, n;
+
+	pthread_mutex_lock(&trace_lock);
+	for (p = &trace_rings; (r = *p); ) {
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		tail = r->tail;
+
+		/* At most two runs, either side of the end of the ring */
+		while (tail != head) {
+			n = TRACE_RING_SIZE - (tail & (TRACE_RING_SIZE - 1));
+			if (n > head - tail)
+				n = head - tail;
+			fwrite(&r->recs[tail & (TRACE_RING_SIZE - 1)],
+			       sizeof(*r->recs), n, trace_file);
+			tail += n;
+		}
+		__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+
+		if (__atomic_load_n(&r->dead, __ATOMIC_ACQUIRE) &&
+		    __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == tail) {
+			if (r->dropped)
+				gbsim_event(GBSIM_LOG_ERROR, "trace_dropped",
+					    "thread=%u records=%lu",
+					    r->thread, r->dropped);
+			*p = r->next;
+			free(r->recs);
+			free(r);
+			continue;
+		}
+		p = &r->next;
+	}
+	pthread_mutex_unlock(&trace_lock);
+
+	fflush(trace_file);
+}
+
+static void trace_timer_cb(int fd, uint32_t events, void *arg)
+{
+	trace_drain();
+}
+
+int trace_init(void)
+{
+	struct gbsim_trace_header hdr;
+	int ret;
+
+	if (!trace_path)
+		return 0;
+
+	trace_file = fopen(trace_path, "w");
+	if (!trace_file) {
+		gbsim_error("can't open trace file %s: %s\n", trace_path,
+			    strerror(errno));
+		return -errno;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+	hdr.record_size = sizeof(struct gbsim_trace_rec);
+	fwrite(&hdr, sizeof(hdr), 1, trace_file);
+
+	pthread_key_create(&trace_key, trace_ring_exit);
+
+	trace_timer = reactor_timer_add(trace_timer_cb, NULL);
+	if (trace_timer < 0)
+		return trace_timer;
+
+	ret = reactor_timer_arm(trace_timer, TRACE_DRAIN_NS, true);
+	if (ret < 0)
+		return ret;
+
+	return 0;
+}
+
+/* Write out what the rings still hold; threads may go on tracing to them */
+void trace_cleanup(void)
+{
+	struct trace_ring *r;
+
+	if (!trace_file)
+		return;
+
+	if (trace_timer >= 0) {
+		reactor_timer_del(trace_timer);
+		trace_timer = -1;
+	}
+
+	trace_drain();
+
+	pthread_mutex_lock(&trace_lock);
+	for (r = trace_rings; r; r = r->next)
+		if (r->dropped)
+			gbsim_event(GBSIM_LOG_ERROR, "trace_dropped",
+				    "thread=%u records=%lu",
+				    r->thread, r->dropped);
+	pthread_mutex_unlock(&trace_lock);
+}
+
+/* Print a trace file as text, one message per line */
+int trace_decode(const char *path)
+{
+	struct gbsim_trace_header hdr;
+	struct gbsim_trace_rec rec;
+	FILE *f;
+	int ret = 0;
+
+	f = fopen(path, "r");
+	if (!f) {
+		gbsim_error("can't open trace file %s: %s\n", path,
+			    strerror(errno));
+		return -errno;
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) ||
+	    hdr.record_size != sizeof(rec)) {
+		gbsim_error("%s is not a gbsim trace\n", path);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	while (fread(&rec, sizeof(rec), 1, f) == 1)
+		printf("%" PRIu64 ".%09" PRIu64 " T%u %s CPort %hu type 0x%02x %s id %hu size %hu result %hhu\n",
+		       rec.ns / 1000000000, rec.ns % 1000000000, rec.thread,
+		       rec.dir == GBSIM_TRACE_RX ? "AP -> Module" : "Module -> AP",
+		       rec.hd_cport_id, rec.type & ~OP_RESPONSE,
+		       rec.type & OP_RESPONSE ? "response" : "request",
+		       rec.operation_id, rec.size, rec.result);
+
+out:
+	fclose(f);
+	return ret;
+}
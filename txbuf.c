@@ -0,0 +1,189 @@
+/*
+ * Greybus Simulator: transmit buffer pool
+ *
+ * Copyright 2015 Google Inc.
+ * Copyright 2015 Linaro Ltd.
+ *
+ * Provided under the three clause BSD license found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gbsim.h"
+
+/*
+ * Messages to the AP are built in place in buffers taken from this pool,
+ * and the transport writes them straight from there: a CPort worker
+ * acquires a buffer before running a handler, the handler fills in its
+ * response, and send_response() queues that same buffer for the outbound
+ * scheduler. The buffer goes back to the pool once it has been written,
+ * which for asynchronous I/O is only when the write completes.
+ *
+ * Handlers do not clear what they leave unwritten, so a buffer is cleared
+ * as it is taken, as far as its last message went: nothing of an earlier
+ * message reaches the AP in a later one. A buffer given back unsent may
+ * have been written anywhere, and is cleared whole.
+ */
+#define TXBUF_COUNT		64
+
+static struct gbsim_txbuf txbufs[TXBUF_COUNT];
+static char *txbuf_pool;
+static size_t txbuf_stride;
+static struct gbsim_txbuf *txbuf_free;
+static pthread_mutex_t txbuf_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t txbuf_cond = PTHREAD_COND_INITIALIZER;
+
+/* The buffer the calling CPort worker is building its response in */
+static __thread struct gbsim_txbuf *txbuf_current;
+
+static struct gbsim_txbuf *txbuf_take(bool wait)
+{
+	struct gbsim_txbuf *tb;
+
+	pthread_mutex_lock(&txbuf_lock);
+	while (wait && !txbuf_free)
+		pthread_cond_wait(&txbuf_cond, &txbuf_lock);
+	tb = txbuf_free;
+	if (tb)
+		txbuf_free = tb->next;
+	pthread_mutex_unlock(&txbuf_lock);
+
+	if (!tb)
+		return NULL;
+
+	memset(tb->buf, 0, tb->size);
+	tb->size = 0;
+	tb->next = NULL;
+	tb->rx_ns = 0;
+	return tb;
+}
+
+struct gbsim_txbuf *txbuf_acquire(void)
+{
+	return txbuf_take(true);
+}
+
+/* As txbuf_acquire(), but NULL rather than waiting, for the main loop */
+struct gbsim_txbuf *txbuf_try_acquire(void)
+{
+	return txbuf_take(false);
+}
+
+void txbuf_release(struct gbsim_txbuf *tb)
+{
+	/* A response is done with once it has been written */
+	if (tb->rx_ns)
+		stats_reply(tb);
+
+	pthread_mutex_lock(&txbuf_lock);
+	tb->next = txbuf_free;
+	txbuf_free = tb;
+	pthread_cond_signal(&txbuf_cond);
+	pthread_mutex_unlock(&txbuf_lock);
+}
+
+/*
+ * Queue a buffer for the AP. Ownership of the buffer passes to the
+ * outbound scheduler, which releases it once written.
+ */
+int txbuf_submit(struct gbsim_txbuf *tb, size_t size)
+{
+	return outbound_queue(tb, size);
+}
+
+/* Make tb the buffer the calling worker's handler builds its response in */
+void txbuf_set_current(struct gbsim_txbuf *tb)
+{
+	txbuf_current = tb;
+}
+
+/*
+ * Give back the calling worker's buffer if the handler did not submit it,
+ * e.g. because the operation needed no response.
+ */
+void txbuf_put_current(void)
+{
+	if (txbuf_current) {
+		txbuf_current->rx_ns = 0;
+		txbuf_current->size = msg_size_max;
+		txbuf_release(txbuf_current);
+	}
+	txbuf_current = NULL;
+}
+
+/* The pooled buffer whose message starts at buf, if any */
+static struct gbsim_txbuf *txbuf_from_buf(void *buf)
+{
+	char *p = buf;
+	struct gbsim_txbuf *tb;
+
+	if (p < txbuf_pool || p >= txbuf_pool + TXBUF_COUNT * txbuf_stride)
+		return NULL;
+
+	tb = &txbufs[(p - txbuf_pool) / txbuf_stride];
+	return p == tb->buf ? tb : NULL;
+}
+
+/*
+ * Send a message that has been fully built by the caller. A message built
+ * in a pooled buffer, such as a response in the worker's current buffer,
+ * is submitted without copying and ownership of the buffer passes on. Any
+ * other message (e.g. an unsolicited request built on the stack) is copied
+ * into a pooled buffer, so that it is queued behind the CPort's earlier
+ * messages instead of racing them to the endpoint.
+ */
+int txbuf_send(void *buf, size_t size)
+{
+	struct gbsim_txbuf *tb = txbuf_from_buf(buf);
+
+	if (tb) {
+		if (tb == txbuf_current)
+			txbuf_current = NULL;
+		return txbuf_submit(tb, size);
+	}
+
+	if (size > msg_size_max) {
+		gbsim_error("message of %zu bytes too large to send\n", size);
+		return -EMSGSIZE;
+	}
+
+	tb = txbuf_acquire();
+	memcpy(tb->buf, buf, size);
+	return txbuf_submit(tb, size);
+}
+
+/* Give back the pooled buffer of a message that will not be sent after all */
+void txbuf_discard(void *buf)
+{
+	struct gbsim_txbuf *tb = txbuf_from_buf(buf);
+
+	if (!tb)
+		return;
+	if (tb == txbuf_current)
+		txbuf_current = NULL;
+	tb->rx_ns = 0;
+	tb->size = msg_size_max;
+	txbuf_release(tb);
+}
+
+int txbuf_init(void)
+{
+	int i;
+
+	txbuf_stride = buf_stride(msg_size_max);
+	txbuf_pool = buf_pool_alloc(TXBUF_COUNT, msg_size_max);
+	if (!txbuf_pool)
+		return -ENOMEM;
+
+	for (i = 0; i < TXBUF_COUNT; i++) {
+		txbufs[i].buf = txbuf_pool + i * txbuf_stride;
+		txbuf_release(&txbufs[i]);
+	}
+
+	return 0;
+}
@@ -14,9 +14,11 @@
 #include <linux/fs.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <termios.h>
@@ -28,6 +30,14 @@
 #define GB_UART_MESSAGE_SIZE_MAX		GB_OPERATION_DATA_SIZE_MAX
 #define GB_UART_DATA_SIZE_MAX \
 	(GB_UART_MESSAGE_SIZE_MAX - sizeof(struct gb_uart_send_data_request))
+/* Received data has to fit in one message to the AP, within the protocol */
+#define GB_UART_RECV_PAYLOAD_MAX \
+	(msg_size_max - sizeof(struct gb_operation_msg_hdr) < \
+	 GB_UART_MESSAGE_SIZE_MAX ? \
+	 msg_size_max - sizeof(struct gb_operation_msg_hdr) : \
+	 GB_UART_MESSAGE_SIZE_MAX)
+#define GB_UART_RECV_DATA_MAX \
+	(GB_UART_RECV_PAYLOAD_MAX - sizeof(struct gb_uart_recv_data_request))
 #define BREAK_DURATION_MS 300			/* break duration tcsendbreak() */
 
 /* greybus-spec/build/html/bridged_phy.html#uart-protocol */
@@ -35,23 +45,24 @@
 #define GB_OPERATION_DATA_SIZE_MAX		0x400	/* TODO: BOD */
 
 #define UART_MAXNAME				20
-#define UART_IDX_TX				1
-#define UART_IDX_RX				0
-#define UART_IDX_COUNT				2
+#define UART_MODEM_POLL_NS			1000000000ULL
+#define UART_RETRY_NS				1000000ULL
 
 /*
  * This code works in the following way.
  * Each tty has a handle to the /dev/ttyOx port represented by a handle 'fd'.
- * Each tty has a pipe for signalling that the AP ACKed Module -> AP UART data.
- * A single thread is responsible for running select on all open tty ports
- * and relaying data from each tty to the AP as data arrives on the tty handle.
- * This thread will wait for up to 2 seconds for the AP to send back the
- * corresponding ACK. If the ACK never comes, the data is not resent.
+ * Each open tty port is registered with the main loop, which relays data
+ * from the tty to the AP as data arrives on the tty handle. A periodic
+ * timer on the same loop polls the modem lines, which raise no events.
+ * Each message to the AP is tracked as an operation, which times out if
+ * the AP does not send back the corresponding ACK within 2 seconds. If the
+ * ACK never comes, the data is not resent.
  * When the AP wants to send data to the UART then this is written directly
  * to the fd for the relevant tty.
- * The RX thread has a pipe file-descriptor used to signal thread termination.
- * This pipe along with the file descriptors for the open tty ports is run
- * though a timeless select() in uart_thread().
+ * A tty is only read once a credit and a pooled buffer are secured for the
+ * message to the AP; otherwise it stops being watched until the AP's
+ * responses return credits, or a little later for a buffer, so data backs
+ * up in the tty instead of in gbsim or being dropped.
  */
 struct gb_uart_port {
 	uint16_t	cport_id;
@@ -64,29 +75,54 @@ struct gb_uart_port {
 	uint8_t		module_id;
 	int		tiocm_bits;
 	pthread_mutex_t	uart_port;
+	/* Only used from the main loop */
+	bool		throttled;
+	unsigned char	*rx_buf;	/* read, not yet sent to the AP */
+	int		rx_len;
 };
 
 static struct gb_uart_port up[GB_UART_MAX];
-static int uart_sig_pipe[UART_IDX_COUNT] = {-1, -1};
-static bool terminate_thread;
-static int thread_started;
+static int modem_timer = -1;
+static int retry_timer = -1;
 static int port_count;
 static int up_count;
-static pthread_t uart_pthread;
-static pthread_barrier_t uart_barrier;
+static pthread_mutex_t port_lock = PTHREAD_MUTEX_INITIALIZER;
 
-/* Only used when bbb_backend is true */
-static int gb_uart_send(int i, void *tbuf, size_t tsize, __u8 type, __u8 flags)
+/*
+ * Only used when bbb_backend is true. Secure what a message to the AP
+ * needs, without waiting: a credit, and a pooled buffer. Only the main
+ * loop sends requests on a UART CPort, so the credit is still there when
+ * the message is sent. Out of credits, the CPort is throttled; out of
+ * buffers, the retry timer goes off a little later.
+ */
+static struct gbsim_txbuf *uart_reserve(int i)
 {
-	char uart_buf[GB_OPERATION_DATA_SIZE_MAX];
-	struct op_msg *op_req = (struct op_msg *)uart_buf;
+	struct gbsim_txbuf *tb;
+
+	if (!operation_credits(up[i].hd_cport_id))
+		return NULL;
+
+	tb = txbuf_try_acquire();
+	if (!tb)
+		reactor_timer_arm(retry_timer, UART_RETRY_NS, false);
+
+	return tb;
+}
+
+/* Only used when bbb_backend is true, with a buffer from uart_reserve() */
+static int gb_uart_send(int i, struct gbsim_txbuf *tb, void *tbuf,
+			size_t tsize, __u8 type, __u8 flags)
+{
+	struct op_msg *op_req;
 	size_t payload_size = 0;
 	uint16_t message_size;
-	struct gb_uart_recv_data_request *rdr =
-		(struct gb_uart_recv_data_request *)(uart_buf + sizeof(struct gb_operation_msg_hdr));
-	struct gb_uart_serial_state_request *ssr =
-		(struct gb_uart_serial_state_request *)(uart_buf + sizeof(struct gb_operation_msg_hdr));
-	int ret;
+	struct gb_uart_recv_data_request *rdr;
+	struct gb_uart_serial_state_request *ssr;
+
+	/* Built in place in a pooled buffer, queued behind the CPort's responses */
+	op_req = (struct op_msg *)tb->buf;
+	rdr = (struct gb_uart_recv_data_request *)(tb->buf + sizeof(struct gb_operation_msg_hdr));
+	ssr = (struct gb_uart_serial_state_request *)(tb->buf + sizeof(struct gb_operation_msg_hdr));
 
 	switch (type) {
 	case GB_UART_TYPE_RECEIVE_DATA:
@@ -101,6 +137,7 @@ static int gb_uart_send(int i, void *tbuf, size_t tsize, __u8 type, __u8 flags)
 		break;
 	default:
 		gbsim_error("UART send operation %02x invalid\n", type);
+		txbuf_release(tb);
 		return -EINVAL;
 
 	}
@@ -108,24 +145,10 @@ static int gb_uart_send(int i, void *tbuf, size_t tsize, __u8 type, __u8 flags)
 	gbsim_debug("Module %hhu -> AP CPort %hu UART protocol unsol data\n",
 		    up[i].module_id, up[i].cport_id);
 
-	/* Fill in the request header */
-	message_size = sizeof(struct gb_operation_msg_hdr) + payload_size;
-	op_req->header.size = htole16(message_size);
-	op_req->header.operation_id = 0;				/* Unidirectional */
-	op_req->header.type = type;
-
-	/* Store the cport id in the header pad bytes */
-	op_req->header.pad[0] = up[i].hd_cport_id & 0xff;
-	op_req->header.pad[1] = (up[i].hd_cport_id >> 8) & 0xff;
+	gbsim_debug("UART %s -> AP length %zu\n", up[i].name, tsize);
 
-	if (verbose) {
-		gbsim_debug("UART %s -> AP length %zu\n", up[i].name, tsize);
-		gbsim_dump(op_req, message_size);
-	}
-	ret = write(to_ap, op_req, message_size);
-	if (ret < 0)
-		return ret;
-	return 0;
+	message_size = sizeof(struct gb_operation_msg_hdr) + payload_size;
+	return send_request(op_req, up[i].hd_cport_id, message_size, type);
 }
 
 static int tty_find_port(uint8_t module_id, uint16_t cport_id)
@@ -140,33 +163,47 @@ static int tty_find_port(uint8_t module_id, uint16_t cport_id)
 	return i;
 }
 
-/* Only used when bbb_backend is true */
+/*
+ * Only used when bbb_backend is true. Runs on the main loop: the state is
+ * sent without holding the port, and a change that could not be sent is
+ * sent again on the next poll.
+ */
 static void tty_poll_modem_state(int i)
 {
+	struct gbsim_txbuf *tb;
 	int ret;
-	int tiocm_bits;
+	int tiocm_bits, state;
 	extern int errno;
 
 	pthread_mutex_lock(&up[i].uart_port);
 	ret = ioctl(up[i].fd, TIOCMGET, &tiocm_bits);
-	if (ret == 0 && up[i].tiocm_bits != tiocm_bits) {
-		up[i].tiocm_bits = tiocm_bits;
-		tiocm_bits =  up[i].tiocm_bits & TIOCM_CD  ? GB_UART_CTRL_DCD : 0;
-		tiocm_bits |= up[i].tiocm_bits & TIOCM_DSR ? GB_UART_CTRL_DSR : 0;
-		tiocm_bits |= up[i].tiocm_bits & TIOCM_RI  ? GB_UART_CTRL_RI  : 0;
-		gb_uart_send(i, &tiocm_bits, sizeof(tiocm_bits),
-			     GB_UART_TYPE_SERIAL_STATE, 0);
-		if (verbose)
-			gbsim_debug("UART DCD=%d DSR=%d RI=%d",
-				    tiocm_bits & GB_UART_CTRL_DCD,
-				    tiocm_bits & GB_UART_CTRL_DSR,
-				    tiocm_bits & GB_UART_CTRL_RI);
-	}
 	pthread_mutex_unlock(&up[i].uart_port);
+	if (ret != 0 || up[i].tiocm_bits == tiocm_bits)
+		return;
+
+	state =  tiocm_bits & TIOCM_CD  ? GB_UART_CTRL_DCD : 0;
+	state |= tiocm_bits & TIOCM_DSR ? GB_UART_CTRL_DSR : 0;
+	state |= tiocm_bits & TIOCM_RI  ? GB_UART_CTRL_RI  : 0;
+	tb = uart_reserve(i);
+	if (!tb)
+		return;
+	if (gb_uart_send(i, tb, &state, sizeof(state),
+			 GB_UART_TYPE_SERIAL_STATE, 0))
+		return;
+	up[i].tiocm_bits = tiocm_bits;
+	gbsim_debug("UART DCD=%d DSR=%d RI=%d",
+		    state & GB_UART_CTRL_DCD,
+		    state & GB_UART_CTRL_DSR,
+		    state & GB_UART_CTRL_RI);
 }
 
-/* Only used when bbb_backend is true */
-static unsigned char *gb_uart_send_escape_sequences(int i, unsigned char *data,
+/*
+ * Only used when bbb_backend is true. Sends the data up to the first error
+ * or break in one message, and returns where the rest starts.
+ */
+static unsigned char *gb_uart_send_escape_sequences(int i,
+						    struct gbsim_txbuf *tb,
+						    unsigned char *data,
 						    int size)
 {
 	unsigned char *begin = data;
@@ -211,46 +248,82 @@ static unsigned char *gb_uart_send_escape_sequences(int i, unsigned char *data,
 
 	/* Send the parsed message */
 	size = send_data - begin;
-	gb_uart_send(i, begin, size, GB_UART_TYPE_RECEIVE_DATA, flags);
+	gb_uart_send(i, tb, begin, size, GB_UART_TYPE_RECEIVE_DATA, flags);
 
 	/* Return offset */
 	return data;
 err:
 	gbsim_error("UART: parsing esc sequence");
+	txbuf_release(tb);
 	return end;
 
 }
 
-/* Only used when bbb_backend is true */
-static int tty_read(int i)
+/*
+ * Only used when bbb_backend is true. Relays what is left of an earlier
+ * read, then, if readable, reads the tty once more. Each message is only
+ * built once uart_reserve() has secured it, and nothing is read before
+ * then, so what the AP can't take yet stays in the tty. Errors and breaks
+ * split a read into several messages; what is left of it when the AP runs
+ * out of credits is kept in rx_buf. Returns -EAGAIN when throttled.
+ */
+static int tty_read(int i, bool readable)
 {
-	unsigned char data[GB_UART_DATA_SIZE_MAX];
-	unsigned char *next_frame;
-	unsigned char *end;
+	struct gbsim_txbuf *tb;
+	unsigned char *next;
 	int ret;
 	extern int errno;
 
-	pthread_mutex_lock(&up[i].uart_port);
-	ret = read(up[i].fd, data, sizeof(data));
-	pthread_mutex_unlock(&up[i].uart_port);
-	if (ret < 0) {
-		if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
-			return ret;
-	} else {
-		if (up[i].esc) {
-			next_frame = data;
-			end = &data[ret];
-			while (next_frame < end) {
-				next_frame = gb_uart_send_escape_sequences(i, next_frame, ret);
-				ret = end-next_frame;
+	do {
+		if (!up[i].rx_len && !readable)
+			return 0;
+
+		tb = uart_reserve(i);
+		if (!tb)
+			return -EAGAIN;
+
+		if (!up[i].rx_len) {
+			pthread_mutex_lock(&up[i].uart_port);
+			ret = read(up[i].fd, up[i].rx_buf, GB_UART_RECV_DATA_MAX);
+			pthread_mutex_unlock(&up[i].uart_port);
+			readable = false;
+			if (ret <= 0) {
+				if (ret < 0 && errno != EAGAIN &&
+				    errno != EWOULDBLOCK)
+					ret = -errno;
+				else
+					ret = 0;
+				txbuf_release(tb);
+				return ret;
 			}
+			up[i].rx_len = ret;
+		}
+
+		if (up[i].esc) {
+			next = gb_uart_send_escape_sequences(i, tb, up[i].rx_buf,
+							     up[i].rx_len);
 		} else {
-			gb_uart_send(i, data, ret, GB_UART_TYPE_RECEIVE_DATA, 0);
+			gb_uart_send(i, tb, up[i].rx_buf, up[i].rx_len,
+				     GB_UART_TYPE_RECEIVE_DATA, 0);
+			next = up[i].rx_buf + up[i].rx_len;
 		}
-	}
+		up[i].rx_len -= next - up[i].rx_buf;
+		memmove(up[i].rx_buf, next, up[i].rx_len);
+	} while (up[i].rx_len);
+
 	return 0;
 }
 
+/* Only used when bbb_backend is true, from the main loop */
+static void tty_throttle(int i, bool throttled)
+{
+	if (up[i].throttled == throttled)
+		return;
+
+	up[i].throttled = throttled;
+	reactor_mod(up[i].fd, throttled ? 0 : EPOLLIN);
+}
+
 static int tty_write(uint8_t module_id, uint16_t cport_id, void *tbuf, size_t tsize)
 {
 	int i;
@@ -275,7 +348,7 @@ static int tty_write(uint8_t module_id, uint16_t cport_id, void *tbuf, size_t ts
 		gbsim_error("UART write -> %s failed errno=%d\n",
 			    up[i].name, errno);
 
-	if (verbose) {
+	if (gbsim_debug_enabled()) {
 		gbsim_debug("AP -> UART %s length %zu\n", up[i].name, tsize);
 		gbsim_dump(tbuf, tsize);
 	}
@@ -519,14 +592,16 @@ static int uart_init_port(uint8_t module_id, uint16_t cport_id,
 {
 	int i;
 
+	pthread_mutex_lock(&port_lock);
 	i = tty_find_port(module_id, cport_id);
 	if (i < port_count)
-		return i;
+		goto out;
 
 	if (port_count >= GB_UART_MAX) {
 		gbsim_error("All UARTs used Module %hu CPort %hhu\n",
 			    module_id, cport_id);
-		return -ENODEV;
+		i = -ENODEV;
+		goto out;
 	}
 	up[port_count].module_id = module_id;
 	up[port_count].cport_id = cport_id;
@@ -537,11 +612,17 @@ static int uart_init_port(uint8_t module_id, uint16_t cport_id,
 		   module_id, cport_id, hd_cport_id, port_count);
 	i = port_count;
 	port_count++;
+
+	/* Start relaying data from the tty now the AP knows the port */
+	if (i < up_count)
+		reactor_mod(up[i].fd, EPOLLIN);
+out:
+	pthread_mutex_unlock(&port_lock);
 	return i;
 }
 
-int uart_handler(uint16_t cport_id, uint16_t hd_cport_id, void *rbuf,
-		 size_t rsize, void *tbuf, size_t tsize)
+static int uart_handler(uint16_t cport_id, uint16_t hd_cport_id, void *rbuf,
+			size_t rsize, void *tbuf, size_t tsize)
 {
 	struct gb_operation_msg_hdr *oph;
 	struct op_msg *op_req = rbuf;
@@ -611,90 +692,79 @@ int uart_handler(uint16_t cport_id, uint16_t hd_cport_id, void *rbuf,
 }
 
 /* Only used when bbb_backend is true */
-static void *uart_thread(void *param)
+static void uart_tty_cb(int fd, uint32_t events, void *arg)
 {
-	fd_set fdset;
-	int i, ret;
-	int max = uart_sig_pipe[UART_IDX_RX];
-	struct timeval tv;
-	extern int errno;
+	int i = (intptr_t)arg;
+	int ret;
 
-	pthread_barrier_wait(&uart_barrier);
+	if (events & (EPOLLERR | EPOLLHUP)) {
+		gbsim_error("UART %s hung up\n", up[i].name);
+		reactor_del(fd);
+		return;
+	}
 
-	for (i = 0; i < up_count; i++)
-		if (max < up[i].fd)
-			max = up[i].fd;
-	while (!terminate_thread) {
-		for (i = 0; i < up_count; i++) {
-			if (up[i].init == true)
-				tty_poll_modem_state(i);
-		}
+	/* Out of credits or buffers: stop watching the tty until retried */
+	ret = tty_read(i, true);
+	if (ret == -EAGAIN) {
+		tty_throttle(i, true);
+	} else if (ret < 0) {
+		gbsim_error("UART %s read errno=%d\n", up[i].name, -ret);
+		reactor_del(fd);
+	}
+}
 
-		FD_ZERO(&fdset);
-		FD_SET(uart_sig_pipe[UART_IDX_RX] , &fdset);
-		for (i = 0; i < up_count; i++) {
-			if (up[i].init == true)
-				FD_SET(up[i].fd , &fdset);
-		}
+/*
+ * Only used when bbb_backend is true. Runs on the main loop once credits
+ * or buffers may be back: relay what is left of a split read, then watch
+ * the tty again. A port still short of them is throttled again.
+ */
+static void uart_retry_cb(int fd, uint32_t events, void *arg)
+{
+	int i;
 
-		tv.tv_sec = 1;
-		tv.tv_usec = 0;
-		ret = select(1 + max, &fdset, 0, 0, &tv);
-		switch (ret) {
-		case -1:
-			gbsim_error("%s : select errno=%d\n", __func__, errno);
-			terminate_thread = true;
-			break;
-		case 0:
-			break;
-		default:
-			if (FD_ISSET(uart_sig_pipe[UART_IDX_RX], &fdset)) {
-				terminate_thread = true;
-				break;
-			}
-			for (i = 0; i < up_count; i++) {
-				if (FD_ISSET(up[i].fd, &fdset)) {
-					if (tty_read(i)) {
-						terminate_thread = true;
-						break;
-					}
-				}
-			}
-			break;
-		}
+	for (i = 0; i < up_count; i++) {
+		if (up[i].init != true || !up[i].throttled)
+			continue;
+		if (tty_read(i, false) == 0)
+			tty_throttle(i, false);
 	}
-	gbsim_info("UART thread exit\n");
-	pthread_exit(NULL);
-	return NULL;
 }
 
-void uart_cleanup(void)
+/* Only used when bbb_backend is true */
+static void uart_modem_cb(int fd, uint32_t events, void *arg)
 {
 	int i;
-	char c;
-	extern int errno;
 
-	if (thread_started) {
-		/* signal termination */
-		if (write(uart_sig_pipe[UART_IDX_TX], &c, 1) < 0)
-			gbsim_error("Write to signal pipe fail %d\n", errno);
+	for (i = 0; i < up_count; i++) {
+		if (up[i].init == true)
+			tty_poll_modem_state(i);
+	}
+}
 
-		/* sync */
-		pthread_join(uart_pthread, NULL);
-		pthread_barrier_destroy(&uart_barrier);
+static void uart_cleanup(void)
+{
+	int i;
+
+	if (modem_timer >= 0) {
+		reactor_timer_del(modem_timer);
+		modem_timer = -1;
 	}
 
-	/* Close serial thread pipes */
-	if (uart_sig_pipe[UART_IDX_TX] != -1)
-		close(uart_sig_pipe[UART_IDX_TX]);
-	if (uart_sig_pipe[UART_IDX_RX] != -1)
-		close(uart_sig_pipe[UART_IDX_RX]);
+	if (retry_timer >= 0) {
+		reactor_timer_del(retry_timer);
+		retry_timer = -1;
+	}
 
-	/* Close fds to serial ports a signal pipes for ports */
-	for (i = 0; i < GB_UART_MAX; i++) {
-		if (up[i].fd != -1)
-			close(up[i].fd);
+	/* Close fds to serial ports */
+	for (i = 0; i < up_count; i++) {
+		reactor_del(up[i].fd);
+		close(up[i].fd);
+		free(up[i].rx_buf);
+		up[i].rx_buf = NULL;
+		up[i].rx_len = 0;
+		up[i].throttled = false;
 	}
+	up_count = 0;
 }
 
 /* Only used when bbb_backend is true */
@@ -710,62 +780,83 @@ static int uart_open(int idx)
 	}
 
 	pthread_mutex_init(&up[up_count].uart_port, 0);
+
+	up[up_count].rx_buf = buf_alloc(GB_UART_RECV_DATA_MAX);
+	if (!up[up_count].rx_buf) {
+		close(up[up_count].fd);
+		uart_cleanup();
+		return EXIT_FAILURE;
+	}
+
+	/* Not read until the AP starts using the port */
+	if (reactor_add(up[up_count].fd, 0, uart_tty_cb,
+			(void *)(intptr_t)up_count) < 0) {
+		close(up[up_count].fd);
+		free(up[up_count].rx_buf);
+		up[up_count].rx_buf = NULL;
+		uart_cleanup();
+		return EXIT_FAILURE;
+	}
+
 	up_count++;
 	return 0;
 }
 
-char *uart_get_operation(uint8_t type)
+static const char * const uart_operations[] = {
+	[GB_UART_TYPE_INVALID] = "GB_UART_TYPE_INVALID",
+	[GB_UART_TYPE_PROTOCOL_VERSION] = "GB_UART_TYPE_PROTOCOL_VERSION",
+	[GB_UART_TYPE_SEND_DATA] = "GB_UART_TYPE_SEND_DATA",
+	[GB_UART_TYPE_RECEIVE_DATA] = "GB_UART_TYPE_RECEIVE_DATA",
+	[GB_UART_TYPE_SET_LINE_CODING] = "GB_UART_TYPE_SET_LINE_CODING",
+	[GB_UART_TYPE_SET_CONTROL_LINE_STATE] = "GB_UART_TYPE_SET_CONTROL_LINE_STATE",
+	[GB_UART_TYPE_SEND_BREAK] = "GB_UART_TYPE_SEND_BREAK",
+	[GB_UART_TYPE_SERIAL_STATE] = "GB_UART_TYPE_SERIAL_STATE",
+};
+
+/*
+ * Called once the AP has returned credits to a throttled UART CPort, from
+ * any thread: the ports are left to the main loop to pick up again.
+ */
+static void uart_unthrottle(uint16_t hd_cport_id)
 {
-	switch (type) {
-	case GB_UART_TYPE_INVALID:
-		return "GB_UART_TYPE_INVALID";
-	case GB_UART_TYPE_PROTOCOL_VERSION:
-		return "GB_UART_TYPE_PROTOCOL_VERSION";
-	case GB_UART_TYPE_SEND_DATA:
-		return "GB_UART_TYPE_SEND_DATA";
-	case GB_UART_TYPE_RECEIVE_DATA:
-		return "GB_UART_TYPE_RECEIVE_DATA";
-	case GB_UART_TYPE_SET_LINE_CODING:
-		return "GB_UART_TYPE_SET_LINE_CODING";
-	case GB_UART_TYPE_SET_CONTROL_LINE_STATE:
-		return "GB_UART_TYPE_SET_CONTROL_LINE_STATE";
-	case GB_UART_TYPE_SEND_BREAK:
-		return "GB_UART_TYPE_SEND_BREAK";
-	case GB_UART_TYPE_SERIAL_STATE:
-		return "GB_UART_TYPE_SERIAL_STATE";
-	default:
-		return "(Unknown operation)";
-	}
+	reactor_timer_arm(retry_timer, 1, false);
 }
 
-void uart_init(void)
+static void uart_init(void)
 {
-	extern int errno;
-	int i, ret;
+	int i;
 
 	if (!bbb_backend)
 		return;
+
 	/* Loop through the /dev/tty0x entries */
 	for (i = 0; i < uart_count; i++)
 		if (uart_open(i + uart_portno))
 			return;
 
-	/* Create a pipe for kicking the thread's select */
-	ret = pipe2(uart_sig_pipe, O_NONBLOCK);
-	if (ret < 0) {
-		perror("error making pipe!\n");
+	/* The modem lines raise no events, so poll them */
+	modem_timer = reactor_timer_add(uart_modem_cb, NULL);
+	if (modem_timer < 0) {
+		gbsim_error("can't create UART modem timer\n");
 		uart_cleanup();
 		return;
 	}
+	reactor_timer_arm(modem_timer, UART_MODEM_POLL_NS, true);
 
-	/* Init fdr thread */
-	pthread_barrier_init(&uart_barrier, 0, 2);
-	ret = pthread_create(&uart_pthread, NULL, uart_thread, NULL);
-	if (ret < 0) {
-		perror("can't create uart thread");
+	retry_timer = reactor_timer_add(uart_retry_cb, NULL);
+	if (retry_timer < 0) {
+		gbsim_error("can't create UART retry timer\n");
 		uart_cleanup();
-		return;
 	}
-	thread_started = 1;
-	pthread_barrier_wait(&uart_barrier);
 }
+
+const struct gbsim_protocol uart_protocol = {
+	.id		= GREYBUS_PROTOCOL_UART,
+	.name		= "UART",
+	.handler	= uart_handler,
+	.operations	= uart_operations,
+	.operation_count = ARRAY_SIZE(uart_operations),
+	.init		= uart_init,
+	.cleanup	= uart_cleanup,
+	.unthrottle	= uart_unthrottle,
+};